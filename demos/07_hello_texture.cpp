@@ -9,6 +9,7 @@
 #include <par/LavaDescCache.h>
 #include <par/LavaLog.h>
 #include <par/LavaPipeCache.h>
+#include <par/LavaSamplerCache.h>
 #include <par/LavaTexture.h>
 
 #define STBI_FAILURE_USERMSG
@@ -138,56 +139,41 @@ int main(const int argc, const char *argv[]) {
     texture->freeStage();
     VkImageView imageView = texture->getImageView();
 
-    // Create the sampler.
-    VkSampler sampler;
-    VkSamplerCreateInfo samplerInfo {
+    // Fetch the sampler from the cache.
+    auto samplers = LavaSamplerCache::create({ .device = device, .gpu = gpu });
+    const VkSampler sampler = samplers->getSampler({
         .sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO,
         .minFilter = VK_FILTER_LINEAR,
         .magFilter = VK_FILTER_LINEAR,
         .mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST,
         .minLod = 0.0f,
         .maxLod = 0.25f
-    };
-    vkCreateSampler(device, &samplerInfo, 0, &sampler);
-
-    // Create the descriptor set.
-    auto descriptors = LavaDescCache::create({
-        .device = device,
-        .uniformBuffers = {},
-        .imageSamplers = { {
-            .sampler = sampler,
-            .imageView = imageView,
-            .imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
-        } }
     });
+
+    // Create the descriptor set, using reflection to obtain the layout.
+    LavaDescCache::Config descConfig = program->getDescriptorConfig();
+    descConfig.imageSamplers[0] = {
+        .sampler = sampler,
+        .imageView = imageView,
+        .imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+    };
+    auto descriptors = LavaDescCache::create(descConfig);
     const VkDescriptorSetLayout dlayout = descriptors->getLayout();
     const VkDescriptorSet dset = descriptors->getDescriptor();
 
-    static_assert(sizeof(Vertex) == 16, "Unexpected vertex size.");
+    // Create the pipeline cache, using reflection to obtain the vertex layout.
+    LavaPipeCache::VertexState vertexState =
+            program->getVertexState(VK_PRIMITIVE_TOPOLOGY_TRIANGLE_STRIP);
+    LOG_CHECK(!vertexState.buffers.empty() && vertexState.buffers[0].stride == sizeof(Vertex),
+            "Unexpected vertex size.");
     auto pipelines = LavaPipeCache::create({
         .device = device,
         .descriptorLayouts = { dlayout },
         .renderPass = renderPass,
         .vshader = vshader,
         .fshader = fshader,
-        .vertex = {
-            .topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_STRIP,
-            .attributes = { {
-                .binding = 0u,
-                .format = VK_FORMAT_R32G32_SFLOAT,
-                .location = 0u,
-                .offset = 0u,
-            }, {
-                .binding = 0u,
-                .format = VK_FORMAT_R32G32_SFLOAT,
-                .location = 1u,
-                .offset = 8u,
-            } },
-            .buffers = { {
-                .binding = 0u,
-                .stride = sizeof(Vertex),
-            } }
-        }
+        .vertex = vertexState,
+        .pushConstants = program->getReflection().pushConstants,
     });
     VkPipeline pipeline = pipelines->getPipeline();
     VkPipelineLayout playout = pipelines->getLayout();
@@ -225,13 +211,15 @@ int main(const int argc, const char *argv[]) {
         vkCmdDraw(cmdbuffer, 4, 1, 0, 0);
         vkCmdEndRenderPass(cmdbuffer);
         context->endFrame();
+        samplers->releaseUnused();
     }
 
     // Wait for the command buffers to finish executing.
     context->waitFrame();
 
     // Cleanup.
-    vkDestroySampler(device, sampler, 0);
+    samplers->releaseSampler(sampler);
+    delete samplers;
     delete texture;
     delete descriptors;
     delete vertexBuffer;
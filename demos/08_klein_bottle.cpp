@@ -4,12 +4,14 @@
 #include <par/LavaLoader.h>
 
 #include <par/AmberProgram.h>
+#include <par/AmberTextureLoader.h>
 #include <par/LavaContext.h>
 #include <par/LavaCpuBuffer.h>
 #include <par/LavaDescCache.h>
 #include <par/LavaGpuBuffer.h>
 #include <par/LavaLog.h>
 #include <par/LavaPipeCache.h>
+#include <par/LavaSamplerCache.h>
 #include <par/LavaTexture.h>
 
 #include <GLFW/glfw3.h>
@@ -25,10 +27,6 @@ using namespace std;
 #define TINYOBJLOADER_IMPLEMENTATION
 #include <tiny_obj_loader.h>
 
-#define STBI_FAILURE_USERMSG
-#define STB_IMAGE_IMPLEMENTATION
-#include <stb_image.h>
-
 namespace {
     constexpr int DEMO_WIDTH = 256;
     constexpr int DEMO_HEIGHT = 256;
@@ -252,25 +250,11 @@ static Geometry load_geometry(const char* filename, VkDevice device, VkPhysicalD
     return geo;
 }
 
-static unique_ptr<LavaTexture> load_texture(char const* filename, VkDevice device,
-        VkPhysicalDevice gpu) {
-    uint32_t width, height;
-    int ok = stbi_info(filename, (int*) &width, (int*) &height, 0);
-    if (!ok) {
-        llog.error("{}: {}.", filename, stbi_failure_reason());
+static unique_ptr<LavaTexture> get_texture(const AmberTextureLoader::Future& future) {
+    LavaTexture* texture = future.get();
+    if (!texture) {
         exit(1);
     }
-    llog.info("Loading texture {:4}x{:4} {}", width, height, filename);
-    uint8_t* texels = stbi_load(filename, (int*) &width, (int*) &height, 0, 4);
-    auto texture = LavaTexture::create({
-        .device = device, .gpu = gpu,
-        .size = width * height * 4u,
-        .source = texels,
-        .width = width,
-        .height = height,
-        .format = VK_FORMAT_R8G8B8A8_UNORM,
-    });
-    stbi_image_free(texels);
     return unique_ptr<LavaTexture>(texture);
 }
 
@@ -280,13 +264,19 @@ static void run_demo(LavaContext* context, GLFWwindow* window) {
     const VkRenderPass renderPass = context->getRenderPass();
     const VkExtent2D extent = context->getSize();
 
-    // Load textures from disk.
-    auto backdrop_texture = load_texture("../extras/assets/abstract.jpg", device, gpu);
-    auto occlusion = load_texture("../extras/assets/klein.png", device, gpu);
-    auto rust = load_texture("../extras/assets/rust.png", device, gpu);
+    // Start decoding textures on worker threads.
+    auto loader = unique_ptr<AmberTextureLoader>(AmberTextureLoader::create({
+        .device = device, .gpu = gpu
+    }));
+    auto backdrop_future = loader->load("../extras/assets/abstract.jpg");
+    auto occlusion_future = loader->load("../extras/assets/klein.png");
+    auto rust_future = loader->load("../extras/assets/rust.png");
 
-    // Create the klein bottle mesh.
+    // Create the klein bottle mesh while the textures are decoding.
     auto geo = load_geometry("../extras/assets/klein.obj", device, gpu);
+    auto backdrop_texture = get_texture(backdrop_future);
+    auto occlusion = get_texture(occlusion_future);
+    auto rust = get_texture(rust_future);
 
     // Start uploading the textures and geometry.
     VkCommandBuffer workbuf = context->beginWork();
@@ -324,17 +314,16 @@ static void run_demo(LavaContext* context, GLFWwindow* window) {
     const VkBufferCopy region = { .size = sizeof(BACKDROP_VERTICES) };
     vkCmdCopyBuffer(workbuf, vboStage->getBuffer(), backdrop_vertices->getBuffer(), 1, &region);
 
-    // Create the sampler.
-    VkSampler sampler;
-    VkSamplerCreateInfo samplerInfo {
+    // Fetch the sampler from the cache.
+    auto samplers = make_unique<LavaSamplerCache>({ .device = device, .gpu = gpu });
+    const VkSampler sampler = samplers->getSampler({
         .sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO,
         .minFilter = VK_FILTER_LINEAR,
         .magFilter = VK_FILTER_LINEAR,
         .mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST,
         .minLod = 0.0f,
         .maxLod = 0.25f
-    };
-    vkCreateSampler(device, &samplerInfo, 0, &sampler);
+    });
 
     // Create the double-buffered UBO.
     LavaCpuBuffer::Config cfg {
@@ -547,15 +536,16 @@ static void run_demo(LavaContext* context, GLFWwindow* window) {
         ubo[0]->setData(&uniforms, sizeof(uniforms));
         swap(ubo[0], ubo[1]);
         context->presentRecording(frame);
+        samplers->releaseUnused();
     }
 
     // Wait for the command buffer to finish before deleting any Vulkan objects.
     context->waitRecording(frame);
 
-    // Cleanup. All Vulkan objects except the sampler and recorded command buffers are stored
-    // unique_ptr so they self-destruct when the scope ends.
+    // Cleanup. All Vulkan objects except the recorded command buffers are stored unique_ptr so
+    // they self-destruct when the scope ends.
     context->freeRecording(frame);
-    vkDestroySampler(device, sampler, 0);
+    samplers->releaseSampler(sampler);
 }
 
 int main(const int argc, const char *argv[]) {
@@ -8,8 +8,10 @@
 #include <par/LavaGpuBuffer.h>
 #include <par/LavaLog.h>
 #include <par/LavaPipeCache.h>
+#include <par/LavaSamplerCache.h>
 #include <par/LavaTexture.h>
 #include <par/AmberProgram.h>
+#include <par/AmberTextureLoader.h>
 
 #include <GLFW/glfw3.h>
 
@@ -72,25 +74,11 @@ namespace {
     }
 }
 
-static unique_ptr<LavaTexture> load_texture(char const* filename, VkDevice device,
-        VkPhysicalDevice gpu) {
-    uint32_t width, height;
-    int ok = stbi_info(filename, (int*) &width, (int*) &height, 0);
-    if (!ok) {
-        llog.error("{}: {}.", filename, stbi_failure_reason());
+static unique_ptr<LavaTexture> get_texture(const AmberTextureLoader::Future& future) {
+    LavaTexture* texture = future.get();
+    if (!texture) {
         exit(1);
     }
-    llog.info("Loading texture from {} ({}x{})", filename, width, height);
-    uint8_t* texels = stbi_load(filename, (int*) &width, (int*) &height, 0, 4);
-    auto texture = LavaTexture::create({
-        .device = device, .gpu = gpu,
-        .size = width * height * 4u,
-        .source = texels,
-        .width = width,
-        .height = height,
-        .format = VK_FORMAT_R8G8B8A8_UNORM,
-    });
-    stbi_image_free(texels);
     return unique_ptr<LavaTexture>(texture);
 }
 
@@ -100,6 +88,10 @@ static void run_demo(LavaContext* context, GLFWwindow* window) {
     const VkRenderPass renderPass = context->getRenderPass();
     const VkExtent2D extent = context->getSize();
 
+    // Start decoding the backdrop texture on a worker thread.
+    auto loader = make_unique<AmberTextureLoader>({ .device = device, .gpu = gpu });
+    auto particles2_future = loader->load("../extras/assets/particles2.jpg");
+
     // Fetch the bluenoise data.
     par_easycurl_init(0);
     #define BLUENOISE_BASEURL "http://github.prideout.net/assets/"
@@ -239,9 +231,9 @@ static void run_demo(LavaContext* context, GLFWwindow* window) {
         return vbo;
     }("../extras/assets/particles1.png");
 
-    // Load textures from disk.
+    // Upload the backdrop texture, which has been decoding while the points were generated.
     VkCommandBuffer workbuf = context->beginWork();
-    auto particles2_texture = load_texture("../extras/assets/particles2.jpg", device, gpu);
+    auto particles2_texture = get_texture(particles2_future);
     particles2_texture->uploadStage(workbuf);
 
     // Create the backdrop mesh.
@@ -261,17 +253,16 @@ static void run_demo(LavaContext* context, GLFWwindow* window) {
     const VkBufferCopy region = { .size = sizeof(BACKDROP_VERTICES) };
     vkCmdCopyBuffer(workbuf, vboStage->getBuffer(), backdrop_vertices->getBuffer(), 1, &region);
 
-    // Create the sampler.
-    VkSampler sampler;
-    VkSamplerCreateInfo samplerInfo {
+    // Fetch the sampler from the cache.
+    auto samplers = make_unique<LavaSamplerCache>({ .device = device, .gpu = gpu });
+    const VkSampler sampler = samplers->getSampler({
         .sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO,
         .minFilter = VK_FILTER_LINEAR,
         .magFilter = VK_FILTER_LINEAR,
         .mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST,
         .minLod = 0.0f,
         .maxLod = 0.25f
-    };
-    vkCreateSampler(device, &samplerInfo, 0, &sampler);
+    });
 
     // Create the double-buffered UBO.
     unique_ptr<LavaCpuBuffer> ubo[2];
@@ -477,18 +468,19 @@ static void run_demo(LavaContext* context, GLFWwindow* window) {
             ubo[0]->setData(&uniforms, sizeof(uniforms));
             swap(ubo[0], ubo[1]);
             context->presentRecording(frame);
+            samplers->releaseUnused();
             backdrop_program->checkDirectory();
         }
 
         // Wait for the command buffer to finish before deleting any Vulkan objects.
         context->waitRecording(frame);
 
-        // Cleanup. All Vulkan objects except the sampler and recorded command buffers are stored
-        // unique_ptr so they self-destruct when the scope ends.
+        // Cleanup. All Vulkan objects except the recorded command buffers are stored unique_ptr so
+        // they self-destruct when the scope ends.
         context->freeRecording(frame);
     }
 
-    vkDestroySampler(device, sampler, 0);
+    samplers->releaseSampler(sampler);
 }
 
 int main(const int argc, const char *argv[]) {
@@ -8,6 +8,7 @@
 #include <par/LavaGpuBuffer.h>
 #include <par/LavaLog.h>
 #include <par/LavaPipeCache.h>
+#include <par/LavaSamplerCache.h>
 #include <par/LavaTexture.h>
 #include <par/AmberProgram.h>
 
@@ -176,17 +177,16 @@ static void run_demo(LavaContext* context, GLFWwindow* window) {
     const VkBufferCopy region = { .size = sizeof(BACKDROP_VERTICES) };
     vkCmdCopyBuffer(workbuf, vboStage->getBuffer(), backdrop_vertices->getBuffer(), 1, &region);
 
-    // Create the sampler.
-    VkSampler sampler;
-    VkSamplerCreateInfo samplerInfo {
+    // Fetch the sampler from the cache.
+    auto samplers = make_unique<LavaSamplerCache>({ .device = device, .gpu = gpu });
+    const VkSampler sampler = samplers->getSampler({
         .sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO,
         .minFilter = VK_FILTER_LINEAR,
         .magFilter = VK_FILTER_LINEAR,
         .mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST,
         .minLod = 0.0f,
         .maxLod = 0.25f
-    };
-    vkCreateSampler(device, &samplerInfo, 0, &sampler);
+    });
 
     // Create the double-buffered UBO.
     unique_ptr<LavaCpuBuffer> ubo[2];
@@ -387,18 +387,19 @@ static void run_demo(LavaContext* context, GLFWwindow* window) {
             ubo[0]->setData(&uniforms, sizeof(uniforms));
             swap(ubo[0], ubo[1]);
             context->presentRecording(frame);
+            samplers->releaseUnused();
             backdrop_program->checkDirectory();
         }
 
         // Wait for the command buffer to finish before deleting any Vulkan objects.
         context->waitRecording(frame);
 
-        // Cleanup. All Vulkan objects except the sampler and recorded command buffers are stored
-        // unique_ptr so they self-destruct when the scope ends.
+        // Cleanup. All Vulkan objects except the recorded command buffers are stored unique_ptr so
+        // they self-destruct when the scope ends.
         context->freeRecording(frame);
     }
 
-    vkDestroySampler(device, sampler, 0);
+    samplers->releaseSampler(sampler);
 }
 
 int main(const int argc, const char *argv[]) {
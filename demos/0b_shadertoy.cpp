@@ -8,6 +8,7 @@
 
 #include <par/AmberApplication.h>
 #include <par/AmberProgram.h>
+#include <par/AmberShaderReloader.h>
 
 #include "vmath.h"
 
@@ -36,8 +37,10 @@ namespace {
         ShaderToyApp(SurfaceFn createSurface);
         ~ShaderToyApp();
         void draw(double seconds) override;
+        void recordCommands();
         LavaContext* mContext;
         AmberProgram* mProgram;
+        AmberShaderReloader* mReloader;
         LavaGpuBuffer* mVertexBuffer;
         LavaRecording* mRecording;
         LavaPipeCache* mPipelines;
@@ -132,13 +135,24 @@ ShaderToyApp::ShaderToyApp(SurfaceFn createSurface) {
             } }
         }
     });
-    VkPipeline pipeline = mPipelines->getPipeline();
-    VkPipelineLayout playout = mPipelines->getLayout();
 
     // Finish populating the vertex buffer.
     mContext->waitWork();
     delete stage;
 
+    // Recompile the shaders and re-record the command buffers whenever this file changes.
+    mReloader = AmberShaderReloader::create({ .device = device });
+    mReloader->addProgram(mProgram, __FILE__, "shadertoy.vs", "shadertoy.fs", mPipelines);
+
+    recordCommands();
+}
+
+void ShaderToyApp::recordCommands() {
+    const auto renderPass = mContext->getRenderPass();
+    const auto extent = mContext->getSize();
+    const VkPipeline pipeline = mPipelines->getPipeline();
+    const VkPipelineLayout playout = mPipelines->getLayout();
+
     // Fill in some structs that will be used when rendering.
     const VkClearValue clearValue = { .color.float32 = {} };
     const VkViewport viewport = {
@@ -179,6 +193,7 @@ ShaderToyApp::ShaderToyApp(SurfaceFn createSurface) {
 ShaderToyApp::~ShaderToyApp() {
     mContext->waitRecording(mRecording);
     mContext->freeRecording(mRecording);
+    delete mReloader;
     delete mUniforms[0];
     delete mUniforms[1];
     delete mDescriptors;
@@ -189,6 +204,11 @@ ShaderToyApp::~ShaderToyApp() {
 }
 
 void ShaderToyApp::draw(double time) {
+    mReloader->update([this] (AmberProgram*) {
+        mContext->waitRecording(mRecording);
+        mContext->freeRecording(mRecording);
+        recordCommands();
+    });
     Uniforms uniforms {
         .iResolution = {1794, 1080, 0, 0},
         .iTime = (float) time
@@ -196,6 +216,11 @@ void ShaderToyApp::draw(double time) {
     mUniforms[0]->setData(&uniforms, sizeof(uniforms));
     mContext->presentRecording(mRecording);
     swap(mUniforms[0], mUniforms[1]);
+
+    // The recorded command buffers bind the current pipeline, so mark it as used before evicting
+    // stale pipelines and destroying the ones that were replaced by hot reloading.
+    mPipelines->getPipeline();
+    mPipelines->releaseUnused(1000);
 }
 
 static AmberApplication::Register app("shadertoy", [] (AmberApplication::SurfaceFn cb) {
@@ -6,6 +6,7 @@
 #include <par/LavaGpuBuffer.h>
 #include <par/LavaLog.h>
 #include <par/LavaPipeCache.h>
+#include <par/LavaSamplerCache.h>
 #include <par/LavaSurfCache.h>
 
 #include <par/AmberApplication.h>
@@ -49,6 +50,7 @@ struct FramebufferApp : AmberApplication {
     VkExtent2D mResolution;
     LavaSurfCache* mSurfaces;
     LavaSurface mOffscreenSurface;
+    LavaSamplerCache* mSamplers;
     VkSampler mSampler;
 };
 
@@ -118,16 +120,16 @@ FramebufferApp::FramebufferApp(SurfaceFn createSurface) {
     mUniforms[0] = LavaCpuBuffer::create(cfg);
     mUniforms[1] = LavaCpuBuffer::create(cfg);
 
-    // Create the sampler.
-    VkSamplerCreateInfo samplerInfo {
+    // Fetch the sampler from the cache.
+    mSamplers = LavaSamplerCache::create({ .device = device, .gpu = gpu });
+    mSampler = mSamplers->getSampler({
         .sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO,
         .minFilter = VK_FILTER_LINEAR,
         .magFilter = VK_FILTER_LINEAR,
         .mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST,
         .minLod = 0.0f,
         .maxLod = 0.25f
-    };
-    vkCreateSampler(device, &samplerInfo, 0, &mSampler);
+    });
 
     // Create the descriptor set.
     mDescriptors = LavaDescCache::create({
@@ -222,7 +224,8 @@ FramebufferApp::~FramebufferApp() {
     mContext->waitRecording(mRecording);
     mContext->freeRecording(mRecording);
     mSurfaces->freeAttachment(mOffscreenSurface.color);
-    vkDestroySampler(mContext->getDevice(), mSampler, 0);
+    mSamplers->releaseSampler(mSampler);
+    delete mSamplers;
     delete mSurfaces;
     delete mUniforms[0];
     delete mUniforms[1];
@@ -242,6 +245,13 @@ void FramebufferApp::draw(double time) {
     mUniforms[0]->setData(&uniforms, sizeof(uniforms));
     mContext->presentRecording(mRecording);
     swap(mUniforms[0], mUniforms[1]);
+
+    // The recorded command buffers refer to the offscreen framebuffer, so mark it as used before
+    // releasing stale framebuffers and recycling freed attachments.
+    mSurfaces->getRenderPass(mOffscreenSurface);
+    mSurfaces->getFramebuffer(mOffscreenSurface);
+    mSurfaces->releaseUnused(1000);
+    mSamplers->releaseUnused();
 }
 
 static AmberApplication::Register prefs({
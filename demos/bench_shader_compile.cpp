@@ -0,0 +1,152 @@
+// The MIT License
+// Copyright (c) 2018 Philip Rideout
+
+// Measures how AmberCompiler::compileBatch scales with the number of worker threads.
+//
+// Usage: bench_shader_compile [folder] [repetitions]
+//
+// Gathers the GLSL from every demo in the folder (defaults to ../demos), both inline strings and
+// chunks, then compiles all of them with 1, 2, 4, ... threads, up to the number of hardware
+// threads. The SPIR-V cache is disabled so that every shader goes through glslang. Reports shaders
+// per second and the speedup relative to a single thread, followed by the effect of the optimizer.
+
+#include <par/LavaLoader.h>
+
+#include <par/AmberCompiler.h>
+#include <par/AmberProgram.h>
+#include <par/LavaLog.h>
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <dirent.h>
+#include <string.h>
+
+using namespace par;
+using namespace std;
+
+namespace {
+    constexpr char const* DEFAULT_FOLDER = "../demos";
+    constexpr char const* INLINE_PREFIX = "AMBER_PREFIX_450 R\"";
+
+    using Job = AmberCompiler::Job;
+
+    vector<string> listSources(const string& folder) {
+        vector<string> filenames;
+        DIR* dir = opendir(folder.c_str());
+        if (!dir) {
+            return filenames;
+        }
+        while (dirent* entry = readdir(dir)) {
+            const size_t len = strlen(entry->d_name);
+            if (len > 4 && !strcmp(entry->d_name + len - 4, ".cpp") &&
+                    strncmp(entry->d_name, "bench_", 6)) {
+                filenames.push_back(folder + "/" + entry->d_name);
+            }
+        }
+        closedir(dir);
+        sort(filenames.begin(), filenames.end());
+        return filenames;
+    }
+
+    // Finds raw string literals that follow AMBER_PREFIX_450, and infers the stage from the name of
+    // the variable they are assigned to.
+    void gatherInlineShaders(const string& source, vector<Job>* jobs) {
+        for (size_t pos = source.find(INLINE_PREFIX); pos != string::npos;
+                pos = source.find(INLINE_PREFIX, pos + 1)) {
+            const size_t lineStart = source.rfind('\n', pos) + 1;
+            string name = source.substr(lineStart, pos - lineStart);
+            transform(name.begin(), name.end(), name.begin(), ::tolower);
+            const bool vertex = name.find("vert") != string::npos ||
+                    name.find("vshader") != string::npos;
+            const bool fragment = name.find("frag") != string::npos ||
+                    name.find("fshader") != string::npos;
+            const size_t open = pos + strlen(INLINE_PREFIX);
+            const size_t paren = source.find('(', open);
+            const string terminator = ")" + source.substr(open, paren - open) + "\"";
+            const size_t close = source.find(terminator, paren);
+            if (close == string::npos || vertex == fragment) {
+                continue;
+            }
+            jobs->push_back({
+                .stage = vertex ? AmberCompiler::VERTEX : AmberCompiler::FRAGMENT,
+                .glsl = "#version 450\n" + source.substr(paren + 1, close - paren - 1)
+            });
+        }
+    }
+
+    // Finds chunks named "*.vs", "*.fs" or "*.cs" and extracts them with AmberProgram::getChunk.
+    void gatherChunks(const string& filename, const string& source, vector<Job>* jobs) {
+        istringstream lines(source);
+        for (string line; getline(lines, line);) {
+            if (line.compare(0, 3, "-- ")) {
+                continue;
+            }
+            const string name = line.substr(3, line.find(' ', 3) - 3);
+            const bool vertex = name.size() > 3 && !name.compare(name.size() - 3, 3, ".vs");
+            const bool fragment = name.size() > 3 && !name.compare(name.size() - 3, 3, ".fs");
+            const bool compute = name.size() > 3 && !name.compare(name.size() - 3, 3, ".cs");
+            if (vertex || fragment || compute) {
+                jobs->push_back({
+                    .stage = vertex ? AmberCompiler::VERTEX :
+                            fragment ? AmberCompiler::FRAGMENT : AmberCompiler::COMPUTE,
+                    .glsl = AmberProgram::getChunk(filename, name)
+                });
+            }
+        }
+    }
+}
+
+int main(const int argc, const char *argv[]) {
+    const string folder = argc > 1 ? argv[1] : DEFAULT_FOLDER;
+    const uint32_t repetitions = argc > 2 ? std::max(atoi(argv[2]), 1) : 4;
+
+    vector<Job> shaders;
+    for (const auto& filename : listSources(folder)) {
+        ifstream file(filename);
+        stringstream contents;
+        contents << file.rdbuf();
+        gatherInlineShaders(contents.str(), &shaders);
+        gatherChunks(filename, contents.str(), &shaders);
+    }
+    if (shaders.empty()) {
+        llog.error("No shaders found in {}.", folder);
+        return 1;
+    }
+    llog.info("Compiling {} shaders from {}, {} times per run.", shaders.size(), folder,
+            repetitions);
+
+    AmberCompiler::setCacheFolder("");
+    const uint32_t maxThreads = std::max(thread::hardware_concurrency(), 1u);
+    double baseline = 0;
+    for (uint32_t nthreads = 1;; nthreads = std::min(nthreads * 2, maxThreads)) {
+        vector<Job> jobs;
+        for (uint32_t rep = 0; rep < repetitions; rep++) {
+            jobs.insert(jobs.end(), shaders.begin(), shaders.end());
+        }
+        const auto start = chrono::high_resolution_clock::now();
+        const bool success = AmberCompiler::compileBatch(&jobs, nthreads);
+        const auto end = chrono::high_resolution_clock::now();
+        const double seconds = chrono::duration<double>(end - start).count();
+        if (!success) {
+            llog.error("Some shaders failed to compile.");
+            return 1;
+        }
+        baseline = nthreads == 1 ? seconds : baseline;
+        llog.info("{:2} threads: {:7.1f} shaders/s {:5.2f}x", nthreads, jobs.size() / seconds,
+                baseline / seconds);
+        if (nthreads == maxThreads) {
+            break;
+        }
+    }
+    const AmberCompiler::Stats stats = AmberCompiler::getStats();
+    llog.info("Optimized SPIR-V from {} to {} bytes, spending {:.1f}% of compile time.",
+            stats.unoptimizedBytes, stats.optimizedBytes,
+            100.0 * stats.optimizeSeconds / stats.compileSeconds);
+    return 0;
+}
@@ -0,0 +1,140 @@
+// The MIT License
+// Copyright (c) 2018 Philip Rideout
+
+// Measures how AmberTextureLoader throughput scales with the number of worker threads.
+//
+// Usage: bench_texture_loader [folder] [repetitions]
+//
+// Loads every image in the folder (defaults to ../extras/assets) using 1, 2, 4, ... threads, up to
+// the number of hardware threads, and reports images per second, megabytes of staged texels per
+// second, and the speedup relative to a single thread.
+
+#include <par/LavaLoader.h>
+
+#include <par/AmberTextureLoader.h>
+#include <par/LavaContext.h>
+#include <par/LavaLog.h>
+#include <par/LavaTexture.h>
+
+#include <GLFW/glfw3.h>
+
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <dirent.h>
+#include <string.h>
+#include <strings.h>
+
+using namespace par;
+using namespace std;
+
+namespace {
+    constexpr char const* DEFAULT_FOLDER = "../extras/assets";
+    constexpr char const* EXTENSIONS[] = {
+        ".jpg", ".jpeg", ".png", ".tga", ".bmp", ".ktx", ".ktx2"
+    };
+
+    bool isImage(const string& filename) {
+        for (char const* ext : EXTENSIONS) {
+            const size_t len = strlen(ext);
+            if (filename.size() > len &&
+                    !strcasecmp(filename.c_str() + filename.size() - len, ext)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    vector<string> listImages(const string& folder) {
+        vector<string> filenames;
+        DIR* dir = opendir(folder.c_str());
+        if (!dir) {
+            return filenames;
+        }
+        while (dirent* entry = readdir(dir)) {
+            if (isImage(entry->d_name)) {
+                filenames.push_back(folder + "/" + entry->d_name);
+            }
+        }
+        closedir(dir);
+        return filenames;
+    }
+}
+
+static void run_benchmark(LavaContext* context, const vector<string>& filenames,
+        uint32_t repetitions) {
+    const VkDevice device = context->getDevice();
+    const VkPhysicalDevice gpu = context->getGpu();
+    const uint32_t maxThreads = std::max(thread::hardware_concurrency(), 1u);
+    double baseline = 0;
+    for (uint32_t nthreads = 1;; nthreads = std::min(nthreads * 2, maxThreads)) {
+        auto loader = AmberTextureLoader::create({
+            .device = device, .gpu = gpu,
+            .threadCount = nthreads
+        });
+        vector<AmberTextureLoader::Future> futures;
+        const auto start = chrono::high_resolution_clock::now();
+        for (uint32_t rep = 0; rep < repetitions; rep++) {
+            for (const auto& filename : filenames) {
+                futures.push_back(loader->load(filename));
+            }
+        }
+        loader->wait();
+        const auto end = chrono::high_resolution_clock::now();
+        const double seconds = chrono::duration<double>(end - start).count();
+
+        uint64_t texels = 0;
+        for (auto& future : futures) {
+            LavaTexture* texture = future.get();
+            if (texture) {
+                const VkExtent3D extent = texture->getExtent();
+                texels += extent.width * extent.height;
+            }
+            delete texture;
+        }
+        delete loader;
+
+        baseline = nthreads == 1 ? seconds : baseline;
+        llog.info("{:2} threads: {:7.1f} images/s {:8.1f} MB/s {:5.2f}x", nthreads,
+                futures.size() / seconds, texels * 4.0 / seconds / (1024 * 1024),
+                baseline / seconds);
+        if (nthreads == maxThreads) {
+            break;
+        }
+    }
+}
+
+int main(const int argc, const char *argv[]) {
+    const string folder = argc > 1 ? argv[1] : DEFAULT_FOLDER;
+    const uint32_t repetitions = argc > 2 ? std::max(atoi(argv[2]), 1) : 4;
+    const vector<string> filenames = listImages(folder);
+    if (filenames.empty()) {
+        llog.error("No images found in {}.", folder);
+        return 1;
+    }
+    llog.info("Loading {} images from {}, {} times per run.", filenames.size(), folder,
+            repetitions);
+
+    // The swap chain is never presented, but LavaContext requires a surface.
+    glfwInit();
+    glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
+    glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+    GLFWwindow* window = glfwCreateWindow(64, 64, "bench", 0, 0);
+    LavaContext* context = LavaContext::create({
+        .depthBuffer = false,
+        .validation = false,
+        .samples = VK_SAMPLE_COUNT_1_BIT,
+        .createSurface = [window] (VkInstance instance) {
+            VkSurfaceKHR surface;
+            glfwCreateWindowSurface(instance, window, nullptr, &surface);
+            return surface;
+        }
+    });
+    run_benchmark(context, filenames, repetitions);
+    delete context;
+    glfwDestroyWindow(window);
+    glfwTerminate();
+    return 0;
+}
@@ -3,17 +3,109 @@
 
 #pragma once
 
+#include <functional>
 #include <string>
 #include <vector>
 
+#include <vulkan/vulkan.h>
+
 namespace par {
 
+// Compiles GLSL into SPIR-V using glslang.
+//
+// Results are stored in an on-disk cache, with filenames derived from a hash of the GLSL, the
+// stage, the glslang version, and the resource limits. A cached shader is returned without
+// initializing glslang, which avoids the cost of parsing and linking on every startup.
+//
+// Compilers may be used from multiple threads, and glslang is initialized and finalized safely
+// when compilers are created and destroyed concurrently.
 class AmberCompiler {
 public:
     static AmberCompiler* create() noexcept;
     static void operator delete(void* ptr) noexcept;
     enum Stage { VERTEX, FRAGMENT, COMPUTE };
     bool compile(Stage stage, const std::string& glsl, std::vector<uint32_t>* spirv) const noexcept;
+
+    // Compiles many shaders concurrently, using the given number of threads (defaults to the number
+    // of hardware threads), one of which is the calling thread. The optional callback receives the
+    // index of each job as soon as it is done, and may be invoked from any of these threads.
+    // Returns true if every job succeeded.
+    struct Job {
+        Stage stage;
+        std::string glsl;
+        std::vector<uint32_t> spirv;
+        bool success;
+    };
+    using JobFn = std::function<void(uint32_t index)>;
+    static bool compileBatch(std::vector<Job>* jobs, uint32_t threadCount = 0,
+            JobFn onComplete = nullptr) noexcept;
+
+    // Describes the interface of a SPIR-V module: its descriptor bindings, push constant ranges,
+    // vertex inputs (for vertex shaders), and workgroup size (for compute shaders). If the shader
+    // declares its workgroup size with local_size_x_id et al, localSize holds the default values
+    // and localSizeIds holds the constant IDs. Other scalar specialization constants are listed
+    // with their default values. Vertex input formats are inferred from the GLSL type, so
+    // normalized integer formats cannot be detected.
+    struct Reflection {
+        struct Binding {
+            uint32_t set;
+            uint32_t binding;
+            VkDescriptorType type;
+            uint32_t count;
+            VkShaderStageFlags stages;
+        };
+        struct Input {
+            uint32_t location;
+            VkFormat format;
+        };
+        struct Constant {
+            uint32_t id;
+            uint32_t defaultValue;                      // Raw bits; booleans are 0 or 1.
+        };
+        std::vector<Binding> bindings;                  // Sorted by set, then by binding.
+        std::vector<VkPushConstantRange> pushConstants;
+        std::vector<Input> inputs;                      // Sorted by location.
+        std::vector<Constant> constants;                // Specialization constants, sorted by id.
+        uint32_t localSize[3];
+        uint32_t localSizeIds[3];                       // Specialization constant IDs, or ~0u.
+    };
+    static bool reflect(Stage stage, const std::vector<uint32_t>& spirv,
+            Reflection* reflection) noexcept;
+
+    // Shrinks SPIR-V in place without changing its behavior. Debug info includes names, source
+    // text and line numbers. Dead code consists of types, constants, global variables and functions
+    // that are not reachable from an entry point, along with their decorations. Builtins and
+    // resource variables with a binding are always kept, so reflection sees every declared
+    // descriptor. Constant folding and inlining are left to glslang's front end and to the driver.
+    enum Optimization : uint32_t {
+        STRIP_DEBUG_INFO = 1 << 0,
+        REMOVE_DEAD_CODE = 1 << 1,
+    };
+    static bool optimize(std::vector<uint32_t>* spirv, uint32_t optimizations) noexcept;
+
+    // Sets the optimizations that are applied to newly compiled SPIR-V before it is cached. This
+    // is shared by all compilers in the process, and is part of the cache key. By default, dead
+    // code is always removed, and debug info is stripped from release builds (when NDEBUG is
+    // defined). Zero disables optimization.
+    static void setOptimizations(uint32_t optimizations) noexcept;
+
+    // Sets the folder for cached SPIR-V, which is created on demand. This is shared by all
+    // compilers in the process. An empty string disables the cache, which is the default on
+    // Android. On other platforms, the default is ".amber_cache" in the working directory.
+    static void setCacheFolder(const std::string& folder) noexcept;
+
+    // Cumulative statistics for all compilers in the process.
+    struct Stats {
+        uint32_t hits;
+        uint32_t misses;
+        double loadSeconds;     // Time spent reading the cache, including misses.
+        double compileSeconds;  // Time spent in glslang after cache misses.
+        double optimizeSeconds; // Time spent in AmberCompiler::optimize after cache misses.
+        uint64_t unoptimizedBytes;
+        uint64_t optimizedBytes;
+    };
+    static Stats getStats() noexcept;
+
 protected:
     AmberCompiler() noexcept = default;
     // par::noncopyable
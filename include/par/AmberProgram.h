@@ -3,8 +3,13 @@
 
 #pragma once
 
+#include <par/AmberCompiler.h>
+#include <par/LavaDescCache.h>
+#include <par/LavaPipeCache.h>
+
 #include <functional>
 #include <string>
+#include <vector>
 
 #include <vulkan/vulkan.h>
 
@@ -14,13 +19,72 @@ class AmberProgram {
 public:
     using string = std::string;
     static AmberProgram* create(const string& vshader, const string& fshader) noexcept;
+
+    // Creates a program with a single compute stage. Compute programs are compiled (individually
+    // or with compileBatch) and reflected just like graphics programs.
+    static AmberProgram* createCompute(const string& cshader) noexcept;
     static void operator delete(void* ptr) noexcept;
     bool compile(VkDevice device) noexcept;
+
+    // Compiles the shaders of many programs concurrently (see AmberCompiler::compileBatch). Each
+    // shader module is created as soon as its SPIR-V is ready. The optional callback is invoked
+    // once all modules for a given program exist, and may be called from any worker thread.
+    // Returns true if every program was successfully compiled.
+    using ProgramFn = std::function<void(AmberProgram*)>;
+    static bool compileBatch(VkDevice device, AmberProgram* const* programs, uint32_t count,
+            uint32_t threadCount = 0, ProgramFn onCompiled = nullptr) noexcept;
     VkShaderModule getVertexShader() const noexcept;
     VkShaderModule getFragmentShader() const noexcept;
+    VkShaderModule getComputeShader() const noexcept;
+
+    // Returns a permutation of this program whose GLSL is preceded by the given macros, each of
+    // which is either a name or a name followed by a value, such as "USE_FOG" or "NUM_LIGHTS 4".
+    // Variants are created on demand and owned by this program. Requests with the same set of
+    // macros (in any order) return the same variant, which is compiled at most once, and only
+    // when the client calls compile or compileBatch on it. Compiled SPIR-V is also shared
+    // across runs via the AmberCompiler cache.
+    //
+    // Features that can be toggled at runtime are better expressed as specialization constants
+    // (layout(constant_id = N) in GLSL), which keep a single variant and module, and defer the
+    // cost to pipeline creation. See LavaPipeCache::setSpecializationInfo and the constants
+    // listed by getReflection.
+    AmberProgram* getVariant(const std::vector<string>& defines) noexcept;
+    uint32_t getVariantCount() const noexcept;
+
+    // Creates a compute pipeline for a compiled compute program, which the caller must destroy.
+    // If the shader declares its workgroup size with specialization constants, for example
+    // layout(local_size_x_id = 0, local_size_y_id = 1) in, then the optional localSize array
+    // overrides these dimensions. Without overrides, the sizes declared in the shader are used.
+    VkPipeline createComputePipeline(VkPipelineLayout layout,
+            const uint32_t* localSize = nullptr) const noexcept;
+
+    // Describes the interface of the compiled program by merging the reflection of each stage
+    // (see AmberCompiler::reflect). Bindings and push constant ranges that appear in several
+    // stages are reported once, with the union of their stage flags. Hot-reloaded modules are
+    // assumed to keep the interface that the program was originally compiled with.
+    AmberCompiler::Reflection getReflection() const noexcept;
+
+    // Returns a configuration for LavaDescCache that matches descriptor set 0, with tightly packed
+    // stage flags. The buffer and image entries are null placeholders that should be filled in by
+    // the client. LavaDescCache assigns binding numbers sequentially, starting with uniform
+    // buffers, then combined image samplers, then input attachments, so the shader must follow
+    // the same convention.
+    LavaDescCache::Config getDescriptorConfig() const noexcept;
+
+    // Returns a vertex state with one attribute per vertex shader input, tightly packed in
+    // location order. Interleaved attributes share buffer binding 0, otherwise each attribute is
+    // sourced from its own buffer binding. Inputs without a single-attribute vertex format, such
+    // as matrices, doubles and 8- or 16-bit types, are skipped with an error.
+    LavaPipeCache::VertexState getVertexState(VkPrimitiveTopology topology,
+            bool interleaved = true) const noexcept;
+
+    // Adopts new shader modules and destroys the old ones, leaving a stage alone if its module is
+    // null. The program must have been compiled. Used by AmberShaderReloader.
+    void replaceShaders(VkShaderModule vshader, VkShaderModule fshader) noexcept;
 
     // Extracts a range of text from a file, spanning from "-- chunkName" until the next "--", or
-    // until the end of the file.
+    // until the end of the file. Each file is memory-mapped and indexed once, and re-indexed only
+    // if its modification time changes, so repeated lookups do not re-read the file.
     static string getChunk(const string& filename, const string& chunkName) noexcept;
 
     // Monitors a folder for changes. Useful for hot-loading.
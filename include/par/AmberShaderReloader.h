@@ -0,0 +1,52 @@
+// The MIT License
+// Copyright (c) 2018 Philip Rideout
+
+#pragma once
+
+#include <functional>
+#include <string>
+
+#include <vulkan/vulkan.h>
+
+namespace par {
+
+class AmberProgram;
+class LavaPipeCache;
+
+// Recompiles shaders whose chunk files have changed, without restarting the app.
+//
+// Each registered program remembers the file and chunk names that its GLSL came from. When the
+// modification time of a file changes, its chunks are extracted again and only the stages whose
+// text differs are recompiled, on a worker thread. Once the new modules are ready, update() swaps
+// them into the program and into its LavaPipeCache (see LavaPipeCache::replaceShader), which
+// defers destruction of the old pipelines until they are out of flight.
+//
+class AmberShaderReloader {
+public:
+    using string = std::string;
+    struct Config {
+        VkDevice device;
+    };
+    static AmberShaderReloader* create(Config config) noexcept;
+    static void operator delete(void* ptr) noexcept;
+
+    // Watches the given chunks of a file on behalf of a compiled program. The pipeline cache is
+    // optional; if provided, it receives the new modules.
+    void addProgram(AmberProgram* program, const string& filename, const string& vchunk,
+            const string& fchunk, LavaPipeCache* pipelines = nullptr) noexcept;
+    void removeProgram(AmberProgram* program) noexcept;
+
+    // Polls the watched files (at most a few times per second) and swaps in any modules that have
+    // finished compiling. The callback is invoked for each program that has new modules, which
+    // is useful for re-recording command buffers. Call this once per frame from the render thread.
+    using ReloadFn = std::function<void(AmberProgram*)>;
+    uint32_t update(ReloadFn onReload = nullptr) noexcept;
+
+protected:
+    AmberShaderReloader() noexcept = default;
+    // par::noncopyable
+    AmberShaderReloader(AmberShaderReloader const&) = delete;
+    AmberShaderReloader& operator=(AmberShaderReloader const&) = delete;
+};
+
+}
@@ -0,0 +1,56 @@
+// The MIT License
+// Copyright (c) 2018 Philip Rideout
+
+#pragma once
+
+#include <future>
+#include <string>
+
+#include <vulkan/vulkan.h>
+
+namespace par {
+
+class LavaTexture;
+
+// Loads image files into LavaTexture objects on a pool of worker threads.
+//
+// KTX and KTX2 files are loaded with LavaTexture::createFromKtx. Other files (JPEG, PNG, etc) are
+// decoded to RGBA8 with stb_image and written into the mapped staging area of a new texture. Each
+// call to load() returns a future that becomes ready once the texels are staged; the render
+// thread then records uploadStage for every texture that is ready. The caller owns the textures.
+//
+class AmberTextureLoader {
+public:
+    using string = std::string;
+    struct Config {
+        VkDevice device;
+        VkPhysicalDevice gpu;
+        uint32_t threadCount;   // Defaults to the number of hardware threads.
+        VkFormat format;        // Format for non-KTX files, defaults to VK_FORMAT_R8G8B8A8_UNORM.
+        bool generateMipmaps;   // Applies to non-KTX files.
+    };
+    using Future = std::shared_future<LavaTexture*>;
+
+    static AmberTextureLoader* create(Config config) noexcept;
+    static void operator delete(void* ptr) noexcept;
+
+    // Enqueues a file and returns a future for its texture, which is null if the file could not be
+    // loaded. Files are loaded in the order they are enqueued.
+    Future load(const string& filename) noexcept;
+
+    // Returns true if the future is ready, without blocking.
+    static bool isReady(const Future& future) noexcept;
+
+    // Blocks until every enqueued file has been loaded.
+    void wait() noexcept;
+
+    uint32_t getThreadCount() const noexcept;
+
+protected:
+    AmberTextureLoader() noexcept = default;
+    // par::noncopyable
+    AmberTextureLoader(AmberTextureLoader const&) = delete;
+    AmberTextureLoader& operator=(AmberTextureLoader const&) = delete;
+};
+
+}
@@ -0,0 +1,62 @@
+// The MIT License
+// Copyright (c) 2018 Philip Rideout
+
+#pragma once
+
+#include <vulkan/vulkan.h>
+
+namespace par {
+
+// Sub-allocates typed ranges out of a few large device-local buffers.
+//
+// Each kind of range (vertex, index, uniform, storage) has its own list of VkBuffer blocks, so
+// ranges of the same kind can share a single binding and be merged into indirect draws. Ranges are
+// carved out with a two-level segregated fit (TLSF) allocator in constant time. Freed ranges are
+// not reused until releaseUnused() has been called enough times to ensure that the GPU is no
+// longer reading them.
+//
+class LavaBufferHeap {
+public:
+    enum Kind { VERTEX, INDEX, UNIFORM, STORAGE };
+    struct Config {
+        VkDevice device;
+        VkPhysicalDevice gpu;
+        uint32_t blockSize;  // Size of each VkBuffer in bytes, defaults to 64 MiB.
+    };
+    struct Range {
+        VkBuffer buffer;
+        uint32_t offset;
+        uint32_t size;
+        uint64_t handle;     // Opaque identifier that should be passed to free().
+    };
+    struct Stats {
+        uint64_t blockBytes;
+        uint64_t usedBytes;
+        uint32_t blockCount;
+        uint32_t rangeCount;
+    };
+    static LavaBufferHeap* create(Config config) noexcept;
+    static void operator delete(void* );
+
+    // Returns a range whose offset is suitably aligned for the given kind. All buffers are created
+    // with VK_BUFFER_USAGE_TRANSFER_DST_BIT so that they can be filled using LavaUploader. Storage
+    // buffers can also be used as indirect draw buffers.
+    Range allocate(Kind kind, uint32_t size) noexcept;
+
+    // Schedules the range for reuse. The range must not be referenced by any command buffer that
+    // is recorded after this call.
+    void free(const Range& range) noexcept;
+
+    // Recycles ranges that were freed at least two calls ago. Call this once per frame.
+    void releaseUnused() noexcept;
+
+    Stats getStats() const noexcept;
+
+protected:
+    LavaBufferHeap() noexcept = default;
+    // par::noncopyable
+    LavaBufferHeap(LavaBufferHeap const&) = delete;
+    LavaBufferHeap& operator=(LavaBufferHeap const&) = delete;
+};
+
+}
@@ -4,6 +4,7 @@
 #pragma once
 
 #include <functional>
+#include <string>
 
 #include <vulkan/vulkan.h>
 
@@ -20,6 +21,45 @@ public:
         VkSampleCountFlagBits samples;
         std::function<VkSurfaceKHR(VkInstance)> createSurface;
     };
+    struct MemoryHeapStats {
+        VkDeviceSize size;            // Total size of the heap.
+        VkDeviceSize budget;          // Estimated budget for this process, or the heap size.
+        VkDeviceSize usage;           // Estimated usage for this process, or Lava's block bytes.
+        VkDeviceSize blockBytes;      // Bytes of VkDeviceMemory allocated by Lava.
+        VkDeviceSize allocatedBytes;  // Bytes within those blocks that are actually in use.
+        uint32_t blockCount;
+        uint32_t allocationCount;
+        bool deviceLocal;
+    };
+    struct MemoryCategoryStats {
+        VkDeviceSize bytes;
+        uint32_t count;
+    };
+    struct MemoryStats {
+        bool hasBudget;               // True if VK_EXT_memory_budget provided budget and usage.
+        uint32_t heapCount;
+        MemoryHeapStats heaps[VK_MAX_MEMORY_HEAPS];
+        MemoryCategoryStats buffers;
+        MemoryCategoryStats textures;
+        MemoryCategoryStats attachments;
+        MemoryCategoryStats staging;
+    };
+    struct DefragStats {
+        VkDeviceSize bytesMoved;
+        VkDeviceSize bytesFreed;
+        uint32_t allocationsMoved;
+        uint32_t blocksFreed;
+        bool complete;                // False if the budget ran out before the pass finished.
+    };
+    struct Relocation {
+        VkBuffer oldBuffer;           // Null unless a buffer was re-created.
+        VkBuffer newBuffer;
+        VkImage oldImage;             // Null unless an image was re-created.
+        VkImage newImage;
+        VkImageView oldView;
+        VkImageView newView;
+    };
+    using RelocationCallback = std::function<void(const Relocation&)>;
     static LavaContext* create(Config config) noexcept;
     static void operator delete(void* );
 
@@ -48,6 +88,28 @@ public:
     void freeRecording(LavaRecording*) noexcept;
     void waitRecording(LavaRecording*) noexcept;
 
+    // Reports usage and budget for each memory heap, along with per-category totals for the
+    // allocations made by Lava objects on this device.
+    MemoryStats getMemoryStats() const noexcept;
+
+    // Returns a JSON document with the same information as getMemoryStats, followed by the
+    // allocator's own statistics. Pass true to include a map of every block and allocation.
+    std::string getMemoryStatsJson(bool detailed = false) const noexcept;
+
+    // Compacts host-visible memory by moving the allocations of LavaCpuBuffer, LavaGpuBuffer, and
+    // pooled LavaSurfCache attachments. Stops after moving roughly "maxBytes" or after the given
+    // number of milliseconds, whichever comes first (0 means unlimited), so it can be called once
+    // per frame. Returns immediately if no block could be released, or if nothing changed since the
+    // last complete pass. Otherwise it waits on the fences of the frames, recordings and work that
+    // are in flight, so call it outside of beginFrame/endFrame and beginWork/endWork, and make sure
+    // that command buffers submitted by other means have finished.
+    // Objects whose memory moved re-create their Vulkan handles; the relocation callback is then
+    // invoked so that clients can replace stale handles, e.g. via LavaDescCache. Command buffers
+    // that were recorded earlier, such as those in a LavaRecording, still refer to the destroyed
+    // handles and must be re-recorded before they are presented again.
+    DefragStats defragment(VkDeviceSize maxBytes, uint32_t maxMilliseconds) noexcept;
+    void setRelocationCallback(RelocationCallback callback) noexcept;
+
     // General accessors.
     VkInstance getInstance() const noexcept;
     VkSurfaceKHR getSurface() const noexcept;
@@ -56,6 +118,7 @@ public:
     VkPhysicalDevice getGpu() const noexcept;
     const VkPhysicalDeviceFeatures& getGpuFeatures() const noexcept;
     VkQueue getQueue() const noexcept;
+    uint32_t getQueueFamilyIndex() const noexcept;
     VkFormat getFormat() const noexcept;
     VkColorSpaceKHR getColorSpace() const noexcept;
     const VkPhysicalDeviceMemoryProperties& getMemoryProperties() const noexcept;
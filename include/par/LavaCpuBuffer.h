@@ -7,8 +7,14 @@
 
 namespace par {
 
+// Host-visible buffer that stays persistently mapped for its entire lifetime.
 class LavaCpuBuffer {
 public:
+    enum MemoryUsage {
+        CPU_TO_GPU, // Default. Written by the CPU, read by the GPU (staging and uniform buffers).
+        CPU_ONLY,   // Host memory that the GPU can copy from, not necessarily fast to read.
+        GPU_TO_CPU, // Written by the GPU and read back by the CPU, typically cached on the host.
+    };
     struct Config {
         VkDevice device;
         VkPhysicalDevice gpu;
@@ -16,14 +22,23 @@ public:
         uint32_t capacity;  // Optional capacity, must be 0 or greater than "size".
         void const* source; // if non-null, triggers a memcpy during construction
         VkBufferUsageFlags usage;
+        MemoryUsage memory;
     };    
     static LavaCpuBuffer* create(Config config) noexcept;
     static void operator delete(void* );
     VkBuffer getBuffer() const noexcept;
+
+    // Copies into the persistently mapped memory and flushes the written range.
     void setData(void const* sourceData, uint32_t bytesToCopy,
             uint32_t offset = 0) noexcept;
+
+    // Returns the persistently mapped pointer. Clients that write through this pointer should call
+    // flush, and clients that read GPU results should call invalidate first. Both are no-ops for
+    // host-coherent memory types.
     uint8_t* map() const noexcept;
     void unmap() const noexcept;
+    void flush(VkDeviceSize offset = 0, VkDeviceSize size = VK_WHOLE_SIZE) const noexcept;
+    void invalidate(VkDeviceSize offset = 0, VkDeviceSize size = VK_WHOLE_SIZE) const noexcept;
 protected:
     LavaCpuBuffer() noexcept = default;
     LavaCpuBuffer(LavaCpuBuffer const&) = delete;
@@ -23,6 +23,10 @@ public:
         std::vector<VkBuffer> uniformBuffers;
         std::vector<VkDescriptorImageInfo> imageSamplers;
         std::vector<VkDescriptorImageInfo> inputAttachments;
+        // Optional stage flags for each binding, in binding order. Bindings without an entry are
+        // visible to all stages, except for input attachments which are fragment-only. Narrow
+        // flags can be obtained from AmberProgram::getDescriptorConfig.
+        std::vector<VkShaderStageFlags> stageFlags;
     };
     static LavaDescCache* create(Config config) noexcept;
     static void operator delete(void* );
@@ -52,6 +56,10 @@ public:
     void unsetImageSampler(VkDescriptorImageInfo binding) noexcept;
     void unsetInputAttachment(VkDescriptorImageInfo binding) noexcept;
 
+    // Discards descriptor sets that refer to the old buffer, and rebinds the new buffer wherever
+    // the old one was bound. Useful after LavaContext::defragment has re-created a buffer.
+    void replaceUniformBuffer(VkBuffer oldBuffer, VkBuffer newBuffer) noexcept;
+
     // Frees descriptor sets that were last retrieved more than N milliseconds ago, and more than
     // M frames ago. Also bumps the internal frame count.
     void evictDescriptors(uint64_t milliseconds, uint64_t nframes) noexcept;
@@ -17,12 +17,36 @@
 #define LOG_DCHECK(condition, msg) LOG_CHECK(condition, msg)
 #endif
 
+// Calls below this level compile to nothing, using the numbering of spdlog::level (0 is trace,
+// 1 is debug, 2 is info, 3 is warn, 4 is error). Fatal messages are never stripped. Release
+// builds strip trace and debug messages by default.
+#ifndef LAVA_LOG_MIN_LEVEL
+#ifdef NDEBUG
+#define LAVA_LOG_MIN_LEVEL 2
+#else
+#define LAVA_LOG_MIN_LEVEL 0
+#endif
+#endif
+
 namespace par {
 
 class LavaLog {
 public:
     LavaLog();
 
+    // Moves formatting and console output to a background thread, so that logging never blocks
+    // the caller on I/O. Messages are passed through spdlog's lock-free bounded queue, whose size
+    // must be a power of two. When the queue is full, BLOCK waits for space and DISCARD drops the
+    // message, which is preferable during a flood of validation messages. Fatal messages flush
+    // the queue before raising a signal. This swaps the underlying logger, so call it at startup
+    // before other threads begin logging.
+    enum class Overflow { BLOCK, DISCARD };
+    void enableAsync(size_t queueSize = 8192, Overflow overflow = Overflow::DISCARD) noexcept;
+    void disableAsync() noexcept;
+
+    // Waits until all queued messages have been written.
+    void flush() const noexcept;
+
     template<typename Arg1, typename... Args>
     void trace(const char *fmt, const Arg1 &, const Args &... args) const noexcept;
 
@@ -60,6 +84,7 @@ public:
     void fatal(const T &msg) const noexcept;
 
 private:
+    void replaceLogger(std::shared_ptr<spdlog::logger> logger) noexcept;
     std::shared_ptr<spdlog::logger> mLogger;
 };
 
@@ -67,63 +92,85 @@ extern LavaLog llog;
 
 template<typename Arg1, typename... Args>
 inline void LavaLog::trace(const char *fmt, const Arg1 &arg1, const Args &... args) const noexcept {
+    #if LAVA_LOG_MIN_LEVEL <= 0
     mLogger->log(spdlog::level::trace, fmt, arg1, args...);
+    #endif
 }
 
 template<typename Arg1, typename... Args>
 inline void LavaLog::debug(const char *fmt, const Arg1 &arg1, const Args &... args) const noexcept {
+    #if LAVA_LOG_MIN_LEVEL <= 1
     mLogger->log(spdlog::level::debug, fmt, arg1, args...);
+    #endif
 }
 
 template<typename Arg1, typename... Args>
 inline void LavaLog::info(const char *fmt, const Arg1 &arg1, const Args &... args) const noexcept {
+    #if LAVA_LOG_MIN_LEVEL <= 2
     mLogger->log(spdlog::level::info, fmt, arg1, args...);
+    #endif
 }
 
 template<typename Arg1, typename... Args>
 inline void LavaLog::warn(const char *fmt, const Arg1 &arg1, const Args &... args) const noexcept {
+    #if LAVA_LOG_MIN_LEVEL <= 3
     mLogger->log(spdlog::level::warn, fmt, arg1, args...);
+    #endif
 }
 
 template<typename Arg1, typename... Args>
 inline void LavaLog::error(const char *fmt, const Arg1 &arg1, const Args &... args) const noexcept {
+    #if LAVA_LOG_MIN_LEVEL <= 4
     mLogger->log(spdlog::level::err, fmt, arg1, args...);
+    #endif
 }
 
 template<typename Arg1, typename... Args>
 inline void LavaLog::fatal(const char *f, const Arg1 &arg, const Args &... args) const noexcept {
     mLogger->log(spdlog::level::err, f, arg, args...);
+    mLogger->flush();
     std::raise(SIGTRAP);
 }
 
 template<typename T>
 inline void LavaLog::trace(const T &msg) const noexcept {
+    #if LAVA_LOG_MIN_LEVEL <= 0
     mLogger->log(spdlog::level::trace, msg);
+    #endif
 }
 
 template<typename T>
 inline void LavaLog::debug(const T &msg) const noexcept {
+    #if LAVA_LOG_MIN_LEVEL <= 1
     mLogger->log(spdlog::level::debug, msg);
+    #endif
 }
 
 template<typename T>
 inline void LavaLog::info(const T &msg) const noexcept {
+    #if LAVA_LOG_MIN_LEVEL <= 2
     mLogger->log(spdlog::level::info, msg);
+    #endif
 }
 
 template<typename T>
 inline void LavaLog::warn(const T &msg) const noexcept {
+    #if LAVA_LOG_MIN_LEVEL <= 3
     mLogger->log(spdlog::level::warn, msg);
+    #endif
 }
 
 template<typename T>
 inline void LavaLog::error(const T &msg) const noexcept {
+    #if LAVA_LOG_MIN_LEVEL <= 4
     mLogger->log(spdlog::level::err, msg);
+    #endif
 }
 
 template<typename T>
 inline void LavaLog::fatal(const T &msg) const noexcept {
     mLogger->log(spdlog::level::err, msg);
+    mLogger->flush();
     std::raise(SIGTRAP);
 }
 
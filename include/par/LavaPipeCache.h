@@ -36,6 +36,8 @@ public:
         VkShaderModule vshader;
         VkShaderModule fshader;
         VertexState vertex;
+        std::vector<VkPushConstantRange> pushConstants; // See AmberProgram::getReflection.
+        VkSpecializationInfo const* specialization;     // Optional, see setSpecializationInfo.
     };
     static LavaPipeCache* create(Config config) noexcept;
     static void operator delete(void* );
@@ -57,7 +59,19 @@ public:
     void setFragmentShader(VkShaderModule module) noexcept;
     void setRenderPass(VkRenderPass renderPass) noexcept;
 
-    // Evicts pipeline objects that were last used more than N milliseconds ago.
+    // Sets the values of specialization constants for both shader stages, or clears them if null.
+    // The info is copied, and is part of the cache key, so each distinct set of values has its own
+    // pipeline while sharing the same shader modules. Constant IDs that a stage does not declare
+    // are ignored by Vulkan.
+    void setSpecializationInfo(VkSpecializationInfo const* info) noexcept;
+
+    // Evicts pipelines that refer to the old module, and binds the new module wherever the old one
+    // was bound. Useful for hot reloading, after which the old module can be destroyed.
+    void replaceShader(VkShaderModule oldModule, VkShaderModule newModule) noexcept;
+
+    // Evicts pipeline objects that were last used more than N milliseconds ago. Also bumps the
+    // internal frame count, and destroys evicted pipelines once they are no longer in flight. Call
+    // this once per frame, otherwise evicted and replaced pipelines are never destroyed.
     void releaseUnused(uint64_t milliseconds) noexcept;
 protected:
     LavaPipeCache() noexcept = default;
@@ -0,0 +1,81 @@
+// The MIT License
+// Copyright (c) 2018 Philip Rideout
+
+#pragma once
+
+#include <functional>
+#include <string>
+
+#include <vulkan/vulkan.h>
+
+namespace par {
+
+// Copies images into a ring of host-visible staging buffers without stalling the GPU.
+//
+// Call capture() to record a copy into a command buffer (typically the one returned by
+// LavaContext::beginFrame) and call poll() once per frame to receive the frames that have finished
+// copying, usually one or two frames later. Each staging buffer is guarded by a VkEvent that the
+// GPU signals after the copy, so poll() never blocks. Optionally streams frames to disk on a
+// worker thread.
+//
+class LavaReadback {
+public:
+    struct Config {
+        VkDevice device;
+        VkPhysicalDevice gpu;
+        uint32_t width;
+        uint32_t height;
+        VkFormat format;
+        uint32_t capacity;  // Number of staging buffers in the ring, defaults to 3.
+    };
+    struct Frame {
+        uint8_t const* data;
+        uint32_t size;
+        uint32_t width;
+        uint32_t height;
+        VkFormat format;
+        uint64_t frameNumber;
+    };
+    enum FileFormat { RAW, PNG };
+    struct Sink {
+        std::string folder;
+        std::string prefix;
+        FileFormat fileFormat;
+        uint32_t queueDepth;  // Maximum number of frames waiting on the worker, defaults to 8.
+    };
+    using FrameCallback = std::function<void(const Frame&)>;
+
+    static LavaReadback* create(Config config) noexcept;
+    static void operator delete(void* );
+
+    // Records a copy from the given image into the next free staging buffer. The image must have
+    // been created with VK_IMAGE_USAGE_TRANSFER_SRC_BIT and is transitioned back to "layout" after
+    // the copy. For swap chain images, pass VK_IMAGE_LAYOUT_PRESENT_SRC_KHR. Returns false (and
+    // drops the frame) if every staging buffer is still in flight.
+    bool capture(VkCommandBuffer cmd, VkImage image, VkImageLayout layout) noexcept;
+
+    // Invokes the callback for each finished copy, oldest first, without waiting on the GPU. The
+    // frame data is only valid during the callback. Returns the number of frames delivered.
+    uint32_t poll(FrameCallback callback = nullptr) noexcept;
+
+    // Similar to poll, but spins until every pending copy has been delivered. The caller must have
+    // already submitted the corresponding command buffers, e.g. by calling LavaContext::endFrame.
+    // Gives up after one second, leaving any undelivered copies pending for a later poll.
+    uint32_t flush(FrameCallback callback = nullptr) noexcept;
+
+    // Writes every delivered frame to disk on a worker thread. Frames are dropped rather than
+    // stalling the render thread if the worker falls behind.
+    void startStreaming(const Sink& sink) noexcept;
+    void stopStreaming() noexcept;
+
+    // Returns the number of frames that were dropped because the ring or the sink was full.
+    uint64_t getDroppedFrameCount() const noexcept;
+
+protected:
+    LavaReadback() noexcept = default;
+    // par::noncopyable
+    LavaReadback(LavaReadback const&) = delete;
+    LavaReadback& operator=(LavaReadback const&) = delete;
+};
+
+}
@@ -0,0 +1,57 @@
+// The MIT License
+// Copyright (c) 2018 Philip Rideout
+
+#pragma once
+
+#include <vulkan/vulkan.h>
+
+namespace par {
+
+// Shares VkSampler objects between clients that request identical sampler state.
+//
+// Samplers are keyed by the contents of VkSamplerCreateInfo and are reference counted. Since equal
+// descriptions yield the same handle, LavaDescCache sees identical bindings and can reuse its
+// descriptor sets. Samplers whose reference count drops to zero stay in the cache until room is
+// needed, at which point the least-recently released sampler is destroyed, as long as it has been
+// idle for long enough that no command buffer in flight can refer to it.
+//
+class LavaSamplerCache {
+public:
+    struct Config {
+        VkDevice device;
+        VkPhysicalDevice gpu;
+        uint32_t capacity;      // Defaults to (and is clamped to) maxSamplerAllocationCount.
+    };
+    struct Stats {
+        uint32_t samplerCount;  // Number of VkSampler objects that currently exist.
+        uint32_t idleCount;     // Number of samplers with no references.
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t evictions;
+    };
+
+    static LavaSamplerCache* create(Config config) noexcept;
+    static void operator delete(void* );
+
+    // Fetches or creates a sampler and adds a reference to it. Returns null if the cache is full
+    // and every sampler is either referenced or still in flight. Extension structures chained via
+    // pNext are not supported.
+    VkSampler getSampler(const VkSamplerCreateInfo& info) noexcept;
+
+    // Removes a reference that was added by getSampler. The sampler is not destroyed immediately.
+    void releaseSampler(VkSampler sampler) noexcept;
+
+    // Bumps the internal frame count. Call this once per frame, otherwise released samplers never
+    // become eligible for eviction.
+    void releaseUnused() noexcept;
+
+    Stats getStats() const noexcept;
+
+protected:
+    LavaSamplerCache() noexcept = default;
+    // par::noncopyable
+    LavaSamplerCache(LavaSamplerCache const&) = delete;
+    LavaSamplerCache& operator=(LavaSamplerCache const&) = delete;
+};
+
+}
@@ -0,0 +1,59 @@
+// The MIT License
+// Copyright (c) 2018 Philip Rideout
+
+#pragma once
+
+#include <vulkan/vulkan.h>
+
+namespace par {
+
+// Ring allocator for transient per-frame data such as uniforms and dynamic vertices.
+//
+// Sub-allocates from a single persistently mapped buffer. Call beginFrame() after
+// LavaContext::beginFrame (which waits on the fence of the frame that used the same command buffer)
+// to reclaim the space consumed by that frame, and call endFrame() before LavaContext::endFrame to
+// flush the current frame's writes. Offsets are aligned to minUniformBufferOffsetAlignment so that
+// they can be used as dynamic uniform buffer offsets as well as vertex or index buffer offsets.
+//
+class LavaStreamBuffer {
+public:
+    struct Config {
+        VkDevice device;
+        VkPhysicalDevice gpu;
+        uint32_t capacity;          // Size of the ring in bytes, shared by all frames in flight.
+        VkBufferUsageFlags usage;   // Defaults to uniform, vertex, and index buffer usage.
+    };
+    struct Allocation {
+        VkBuffer buffer;
+        uint32_t offset;
+        uint8_t* data;              // Null if the ring was full.
+    };
+    static LavaStreamBuffer* create(Config config) noexcept;
+    static void operator delete(void* );
+
+    // Reclaims the space consumed by the oldest frame in flight.
+    void beginFrame() noexcept;
+
+    // Makes the writes of the current frame visible to the GPU.
+    void endFrame() noexcept;
+
+    // Returns an aligned range that stays valid until the GPU has finished the current frame.
+    Allocation allocate(uint32_t size) noexcept;
+
+    // Allocates a range and copies the given data into it.
+    Allocation push(void const* data, uint32_t size) noexcept;
+
+    VkBuffer getBuffer() const noexcept;
+    uint32_t getAlignment() const noexcept;
+
+    // Returns the number of bytes that are currently reserved by frames in flight.
+    uint32_t getUsedBytes() const noexcept;
+
+protected:
+    LavaStreamBuffer() noexcept = default;
+    // par::noncopyable
+    LavaStreamBuffer(LavaStreamBuffer const&) = delete;
+    LavaStreamBuffer& operator=(LavaStreamBuffer const&) = delete;
+};
+
+}
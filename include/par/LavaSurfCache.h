@@ -8,34 +8,53 @@
 namespace par {
 
 // Creates offscreen rendering surfaces, manages a cache of VkFramebuffer and VkRenderPass.
+//
+// Freed attachments are kept in a pool keyed by size, format, usage, and sample count. They become
+// eligible for reuse after the frame count (see releaseUnused) has advanced past any command buffer
+// that might still reference them.
 class LavaSurfCache {
 public:
     struct Config;
     struct Attachment;
     struct Params;
     struct AttachmentConfig;
+    struct PoolStats;
 
     // Construction / Destruction.
     static LavaSurfCache* create(const Config& config) noexcept;
     static void operator delete(void* );
 
-    // Factory functions for VkImage / VkImageLayout.
+    // Factory functions for VkImage / VkImageLayout. Attachments are recycled from the pool when
+    // possible, in which case their contents are undefined until finalized.
     Attachment const* createColorAttachment(const AttachmentConfig& config) const noexcept;
     void finalizeAttachment(Attachment const* attachment, VkCommandBuffer cmdbuf) const noexcept;
     void finalizeAttachment(Attachment const* attachment, VkCommandBuffer cmdbuf,
             VkBuffer srcData, uint32_t nbytes) const noexcept;
     void finalizeAttachment(Attachment const* attachment, VkCommandBuffer cmdbuf,
             const VkClearColorValue& clearColor) const noexcept;
+    // Returns the attachment to the pool rather than destroying it immediately. Framebuffers that
+    // refer to the attachment are evicted from the cache and destroyed once they are out of flight.
     void freeAttachment(Attachment const* attachment) const noexcept;
 
     // Cache retrieval / creation / eviction.
     VkFramebuffer getFramebuffer(const Params& params) noexcept;
     VkRenderPass getRenderPass(const Params& params, VkRenderPassBeginInfo* = nullptr) noexcept;
+
+    // Frees cached objects and pooled attachments that were last used more than N milliseconds
+    // ago. Also bumps the internal frame count and applies the maxPooledBytes limit. Call this once
+    // per frame, otherwise freed attachments are never recycled.
     void releaseUnused(uint64_t milliseconds) noexcept;
 
+    // Destroys pooled attachments, oldest first, until the pool holds at most the given number of
+    // bytes. Attachments that might still be referenced by a command buffer are not destroyed.
+    void trimPool(uint64_t maxBytes) noexcept;
+
+    PoolStats getPoolStats() const noexcept;
+
     struct Config {
         VkDevice device;
         VkPhysicalDevice gpu;
+        uint64_t maxPooledBytes; // Optional limit enforced by releaseUnused, 0 means unlimited.
     };
 
     struct AttachmentConfig {
@@ -44,6 +63,16 @@ public:
         VkFormat format;
         bool enableUpload;
         bool enableRead;
+        VkSampleCountFlagBits samples; // Optional, defaults to VK_SAMPLE_COUNT_1_BIT.
+    };
+
+    struct PoolStats {
+        uint64_t pooledBytes;   // Memory held by freed attachments, including those in flight.
+        uint32_t pooledCount;
+        uint64_t liveBytes;     // Memory held by attachments that have not been freed.
+        uint32_t liveCount;
+        uint64_t hits;          // Number of attachments that were recycled from the pool.
+        uint64_t misses;        // Number of attachments that required a new allocation.
     };
 
     struct Attachment {
@@ -52,6 +81,7 @@ public:
         uint32_t width;
         uint32_t height;
         VkFormat format;
+        uint64_t generation; // Unique per cache, changes whenever an attachment is recycled.
     };
 
     struct Params {
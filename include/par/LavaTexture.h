@@ -9,6 +9,7 @@ namespace par {
 
 class LavaTexture {
 public:
+    enum Type { TEXTURE_2D, TEXTURE_2D_ARRAY, TEXTURE_CUBE, TEXTURE_CUBE_ARRAY, TEXTURE_3D };
     struct Config {
         VkDevice device;
         VkPhysicalDevice gpu;
@@ -17,12 +18,67 @@ public:
         uint32_t width;
         uint32_t height;
         VkFormat format;
+        uint32_t mipLevels;     // Number of levels in "source", packed from largest to smallest.
+        bool generateMipmaps;   // Blits the remainder of the mip chain during uploadStage.
+        uint32_t arrayLayers;   // Number of layers in each level of "source", defaults to 1.
+        Type type;              // Cubemaps have six layers per cube, ordered +X -X +Y -Y +Z -Z.
+        uint32_t depth;         // Number of slices in a 3D texture, defaults to 1.
+    };
+    struct Region {
+        VkBuffer buffer;        // Tightly packed texels, ordered by layer, then slice, then row.
+        VkDeviceSize bufferOffset;
+        uint32_t mipLevel;
+        uint32_t baseArrayLayer;
+        uint32_t layerCount;    // Defaults to 1.
+        VkOffset3D offset;
+        VkExtent3D extent;      // Defaults to the remainder of the level.
+    };
+    struct KtxConfig {
+        VkDevice device;
+        VkPhysicalDevice gpu;
+        void const* data;       // Contents of a KTX or KTX2 file.
+        uint32_t size;
     };
     static LavaTexture* create(Config config) noexcept;
+
+    // Creates a texture from a KTX or KTX2 container, including all of its mip levels, array
+    // layers, cubemap faces and slices. If the device cannot sample the stored format, the
+    // texels are transcoded on the CPU when possible. Returns null after logging an error if the
+    // file cannot be loaded.
+    static LavaTexture* createFromKtx(KtxConfig config) noexcept;
     static void operator delete(void* ptr) noexcept;
+
+    // Copies every level in the staging area into the image and generates the remaining levels, if
+    // requested. Leaves the image in VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL.
     void uploadStage(VkCommandBuffer cmd) const noexcept;
     void freeStage() noexcept;
+
+    // Exposes the staging area so that decoders can write texels directly, without an intermediate
+    // copy. Create the texture with a null source to use this.
+    void* mapStage() noexcept;
+    void unmapStage() noexcept;
+
+    // Copies texels from client-owned buffers into sub-regions of the image, e.g. to update a
+    // single layer of an atlas or one face of a cubemap. Each buffer must have been created with
+    // VK_BUFFER_USAGE_TRANSFER_SRC_BIT and must outlive the command buffer; LavaStreamBuffer works
+    // well for this. Texels outside of the regions are preserved, unless this is called before
+    // uploadStage, in which case they are undefined. Leaves the image in the shader-read layout.
+    void uploadRegions(VkCommandBuffer cmd, Region const* regions, uint32_t count) const noexcept;
+
     VkImageView getImageView() const noexcept;
+    VkImage getImage() const noexcept;
+    uint32_t getMipLevels() const noexcept;
+    uint32_t getArrayLayers() const noexcept;
+    VkFormat getFormat() const noexcept;
+    Type getType() const noexcept;
+    VkExtent3D getExtent(uint32_t mipLevel = 0) const noexcept;
+
+    // Returns a trilinear sampler description whose LOD range covers the entire mip chain.
+    VkSamplerCreateInfo getSamplerInfo() const noexcept;
+
+    // Returns the number of levels in a full mip chain for the given dimensions.
+    static uint32_t getMipCount(uint32_t width, uint32_t height, uint32_t depth = 1) noexcept;
+
 protected:
     LavaTexture() noexcept = default;
     // par::noncopyable
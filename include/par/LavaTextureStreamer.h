@@ -0,0 +1,82 @@
+// The MIT License
+// Copyright (c) 2018 Philip Rideout
+
+#pragma once
+
+#include <functional>
+
+#include <vulkan/vulkan.h>
+
+namespace par {
+
+// Streams the mip levels of many textures progressively, within a memory cap.
+//
+// When a texture is added, only the coarse tail of its mip chain is loaded. Finer levels are then
+// loaded one at a time on a worker thread and copied into the image during update(), which spends
+// at most a fixed number of bytes per frame. Since an image cannot grow or shrink in place, each
+// residency change re-creates the image and its view, copying the levels that were already
+// resident. Views therefore change over time and should be re-fetched every frame; LavaDescCache
+// treats a new view as a new descriptor. When the memory cap is reached, the finest levels of
+// textures that have not been marked as used recently are evicted to make room.
+//
+class LavaTextureStreamer {
+public:
+    struct Config {
+        VkDevice device;
+        VkPhysicalDevice gpu;
+        uint32_t uploadBudget;      // Bytes copied per update, defaults to 4 MiB.
+        uint64_t memoryBudget;      // Maximum size of all resident levels, defaults to 256 MiB.
+        uint32_t tailSize;          // Largest dimension of the initial levels, defaults to 64.
+    };
+
+    // Fills the given level with tightly packed texels. This is called on the worker thread for
+    // fine levels, and on the calling thread of addTexture for the coarse tail.
+    using LoadFn = std::function<void(uint32_t level, void* dest, uint32_t size)>;
+
+    struct Source {
+        uint32_t width;
+        uint32_t height;
+        VkFormat format;
+        uint32_t mipLevels;         // Total number of levels that LoadFn can provide.
+        LoadFn load;
+    };
+    struct Stats {
+        uint64_t residentBytes;
+        uint64_t uploadedBytes;     // Bytes copied during the most recent update.
+        uint32_t pendingLoads;
+        uint32_t evictions;         // Total number of levels that have been evicted.
+    };
+
+    static LavaTextureStreamer* create(Config config) noexcept;
+    static void operator delete(void* );
+
+    // Synchronously loads the coarse tail of the mip chain and returns a texture identifier. The
+    // texture becomes available after the next call to update().
+    uint32_t addTexture(const Source& source) noexcept;
+    void removeTexture(uint32_t id) noexcept;
+
+    // Notes that the texture is being sampled this frame, which makes it eligible for streaming
+    // finer levels and protects it from eviction.
+    void markUsed(uint32_t id) noexcept;
+
+    // Records pending copies into the given command buffer, issues new load requests, and evicts
+    // stale levels. Call this once per frame, before recording draw calls that sample textures.
+    void update(VkCommandBuffer cmd) noexcept;
+
+    // Returns the current view, which covers all resident levels, or null if the texture has not
+    // been uploaded yet.
+    VkImageView getImageView(uint32_t id) const noexcept;
+
+    // Returns the finest resident mip level, where 0 is full resolution.
+    uint32_t getResidentLevel(uint32_t id) const noexcept;
+
+    Stats getStats() const noexcept;
+
+protected:
+    LavaTextureStreamer() noexcept = default;
+    // par::noncopyable
+    LavaTextureStreamer(LavaTextureStreamer const&) = delete;
+    LavaTextureStreamer& operator=(LavaTextureStreamer const&) = delete;
+};
+
+}
@@ -0,0 +1,72 @@
+// The MIT License
+// Copyright (c) 2018 Philip Rideout
+
+#pragma once
+
+#include <string>
+
+#include <stdint.h>
+
+namespace par {
+
+// Records scoped CPU events and exports them as Chrome trace JSON, which can be viewed with
+// chrome://tracing or https://ui.perfetto.dev.
+//
+// Events are placed with LAVA_TRACE_SCOPE, which compiles to nothing unless LAVA_TRACING is
+// defined (see the LAVA_TRACING option in CMakeLists.txt). Each thread appends events to its own
+// fixed-size buffer without taking any locks, and events that do not fit are dropped. The buffers
+// of exited threads are reused by new threads. Nothing is recorded until start() is called.
+//
+class LavaTrace {
+public:
+    // Discards previously recorded events and begins recording.
+    static void start() noexcept;
+
+    // Stops recording. Markers that are still open when this is called are not recorded.
+    static void stop() noexcept;
+
+    static bool isRecording() noexcept;
+
+    // Writes the events recorded since start() to a JSON file. This is safe to call while other
+    // threads are recording, but their newest events may be left out. Returns false on failure.
+    static bool write(const std::string& path) noexcept;
+
+    // Appends an event to the calling thread's buffer. The name must have static storage duration,
+    // since only the pointer is stored. Times are in nanoseconds, as returned by getTime().
+    static void record(char const* name, uint64_t begin, uint64_t end) noexcept;
+    static uint64_t getTime() noexcept;
+
+    // Number of events that were dropped because a thread's buffer was full.
+    static uint64_t getDroppedCount() noexcept;
+};
+
+// Records an event that spans the lifetime of this object. Use LAVA_TRACE_SCOPE rather than
+// constructing this directly, so that markers disappear from builds without tracing.
+class LavaTraceScope {
+public:
+    explicit LavaTraceScope(char const* name) noexcept : mName(name),
+            mRecording(LavaTrace::isRecording()), mBegin(mRecording ? LavaTrace::getTime() : 0) {}
+    ~LavaTraceScope() noexcept {
+        if (mRecording) {
+            LavaTrace::record(mName, mBegin, LavaTrace::getTime());
+        }
+    }
+private:
+    char const* mName;
+    bool mRecording;
+    uint64_t mBegin;
+    // par::noncopyable
+    LavaTraceScope(LavaTraceScope const&) = delete;
+    LavaTraceScope& operator=(LavaTraceScope const&) = delete;
+};
+
+#define LAVA_TRACE_CONCAT_(a, b) a##b
+#define LAVA_TRACE_CONCAT(a, b) LAVA_TRACE_CONCAT_(a, b)
+
+#ifdef LAVA_TRACING
+#define LAVA_TRACE_SCOPE(name) par::LavaTraceScope LAVA_TRACE_CONCAT(lavaTrace, __LINE__)(name)
+#else
+#define LAVA_TRACE_SCOPE(name)
+#endif
+
+}
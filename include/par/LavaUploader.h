@@ -0,0 +1,68 @@
+// The MIT License
+// Copyright (c) 2018 Philip Rideout
+
+#pragma once
+
+#include <vulkan/vulkan.h>
+
+namespace par {
+
+// Batches buffer and image uploads into a reusable staging arena.
+//
+// Each call to upload() copies the source data into the arena and enqueues a transfer. flush()
+// records every pending transfer into a single command buffer with one barrier batch before and
+// after the copies, and submits it without waiting. Arena space is reclaimed once the fence of the
+// corresponding submission has signaled. Destinations must not be in use by the GPU when their
+// upload is flushed; this is intended for freshly created resources, e.g. during scene loading.
+//
+class LavaUploader {
+public:
+    struct Config {
+        VkDevice device;
+        VkPhysicalDevice gpu;
+        VkQueue queue;
+        uint32_t queueFamilyIndex;
+        uint32_t capacity;  // Size of the staging arena in bytes, defaults to 16 MiB.
+    };
+    struct BufferUpload {
+        VkBuffer buffer;    // Must have been created with VK_BUFFER_USAGE_TRANSFER_DST_BIT.
+        uint32_t offset;
+        uint32_t size;
+        void const* source;
+    };
+    struct ImageUpload {
+        VkImage image;      // Must have been created with VK_IMAGE_USAGE_TRANSFER_DST_BIT.
+        uint32_t size;
+        void const* source;
+        VkExtent3D extent;
+        uint32_t mipLevel;
+        uint32_t baseArrayLayer;
+        uint32_t layerCount;        // Defaults to 1.
+        VkImageLayout finalLayout;  // Defaults to VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL.
+    };
+    static LavaUploader* create(Config config) noexcept;
+    static void operator delete(void* );
+
+    // Copies the source data into the staging arena and enqueues a transfer. If the arena is full,
+    // this flushes the pending transfers and waits for the oldest submission to finish. Uploads
+    // that are larger than the entire arena use a dedicated staging buffer.
+    void upload(const BufferUpload& upload) noexcept;
+    void upload(const ImageUpload& upload) noexcept;
+
+    // Submits all pending transfers in a single command buffer and returns immediately.
+    void flush() noexcept;
+
+    // Flushes and then waits for all submissions to finish.
+    void finish() noexcept;
+
+    // Returns the number of uploads that have not been flushed yet.
+    uint32_t getPendingCount() const noexcept;
+
+protected:
+    LavaUploader() noexcept = default;
+    // par::noncopyable
+    LavaUploader(LavaUploader const&) = delete;
+    LavaUploader& operator=(LavaUploader const&) = delete;
+};
+
+}
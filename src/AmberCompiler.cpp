@@ -1,29 +1,106 @@
 // The MIT License
 // Copyright (c) 2018 Philip Rideout
 
+#include <par/LavaLoader.h>
 #include <par/AmberCompiler.h>
 #include <par/LavaLog.h>
+#include <par/LavaTrace.h>
 
 #include <SPIRV/GlslangToSpv.h>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include "LavaInternal.h"
 
 using namespace std;
 using namespace par;
 using namespace spdlog;
 
-static int ninstances = 0;
+namespace {
+
+// Guards the process-wide glslang state, which is initialized by the first compiler that
+// encounters a cache miss, and finalized when the last such compiler is destroyed.
+mutex gInitMutex;
+int gInstances = 0;
+
+// Identifies the layout of cache files. Bump this when the format changes.
+constexpr uint32_t CACHE_MAGIC = 0x41535056; // "ASPV"
+constexpr uint32_t CACHE_FORMAT = 1;
+
+struct CacheHeader {
+    uint32_t magic;
+    uint32_t format;
+    uint32_t keySize;
+    uint32_t spirvWords;
+};
+
+#ifdef __ANDROID__
+string gCacheFolder;
+#else
+string gCacheFolder = ".amber_cache";
+#endif
+
+#ifdef NDEBUG
+atomic<uint32_t> gOptimizations {AmberCompiler::STRIP_DEBUG_INFO | AmberCompiler::REMOVE_DEAD_CODE};
+#else
+atomic<uint32_t> gOptimizations {AmberCompiler::REMOVE_DEAD_CODE};
+#endif
+
+mutex gCacheMutex;
+atomic<uint32_t> gHits {0};
+atomic<uint32_t> gMisses {0};
+atomic<uint64_t> gLoadMicroseconds {0};
+atomic<uint64_t> gCompileMicroseconds {0};
+atomic<uint64_t> gOptimizeMicroseconds {0};
+atomic<uint64_t> gUnoptimizedBytes {0};
+atomic<uint64_t> gOptimizedBytes {0};
+
+using Clock = chrono::high_resolution_clock;
+
+uint64_t microsecondsSince(Clock::time_point start) {
+    return chrono::duration_cast<chrono::microseconds>(Clock::now() - start).count();
+}
+
+// 64-bit FNV-1a. Collisions are harmless because cache files store the full key for comparison.
+uint64_t hashBytes(const string& bytes) {
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (char c : bytes) {
+        hash = (hash ^ (uint8_t) c) * 0x100000001b3ull;
+    }
+    return hash;
+}
+
+string getCacheFolder() {
+    lock_guard<mutex> lock(gCacheMutex);
+    return gCacheFolder;
+}
+
+}
+
+extern const TBuiltInResource DefaultTBuiltInResource;
 
 struct AmberCompilerImpl : AmberCompiler {
-    AmberCompilerImpl() noexcept;
     ~AmberCompilerImpl() noexcept;
     bool compile(Stage stage, const string& glsl, vector<uint32_t>* spirv) const noexcept;
+    bool compileGlsl(Stage stage, const string& glsl, vector<uint32_t>* spirv) const noexcept;
+    static string makeKey(Stage stage, uint32_t optimizations, const string& glsl) noexcept;
+    static bool readCache(const string& path, const string& key, vector<uint32_t>* spirv) noexcept;
+    static void writeCache(const string& folder, const string& path, const string& key,
+            const vector<uint32_t>& spirv) noexcept;
+    mutable bool mInitialized = false;
 };
 
 LAVA_DEFINE_UPCAST(AmberCompiler)
 
-extern const TBuiltInResource DefaultTBuiltInResource;
-
 AmberCompiler* AmberCompiler::create() noexcept {
     return new AmberCompilerImpl();
 }
@@ -34,25 +111,162 @@ void AmberCompiler::operator delete(void* ptr) noexcept {
 }
 
 AmberCompilerImpl::~AmberCompilerImpl() noexcept {
-    if (--ninstances == 0) {
+    lock_guard<mutex> lock(gInitMutex);
+    if (mInitialized && --gInstances == 0) {
         glslang::FinalizeProcess();
     }
 }
 
-AmberCompilerImpl::AmberCompilerImpl() noexcept {
-    if (ninstances++ == 0) {
-        glslang::InitializeProcess();
+// The key contains everything that affects the generated code. The GLSL comes last since it is
+// the only variable-length field besides the version string, which is null-terminated.
+string AmberCompilerImpl::makeKey(Stage stage, uint32_t optimizations,
+        const string& glsl) noexcept {
+    string key;
+    const uint32_t stageWord = stage;
+    key.append((const char*) &stageWord, sizeof(stageWord));
+    key.append((const char*) &optimizations, sizeof(optimizations));
+    key += to_string(glslang::GetSpirvGeneratorVersion()) + " ";
+    key += glslang::GetGlslVersionString();
+    key += '\0';
+    key.append((const char*) &DefaultTBuiltInResource, sizeof(DefaultTBuiltInResource));
+    key += glsl;
+    return key;
+}
+
+bool AmberCompilerImpl::readCache(const string& path, const string& key,
+        vector<uint32_t>* spirv) noexcept {
+    FILE* file = fopen(path.c_str(), "rb");
+    if (!file) {
+        return false;
+    }
+    CacheHeader header;
+    bool valid = fread(&header, sizeof(header), 1, file) == 1 && header.magic == CACHE_MAGIC &&
+            header.format == CACHE_FORMAT && header.keySize == key.size();
+    if (valid) {
+        string storedKey(key.size(), 0);
+        valid = fread(&storedKey[0], 1, key.size(), file) == key.size() && storedKey == key;
+    }
+    if (valid) {
+        spirv->resize(header.spirvWords);
+        valid = fread(spirv->data(), 4, header.spirvWords, file) == header.spirvWords;
+    }
+    fclose(file);
+
+    // The compiler appends to this vector on a miss, so never leave a partial payload behind.
+    if (!valid) {
+        spirv->clear();
+    }
+    return valid;
+}
+
+// Writes to a temporary file and then renames it, so that other processes never see a partially
+// written cache entry.
+void AmberCompilerImpl::writeCache(const string& folder, const string& path, const string& key,
+        const vector<uint32_t>& spirv) noexcept {
+    mkdir(folder.c_str(), 0755);
+    const size_t threadId = hash<thread::id>()(this_thread::get_id());
+    const string tmppath = path + "." + to_string(getpid()) + "." + to_string(threadId);
+    FILE* file = fopen(tmppath.c_str(), "wb");
+    if (!file) {
+        llog.warn("Unable to write {}", path);
+        return;
+    }
+    const CacheHeader header {
+        .magic = CACHE_MAGIC,
+        .format = CACHE_FORMAT,
+        .keySize = (uint32_t) key.size(),
+        .spirvWords = (uint32_t) spirv.size(),
+    };
+    bool valid = fwrite(&header, sizeof(header), 1, file) == 1;
+    valid = valid && fwrite(key.data(), 1, key.size(), file) == key.size();
+    valid = valid && fwrite(spirv.data(), 4, spirv.size(), file) == spirv.size();
+    valid = fclose(file) == 0 && valid;
+    if (!valid || rename(tmppath.c_str(), path.c_str()) != 0) {
+        llog.warn("Unable to write {}", path);
+        remove(tmppath.c_str());
     }
 }
 
 bool AmberCompilerImpl::compile(Stage stage, const string& glsl,
         vector<uint32_t>* spirv) const noexcept {
+    const char* stageName = stage == VERTEX ? "VS" : (stage == FRAGMENT ? "FS" : "CS");
+    const string folder = getCacheFolder();
+    const uint32_t optimizations = gOptimizations;
+    string key, path;
+    if (!folder.empty()) {
+        const auto start = Clock::now();
+        key = makeKey(stage, optimizations, glsl);
+        char filename[32];
+        snprintf(filename, sizeof(filename), "/%016llx.spv", (unsigned long long) hashBytes(key));
+        path = folder + filename;
+        const bool hit = readCache(path, key, spirv);
+        const uint64_t elapsed = microsecondsSince(start);
+        gLoadMicroseconds += elapsed;
+        if (hit) {
+            gHits++;
+            llog.debug("Loaded {} from cache in {:.2f} ms", stageName, elapsed / 1000.0);
+            return true;
+        }
+    }
+
+    gMisses++;
+    const auto start = Clock::now();
+    const bool success = compileGlsl(stage, glsl, spirv);
+    const uint64_t elapsed = microsecondsSince(start);
+    gCompileMicroseconds += elapsed;
+    if (!success) {
+        return false;
+    }
+    llog.debug("Compiled {} in {:.2f} ms", stageName, elapsed / 1000.0);
+    if (optimizations) {
+        const size_t unoptimizedBytes = spirv->size() * 4;
+#ifndef NDEBUG
+        // Dead code removal must not drop the workgroup size specialization constants.
+        Reflection before, after;
+        const bool checkLocalSize = stage == COMPUTE && reflect(stage, *spirv, &before);
+#endif
+        const auto optimizeStart = Clock::now();
+        optimize(spirv, optimizations);
+        const uint64_t optimizeElapsed = microsecondsSince(optimizeStart);
+#ifndef NDEBUG
+        if (checkLocalSize && reflect(stage, *spirv, &after)) {
+            LOG_CHECK(!memcmp(before.localSizeIds, after.localSizeIds, sizeof(after.localSizeIds)),
+                    "Optimization removed a workgroup size specialization constant.");
+        }
+#endif
+        const size_t optimizedBytes = spirv->size() * 4;
+        gOptimizeMicroseconds += optimizeElapsed;
+        gUnoptimizedBytes += unoptimizedBytes;
+        gOptimizedBytes += optimizedBytes;
+        llog.debug("Optimized {} from {} to {} bytes ({:.1f}%) in {:.2f} ms", stageName,
+                unoptimizedBytes, optimizedBytes, 100.0 * optimizedBytes / unoptimizedBytes,
+                optimizeElapsed / 1000.0);
+    }
+    if (!folder.empty()) {
+        writeCache(folder, path, key, *spirv);
+    }
+    return true;
+}
+
+bool AmberCompilerImpl::compileGlsl(Stage stage, const string& glsl,
+        vector<uint32_t>* spirv) const noexcept {
+    {
+        lock_guard<mutex> lock(gInitMutex);
+        if (!mInitialized) {
+            if (gInstances++ == 0) {
+                glslang::InitializeProcess();
+            }
+            mInitialized = true;
+        }
+    }
+
     // Create the glslang shader object.
     EShLanguage lang;
+    char const* label;
     switch (stage) {
-        case VERTEX: lang = EShLangVertex; break;
-        case FRAGMENT: lang = EShLangFragment; break;
-        case COMPUTE: lang = EShLangCompute; break;
+        case VERTEX: lang = EShLangVertex; label = "VS"; break;
+        case FRAGMENT: lang = EShLangFragment; label = "FS"; break;
+        case COMPUTE: lang = EShLangCompute; label = "CS"; break;
     }
     glslang::TShader shader(lang);
     const char *glslStrings[] = { glsl.data() };
@@ -63,7 +277,7 @@ bool AmberCompilerImpl::compile(Stage stage, const string& glsl,
     const int glslangVersion = 100;
     const bool fwdCompatible = false;
     if (!shader.parse(&DefaultTBuiltInResource, glslangVersion, fwdCompatible, flags)) {
-        llog.error("Can't compile {}", (lang == EShLangVertex ? "VS" : "FS"));
+        llog.error("Can't compile {}", label);
         llog.warn(shader.getInfoLog());
         if (*shader.getInfoDebugLog()) {
             llog.debug(shader.getInfoDebugLog());
@@ -81,7 +295,7 @@ bool AmberCompilerImpl::compile(Stage stage, const string& glsl,
     glslang::TProgram program;
     program.addShader(&shader);
     if (!program.link(flags)) {
-        llog.error("Can't link {}", (lang == EShLangVertex ? "VS" : "FS"));
+        llog.error("Can't link {}", label);
         if (program.getInfoLog()) {
             llog.warn(program.getInfoLog());
         }
@@ -99,9 +313,65 @@ bool AmberCompilerImpl::compile(Stage stage, const string& glsl,
 
 bool AmberCompiler::compile(Stage stage, const string& glsl,
         vector<uint32_t>* spirv) const noexcept {
+    LAVA_TRACE_SCOPE("AmberCompiler::compile");
     return upcast(this)->compile(stage, glsl, spirv);
 }
 
+bool AmberCompiler::compileBatch(vector<Job>* jobs, uint32_t threadCount,
+        JobFn onComplete) noexcept {
+    const uint32_t njobs = jobs->size();
+    uint32_t nthreads = threadCount ? threadCount : thread::hardware_concurrency();
+    nthreads = std::max(std::min(nthreads, njobs), 1u);
+
+    // Each worker owns a compiler, which keeps glslang initialized until the worker exits.
+    atomic<uint32_t> next {0};
+    atomic<bool> success {true};
+    auto runWorker = [&] {
+        AmberCompiler* compiler = AmberCompiler::create();
+        for (uint32_t index = next++; index < njobs; index = next++) {
+            Job& job = (*jobs)[index];
+            job.success = compiler->compile(job.stage, job.glsl, &job.spirv);
+            if (!job.success) {
+                success = false;
+            }
+            if (onComplete) {
+                onComplete(index);
+            }
+        }
+        delete compiler;
+    };
+    vector<thread> workers;
+    for (uint32_t i = 1; i < nthreads; i++) {
+        workers.emplace_back(runWorker);
+    }
+    runWorker();
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    return success;
+}
+
+void AmberCompiler::setOptimizations(uint32_t optimizations) noexcept {
+    gOptimizations = optimizations;
+}
+
+void AmberCompiler::setCacheFolder(const string& folder) noexcept {
+    lock_guard<mutex> lock(gCacheMutex);
+    gCacheFolder = folder;
+}
+
+AmberCompiler::Stats AmberCompiler::getStats() noexcept {
+    return {
+        .hits = gHits,
+        .misses = gMisses,
+        .loadSeconds = gLoadMicroseconds / 1e6,
+        .compileSeconds = gCompileMicroseconds / 1e6,
+        .optimizeSeconds = gOptimizeMicroseconds / 1e6,
+        .unoptimizedBytes = gUnoptimizedBytes,
+        .optimizedBytes = gOptimizedBytes,
+    };
+}
+
 // See ResourceLimits.cpp in glslang/StandAlone
 const TBuiltInResource DefaultTBuiltInResource {
     .maxLights = 32,
@@ -0,0 +1,270 @@
+// The MIT License
+// Copyright (c) 2018 Philip Rideout
+
+#include <par/LavaLoader.h>
+#include <par/AmberCompiler.h>
+#include <par/LavaLog.h>
+
+#include <unordered_map>
+#include <unordered_set>
+
+using namespace par;
+using namespace std;
+
+// Implements AmberCompiler::optimize. Like the reflection parser, this understands only the few
+// opcodes that matter to it. Liveness is conservative: every operand word is treated as a possible
+// reference, so a literal that happens to equal an id can keep a definition alive, but nothing
+// that is actually used is ever removed.
+
+namespace {
+
+constexpr uint32_t SPIRV_MAGIC = 0x07230203;
+constexpr uint32_t SPIRV_HEADER_SIZE = 5;
+
+// Debug instructions.
+constexpr uint32_t OP_SOURCE_CONTINUED = 2;
+constexpr uint32_t OP_SOURCE = 3;
+constexpr uint32_t OP_SOURCE_EXTENSION = 4;
+constexpr uint32_t OP_NAME = 5;
+constexpr uint32_t OP_MEMBER_NAME = 6;
+constexpr uint32_t OP_STRING = 7;
+constexpr uint32_t OP_LINE = 8;
+constexpr uint32_t OP_NO_LINE = 317;
+constexpr uint32_t OP_MODULE_PROCESSED = 330;
+
+// Global definitions that may be removed if nothing refers to them.
+constexpr uint32_t OP_UNDEF = 1;
+constexpr uint32_t OP_TYPE_FIRST = 19;              // OpTypeVoid
+constexpr uint32_t OP_TYPE_LAST = 38;               // OpTypePipe
+constexpr uint32_t OP_CONSTANT_FIRST = 41;          // OpConstantTrue
+constexpr uint32_t OP_CONSTANT_LAST = 52;           // OpSpecConstantOp
+constexpr uint32_t OP_FUNCTION = 54;
+constexpr uint32_t OP_FUNCTION_END = 56;
+constexpr uint32_t OP_VARIABLE = 59;
+
+// Annotations, which are removed along with their targets.
+constexpr uint32_t OP_DECORATE = 71;
+constexpr uint32_t OP_MEMBER_DECORATE = 72;
+constexpr uint32_t OP_DECORATE_ID = 332;
+constexpr uint32_t OP_DECORATE_STRING = 5632;
+constexpr uint32_t OP_MEMBER_DECORATE_STRING = 5633;
+constexpr uint32_t DECORATION_BUILTIN = 11;
+constexpr uint32_t DECORATION_BINDING = 33;
+
+// Storage classes of resource variables, which are bound through descriptors.
+constexpr uint32_t STORAGE_UNIFORM_CONSTANT = 0;
+constexpr uint32_t STORAGE_UNIFORM = 2;
+constexpr uint32_t STORAGE_STORAGE_BUFFER = 12;
+
+enum class Kind {
+    REQUIRED,       // Always kept, and its operands are live.
+    DEFINITION,     // Kept only if its result id is live.
+    ANNOTATION,     // Kept only if its target is live, and does not make anything live.
+    DEBUG,          // Removed when stripping, otherwise like ANNOTATION if it has a target.
+};
+
+// A global instruction, or an entire function.
+struct Unit {
+    size_t begin;
+    size_t end;
+    Kind kind;
+    uint32_t id;    // Result id of a DEFINITION, or target of an ANNOTATION.
+};
+
+bool isDebug(uint32_t opcode) {
+    switch (opcode) {
+        case OP_SOURCE_CONTINUED:
+        case OP_SOURCE:
+        case OP_SOURCE_EXTENSION:
+        case OP_NAME:
+        case OP_MEMBER_NAME:
+        case OP_STRING:
+        case OP_LINE:
+        case OP_NO_LINE:
+        case OP_MODULE_PROCESSED:
+            return true;
+    }
+    return false;
+}
+
+bool isAnnotation(uint32_t opcode) {
+    return opcode == OP_DECORATE || opcode == OP_MEMBER_DECORATE || opcode == OP_DECORATE_ID ||
+            opcode == OP_DECORATE_STRING || opcode == OP_MEMBER_DECORATE_STRING;
+}
+
+// Returns the position of the result id for removable definitions, or -1 for other instructions.
+int getResultIndex(uint32_t opcode) {
+    if (opcode >= OP_TYPE_FIRST && opcode <= OP_TYPE_LAST) {
+        return 0;
+    }
+    if (opcode >= OP_CONSTANT_FIRST && opcode <= OP_CONSTANT_LAST) {
+        return 1;
+    }
+    if (opcode == OP_UNDEF || opcode == OP_VARIABLE || opcode == OP_FUNCTION) {
+        return 1;
+    }
+    return -1;
+}
+
+} // anonymous namespace
+
+bool AmberCompiler::optimize(vector<uint32_t>* spirv, uint32_t flags) noexcept {
+    vector<uint32_t>& words = *spirv;
+    if (words.size() < SPIRV_HEADER_SIZE || words[0] != SPIRV_MAGIC) {
+        llog.error("Invalid SPIR-V.");
+        return false;
+    }
+    const bool stripDebug = flags & STRIP_DEBUG_INFO;
+    const bool removeDead = flags & REMOVE_DEAD_CODE;
+
+    // Split the module into units. Functions are treated as a single unit, since the ids within a
+    // function body are local to it and only the function id can be referenced from outside.
+    vector<Unit> units;
+    for (size_t pos = SPIRV_HEADER_SIZE; pos < words.size();) {
+        const uint32_t opcode = words[pos] & 0xffff;
+        const uint32_t nwords = words[pos] >> 16;
+        if (nwords == 0 || pos + nwords > words.size()) {
+            llog.error("Truncated SPIR-V.");
+            return false;
+        }
+        Unit unit { .begin = pos, .end = pos + nwords, .kind = Kind::REQUIRED, .id = 0 };
+        if (opcode == OP_FUNCTION) {
+            while (unit.end < words.size() && (words[unit.end] & 0xffff) != OP_FUNCTION_END) {
+                const uint32_t n = words[unit.end] >> 16;
+                if (n == 0) {
+                    llog.error("Truncated SPIR-V.");
+                    return false;
+                }
+                unit.end += n;
+            }
+            if (unit.end >= words.size()) {
+                llog.error("Truncated SPIR-V.");
+                return false;
+            }
+            unit.end += words[unit.end] >> 16;
+        }
+        const int resultIndex = getResultIndex(opcode);
+        if (isDebug(opcode)) {
+            unit.kind = Kind::DEBUG;
+            unit.id = (opcode == OP_NAME || opcode == OP_MEMBER_NAME) ? words[pos + 1] : 0;
+        } else if (isAnnotation(opcode)) {
+            unit.kind = Kind::ANNOTATION;
+            unit.id = words[pos + 1];
+        } else if (resultIndex >= 0 && (int) nwords > resultIndex + 1) {
+            unit.kind = Kind::DEFINITION;
+            unit.id = words[pos + 1 + resultIndex];
+        }
+        units.push_back(unit);
+        pos = unit.end;
+    }
+
+    // Find live definitions, starting from the operands of required instructions. Builtins are
+    // roots too, since some are only referenced by their decoration. For example, glslang emits
+    // gl_WorkGroupSize as a composite of the local_size_*_id constants, and removing it would lose
+    // the workgroup size specialization. Resource variables with a binding are also kept even if
+    // unused, so that reflection still sees every declared binding and the descriptor layout
+    // matches the shader source.
+    unordered_map<uint32_t, const Unit*> definitions;
+    unordered_set<uint32_t> builtins;
+    unordered_set<uint32_t> bindings;
+    for (const Unit& unit : units) {
+        if (unit.kind == Kind::DEFINITION) {
+            definitions[unit.id] = &unit;
+        } else if (unit.kind == Kind::ANNOTATION && (words[unit.begin] & 0xffff) == OP_DECORATE &&
+                unit.end - unit.begin > 2) {
+            if (words[unit.begin + 2] == DECORATION_BUILTIN) {
+                builtins.insert(unit.id);
+            } else if (words[unit.begin + 2] == DECORATION_BINDING) {
+                bindings.insert(unit.id);
+            }
+        }
+    }
+    auto isRoot = [&](const Unit& unit) {
+        if (builtins.count(unit.id)) {
+            return true;
+        }
+        if (!bindings.count(unit.id) || (words[unit.begin] & 0xffff) != OP_VARIABLE ||
+                unit.end - unit.begin < 4) {
+            return false;
+        }
+        const uint32_t storageClass = words[unit.begin + 3];
+        return storageClass == STORAGE_UNIFORM_CONSTANT || storageClass == STORAGE_UNIFORM ||
+                storageClass == STORAGE_STORAGE_BUFFER;
+    };
+    unordered_set<uint32_t> live;
+    vector<const Unit*> worklist;
+    auto markOperands = [&](const Unit& unit) {
+        for (size_t pos = unit.begin; pos < unit.end; pos += words[pos] >> 16) {
+            const size_t end = pos + (words[pos] >> 16);
+            for (size_t i = pos + 1; i < end; i++) {
+                auto iter = definitions.find(words[i]);
+                if (iter != definitions.end() && live.insert(words[i]).second) {
+                    worklist.push_back(iter->second);
+                }
+            }
+        }
+    };
+    for (const Unit& unit : units) {
+        if (unit.kind == Kind::REQUIRED || (unit.kind == Kind::DEFINITION && !removeDead)) {
+            markOperands(unit);
+        } else if (unit.kind == Kind::DEFINITION && isRoot(unit) && live.insert(unit.id).second) {
+            worklist.push_back(&unit);
+        }
+    }
+    while (!worklist.empty()) {
+        const Unit* unit = worklist.back();
+        worklist.pop_back();
+        markOperands(*unit);
+    }
+
+    // Annotations and names may also target ids that are local to a function, such as variables
+    // and parameters. These are kept only if the id appears in a surviving unit.
+    unordered_set<uint32_t> survivors;
+    if (removeDead) {
+        for (const Unit& unit : units) {
+            if (unit.kind == Kind::REQUIRED ||
+                    (unit.kind == Kind::DEFINITION && live.count(unit.id))) {
+                survivors.insert(words.begin() + unit.begin, words.begin() + unit.end);
+            }
+        }
+    }
+    auto isTargetLive = [&](uint32_t id) {
+        if (!removeDead || id == 0) {
+            return true;
+        }
+        return definitions.count(id) ? live.count(id) > 0 : survivors.count(id) > 0;
+    };
+
+    // Copy the surviving units.
+    vector<uint32_t> result(words.begin(), words.begin() + SPIRV_HEADER_SIZE);
+    result.reserve(words.size());
+    for (const Unit& unit : units) {
+        bool keep = true;
+        switch (unit.kind) {
+            case Kind::REQUIRED:
+                break;
+            case Kind::DEFINITION:
+                keep = !removeDead || live.count(unit.id);
+                break;
+            case Kind::ANNOTATION:
+                keep = isTargetLive(unit.id);
+                break;
+            case Kind::DEBUG:
+                keep = !stripDebug && isTargetLive(unit.id);
+                break;
+        }
+        if (keep) {
+            // Function bodies may contain OpLine and OpNoLine, which are stripped too.
+            for (size_t pos = unit.begin; pos < unit.end; pos += words[pos] >> 16) {
+                const uint32_t opcode = words[pos] & 0xffff;
+                if (stripDebug && (opcode == OP_LINE || opcode == OP_NO_LINE)) {
+                    continue;
+                }
+                result.insert(result.end(), words.begin() + pos,
+                        words.begin() + pos + (words[pos] >> 16));
+            }
+        }
+    }
+    words.swap(result);
+    return true;
+}
@@ -6,9 +6,20 @@
 #include <par/LavaLog.h>
 #include <par/AmberProgram.h>
 
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
 #include <vector>
-#include <fstream>
-#include <regex>
+
+#include <assert.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "LavaInternal.h"
 
@@ -24,18 +35,161 @@ using namespace std;
 using namespace FW;
 #endif
 
+namespace {
+
+struct Chunk {
+    size_t offset;
+    size_t length;
+    uint32_t lineNumber;    // Line number of the first line in the chunk, starting at 1.
+};
+
+// Memory-maps a file and records the extent of every chunk, using a single pass over the text.
+// The mapping stays alive so that chunks can be extracted without touching the rest of the file.
+struct ChunkIndex {
+    ~ChunkIndex();
+    bool build(const string& filename);
+    char const* data = nullptr;
+    size_t size = 0;
+    int64_t modificationTime = 0;
+    unordered_map<string, Chunk> chunks;
+};
+
+// Indices are cached by path, and re-built when the modification time or size of a file changes.
+mutex gChunkMutex;
+unordered_map<string, unique_ptr<ChunkIndex>> gChunkIndices;
+
+// Inserts a block of text after the #version line, which must come first in GLSL. The #line
+// directive keeps error messages pointing at the right line of the original text, unless the
+// original text supplies its own #line directive.
+string insertPreamble(const string& glsl, const string& preamble) {
+    if (glsl.compare(0, 8, "#version")) {
+        return preamble + "#line 1\n" + glsl;
+    }
+    const size_t newline = glsl.find('\n');
+    if (newline == string::npos) {
+        return glsl + "\n" + preamble;
+    }
+    return glsl.substr(0, newline + 1) + preamble + "#line 2\n" + glsl.substr(newline + 1);
+}
+
+// Returns the size of the 32-bit formats that AmberCompiler::reflect can produce.
+uint32_t getFormatSize(VkFormat format) {
+    switch (format) {
+        case VK_FORMAT_R32_SFLOAT:
+        case VK_FORMAT_R32_SINT:
+        case VK_FORMAT_R32_UINT:
+            return 4;
+        case VK_FORMAT_R32G32_SFLOAT:
+        case VK_FORMAT_R32G32_SINT:
+        case VK_FORMAT_R32G32_UINT:
+            return 8;
+        case VK_FORMAT_R32G32B32_SFLOAT:
+        case VK_FORMAT_R32G32B32_SINT:
+        case VK_FORMAT_R32G32B32_UINT:
+            return 12;
+        case VK_FORMAT_R32G32B32A32_SFLOAT:
+        case VK_FORMAT_R32G32B32A32_SINT:
+        case VK_FORMAT_R32G32B32A32_UINT:
+            return 16;
+        default:
+            return 0;
+    }
+}
+
+int64_t getModificationTime(const struct stat& st) {
+    #ifdef __APPLE__
+    return int64_t(st.st_mtimespec.tv_sec) * 1000000000 + st.st_mtimespec.tv_nsec;
+    #else
+    return int64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+    #endif
+}
+
+ChunkIndex::~ChunkIndex() {
+    if (data) {
+        munmap((void*) data, size);
+    }
+}
+
+bool ChunkIndex::build(const string& filename) {
+    const int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) || st.st_size == 0) {
+        close(fd);
+        return false;
+    }
+    void* mapping = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        return false;
+    }
+    data = (char const*) mapping;
+    size = st.st_size;
+    modificationTime = getModificationTime(st);
+
+    // Each line that starts with "--" ends the current chunk. If the line has a name after the
+    // dashes, it also begins a new chunk.
+    Chunk* current = nullptr;
+    uint32_t lineNumber = 1;
+    for (size_t pos = 0; pos < size; lineNumber++) {
+        char const* newline = (char const*) memchr(data + pos, '\n', size - pos);
+        const size_t end = newline ? newline - data : size;
+        if (end - pos >= 2 && data[pos] == '-' && data[pos + 1] == '-') {
+            if (current) {
+                current->length = pos - current->offset;
+                current = nullptr;
+            }
+            size_t begin = pos + 2;
+            while (begin < end && isspace(data[begin])) {
+                begin++;
+            }
+            size_t stop = begin;
+            while (stop < end && !isspace(data[stop])) {
+                stop++;
+            }
+            if (stop > begin) {
+                const size_t next = newline ? end + 1 : end;
+                current = &chunks[string(data + begin, stop - begin)];
+                *current = {next, 0, lineNumber + 1};
+            }
+        }
+        pos = newline ? end + 1 : end;
+    }
+    if (current) {
+        current->length = size - current->offset;
+    }
+    return true;
+}
+
+}
+
 struct AmberProgramImpl : AmberProgram {
     AmberProgramImpl(const string& vshader, const string& fshader) noexcept;
     ~AmberProgramImpl() noexcept;
     VkShaderModule compileVertexShader(VkDevice device) noexcept;
     VkShaderModule compileFragmentShader(VkDevice device) noexcept;
+    VkShaderModule compileComputeShader(VkDevice device) noexcept;
+    bool isCompute() const noexcept { return !mCompShader.empty(); }
+    bool isComplete() const noexcept {
+        return isCompute() ? mCompModule != VK_NULL_HANDLE : mVertModule && mFragModule;
+    }
+    static VkShaderModule createModule(VkDevice device, const vector<uint32_t>& spirv) noexcept;
     AmberCompiler* mCompiler;
     string mVertShader;
     string mFragShader;
+    string mCompShader;
     VkShaderModule mVertModule = VK_NULL_HANDLE;
     VkShaderModule mFragModule = VK_NULL_HANDLE;
+    VkShaderModule mCompModule = VK_NULL_HANDLE;
+    AmberCompiler::Reflection mVertReflection {};
+    AmberCompiler::Reflection mFragReflection {};
+    AmberCompiler::Reflection mCompReflection {};
+    mutable mutex mVariantMutex;
+    unordered_map<string, unique_ptr<AmberProgram>> mVariants;
     VkDevice mDevice = VK_NULL_HANDLE;
-    #ifdef SUPPORT_FILEWATCHER
+    #ifdef FILEWATCHER
     FileWatcher mFileWatcher;
     struct : FileWatchListener {
         FileListener callback;
@@ -57,6 +211,12 @@ AmberProgram* AmberProgram::create(const string& vshader, const string& fshader)
     return new AmberProgramImpl(vshader, fshader);
 }
 
+AmberProgram* AmberProgram::createCompute(const string& cshader) noexcept {
+    auto impl = new AmberProgramImpl({}, {});
+    impl->mCompShader = cshader;
+    return impl;
+}
+
 void AmberProgram::operator delete(void* ptr) noexcept {
     auto impl = (AmberProgramImpl*) ptr;
     ::delete impl;
@@ -69,6 +229,9 @@ AmberProgramImpl::~AmberProgramImpl() noexcept {
     if (mDevice && mFragModule) {
         vkDestroyShaderModule(mDevice, mFragModule, VKALLOC);
     }
+    if (mDevice && mCompModule) {
+        vkDestroyShaderModule(mDevice, mCompModule, VKALLOC);
+    }
     delete mCompiler;
 }
 
@@ -84,14 +247,8 @@ VkShaderModule AmberProgramImpl::compileVertexShader(VkDevice device) noexcept {
         llog.error("Unable to compile vertex shader.");
         return VK_NULL_HANDLE;
     }
-    VkShaderModuleCreateInfo moduleCreateInfo {
-        .sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO,
-        .codeSize = spirv.size() * 4,
-        .pCode = spirv.data()
-    };
-    VkResult err = vkCreateShaderModule(device, &moduleCreateInfo, VKALLOC, &mVertModule);
-    LOG_CHECK(!err, "Unable to create vertex shader module.");
-    return mVertModule;
+    AmberCompiler::reflect(AmberCompiler::VERTEX, spirv, &mVertReflection);
+    return mVertModule = createModule(device, spirv);
 }
 
 VkShaderModule AmberProgramImpl::compileFragmentShader(VkDevice device) noexcept {
@@ -103,22 +260,119 @@ VkShaderModule AmberProgramImpl::compileFragmentShader(VkDevice device) noexcept
         llog.error("Unable to compile fragment shader.");
         return VK_NULL_HANDLE;
     }
+    AmberCompiler::reflect(AmberCompiler::FRAGMENT, spirv, &mFragReflection);
+    return mFragModule = createModule(device, spirv);
+}
+
+VkShaderModule AmberProgramImpl::compileComputeShader(VkDevice device) noexcept {
+    if (mCompModule) {
+        return mCompModule;
+    }
+    std::vector<uint32_t> spirv;
+    if (!mCompiler->compile(AmberCompiler::COMPUTE, mCompShader, &spirv)) {
+        llog.error("Unable to compile compute shader.");
+        return VK_NULL_HANDLE;
+    }
+    AmberCompiler::reflect(AmberCompiler::COMPUTE, spirv, &mCompReflection);
+    return mCompModule = createModule(device, spirv);
+}
+
+VkShaderModule AmberProgramImpl::createModule(VkDevice device,
+        const vector<uint32_t>& spirv) noexcept {
     VkShaderModuleCreateInfo moduleCreateInfo {
         .sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO,
         .codeSize = spirv.size() * 4,
         .pCode = spirv.data()
     };
-    VkResult err = vkCreateShaderModule(device, &moduleCreateInfo, VKALLOC, &mFragModule);
-    LOG_CHECK(!err, "Unable to create fragment shader module.");
-    return mFragModule;
+    VkShaderModule module;
+    VkResult err = vkCreateShaderModule(device, &moduleCreateInfo, VKALLOC, &module);
+    LOG_CHECK(!err, "Unable to create shader module.");
+    return module;
 }
 
 bool AmberProgram::compile(VkDevice device) noexcept {
     AmberProgramImpl& impl = *upcast(this);
-    impl.compileVertexShader(device);
-    impl.compileFragmentShader(device);
+    if (impl.isCompute()) {
+        impl.compileComputeShader(device);
+    } else {
+        impl.compileVertexShader(device);
+        impl.compileFragmentShader(device);
+    }
     impl.mDevice = device;
-    return impl.mVertModule && impl.mFragModule;
+    return impl.isComplete();
+}
+
+bool AmberProgram::compileBatch(VkDevice device, AmberProgram* const* programs, uint32_t count,
+        uint32_t threadCount, ProgramFn onCompiled) noexcept {
+    // Gather a job for every shader that has not been compiled yet, along with the index of the
+    // program that owns it.
+    vector<AmberCompiler::Job> jobs;
+    vector<uint32_t> owners;
+    unique_ptr<atomic<uint32_t>[]> remaining(new atomic<uint32_t>[count]);
+    for (uint32_t i = 0; i < count; i++) {
+        AmberProgramImpl* impl = upcast(programs[i]);
+        impl->mDevice = device;
+        remaining[i] = 0;
+        if (impl->isCompute()) {
+            if (!impl->mCompModule) {
+                jobs.push_back({ .stage = AmberCompiler::COMPUTE, .glsl = impl->mCompShader });
+                owners.push_back(i);
+                remaining[i]++;
+            }
+        } else if (!impl->mVertModule) {
+            jobs.push_back({ .stage = AmberCompiler::VERTEX, .glsl = impl->mVertShader });
+            owners.push_back(i);
+            remaining[i]++;
+        }
+        if (!impl->isCompute() && !impl->mFragModule) {
+            jobs.push_back({ .stage = AmberCompiler::FRAGMENT, .glsl = impl->mFragShader });
+            owners.push_back(i);
+            remaining[i]++;
+        }
+        if (remaining[i] == 0 && onCompiled) {
+            onCompiled(impl);
+        }
+    }
+
+    // Each job writes to distinct module and reflection fields, so workers do not need to
+    // synchronize.
+    return AmberCompiler::compileBatch(&jobs, threadCount, [&](uint32_t index) {
+        const AmberCompiler::Job& job = jobs[index];
+        AmberProgramImpl* impl = upcast(programs[owners[index]]);
+        if (!job.success) {
+            llog.error("Unable to compile {} shader.", job.stage == AmberCompiler::VERTEX ?
+                    "vertex" : job.stage == AmberCompiler::FRAGMENT ? "fragment" : "compute");
+        } else if (job.stage == AmberCompiler::VERTEX) {
+            AmberCompiler::reflect(job.stage, job.spirv, &impl->mVertReflection);
+            impl->mVertModule = AmberProgramImpl::createModule(device, job.spirv);
+        } else if (job.stage == AmberCompiler::FRAGMENT) {
+            AmberCompiler::reflect(job.stage, job.spirv, &impl->mFragReflection);
+            impl->mFragModule = AmberProgramImpl::createModule(device, job.spirv);
+        } else {
+            AmberCompiler::reflect(job.stage, job.spirv, &impl->mCompReflection);
+            impl->mCompModule = AmberProgramImpl::createModule(device, job.spirv);
+        }
+        if (--remaining[owners[index]] == 0 && impl->isComplete() && onCompiled) {
+            onCompiled(impl);
+        }
+    });
+}
+
+void AmberProgram::replaceShaders(VkShaderModule vshader, VkShaderModule fshader) noexcept {
+    AmberProgramImpl& impl = *upcast(this);
+    assert(impl.mDevice);
+    if (vshader && vshader != impl.mVertModule) {
+        if (impl.mVertModule) {
+            vkDestroyShaderModule(impl.mDevice, impl.mVertModule, VKALLOC);
+        }
+        impl.mVertModule = vshader;
+    }
+    if (fshader && fshader != impl.mFragModule) {
+        if (impl.mFragModule) {
+            vkDestroyShaderModule(impl.mDevice, impl.mFragModule, VKALLOC);
+        }
+        impl.mFragModule = fshader;
+    }
 }
 
 VkShaderModule AmberProgram::getVertexShader() const noexcept {
@@ -129,40 +383,249 @@ VkShaderModule AmberProgram::getFragmentShader() const noexcept {
     return upcast(this)->mFragModule;
 }
 
+VkShaderModule AmberProgram::getComputeShader() const noexcept {
+    return upcast(this)->mCompModule;
+}
+
+VkPipeline AmberProgram::createComputePipeline(VkPipelineLayout layout,
+        const uint32_t* localSize) const noexcept {
+    AmberProgramImpl const& impl = *upcast(this);
+    assert(impl.mCompModule && "Program must be compiled.");
+
+    // Override the workgroup dimensions that the shader declared with specialization constants.
+    const uint32_t* ids = impl.mCompReflection.localSizeIds;
+    VkSpecializationMapEntry entries[3];
+    uint32_t count = 0;
+    for (uint32_t i = 0; localSize && i < 3; i++) {
+        if (ids[i] != ~0u) {
+            entries[count++] = {
+                .constantID = ids[i],
+                .offset = i * (uint32_t) sizeof(uint32_t),
+                .size = sizeof(uint32_t)
+            };
+        } else if (localSize[i] != impl.mCompReflection.localSize[i]) {
+            llog.warn("Workgroup size {} is not specialized, use local_size_{}_id.", i,
+                    char('x' + i));
+        }
+    }
+    VkSpecializationInfo specialization {
+        .mapEntryCount = count,
+        .pMapEntries = entries,
+        .dataSize = 3 * sizeof(uint32_t),
+        .pData = localSize
+    };
+    VkComputePipelineCreateInfo pipelineInfo {
+        .sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO,
+        .stage = {
+            .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+            .stage = VK_SHADER_STAGE_COMPUTE_BIT,
+            .module = impl.mCompModule,
+            .pName = "main",
+            .pSpecializationInfo = count ? &specialization : nullptr
+        },
+        .layout = layout
+    };
+    VkPipeline pipeline;
+    VkResult err = vkCreateComputePipelines(impl.mDevice, VK_NULL_HANDLE, 1, &pipelineInfo,
+            VKALLOC, &pipeline);
+    LOG_CHECK(!err, "Unable to create compute pipeline.");
+    return pipeline;
+}
+
+AmberProgram* AmberProgram::getVariant(const vector<string>& defines) noexcept {
+    AmberProgramImpl& impl = *upcast(this);
+
+    // The sorted list of defines identifies the variant, regardless of the order they were given.
+    vector<string> sorted = defines;
+    sort(sorted.begin(), sorted.end());
+    sorted.erase(unique(sorted.begin(), sorted.end()), sorted.end());
+    string preamble;
+    for (const auto& define : sorted) {
+        preamble += "#define " + define + "\n";
+    }
+
+    lock_guard<mutex> lock(impl.mVariantMutex);
+    auto& variant = impl.mVariants[preamble];
+    if (!variant) {
+        auto insert = [&preamble](const string& glsl) {
+            return glsl.empty() ? glsl : insertPreamble(glsl, preamble);
+        };
+        auto variantImpl = new AmberProgramImpl(insert(impl.mVertShader),
+                insert(impl.mFragShader));
+        variantImpl->mCompShader = insert(impl.mCompShader);
+        variant.reset(variantImpl);
+    }
+    return variant.get();
+}
+
+uint32_t AmberProgram::getVariantCount() const noexcept {
+    AmberProgramImpl const& impl = *upcast(this);
+    lock_guard<mutex> lock(impl.mVariantMutex);
+    return (uint32_t) impl.mVariants.size();
+}
+
+AmberCompiler::Reflection AmberProgram::getReflection() const noexcept {
+    using Binding = AmberCompiler::Reflection::Binding;
+    AmberProgramImpl const& impl = *upcast(this);
+    if (impl.isCompute()) {
+        return impl.mCompReflection;
+    }
+    AmberCompiler::Reflection result = impl.mVertReflection;
+    const AmberCompiler::Reflection& frag = impl.mFragReflection;
+    for (const Binding& binding : frag.bindings) {
+        auto iter = find_if(result.bindings.begin(), result.bindings.end(),
+                [&binding](const Binding& b) {
+            return b.set == binding.set && b.binding == binding.binding;
+        });
+        if (iter == result.bindings.end()) {
+            result.bindings.push_back(binding);
+        } else {
+            iter->stages |= binding.stages;
+        }
+    }
+    sort(result.bindings.begin(), result.bindings.end(), [](const Binding& a, const Binding& b) {
+        return a.set < b.set || (a.set == b.set && a.binding < b.binding);
+    });
+    for (const VkPushConstantRange& range : frag.pushConstants) {
+        auto iter = find_if(result.pushConstants.begin(), result.pushConstants.end(),
+                [&range](const VkPushConstantRange& r) {
+            return r.offset == range.offset && r.size == range.size;
+        });
+        if (iter == result.pushConstants.end()) {
+            result.pushConstants.push_back(range);
+        } else {
+            iter->stageFlags |= range.stageFlags;
+        }
+    }
+    using Constant = AmberCompiler::Reflection::Constant;
+    for (const Constant& constant : frag.constants) {
+        auto iter = find_if(result.constants.begin(), result.constants.end(),
+                [&constant](const Constant& c) { return c.id == constant.id; });
+        if (iter == result.constants.end()) {
+            result.constants.push_back(constant);
+        }
+    }
+    sort(result.constants.begin(), result.constants.end(), [](const Constant& a,
+            const Constant& b) { return a.id < b.id; });
+    return result;
+}
+
+LavaDescCache::Config AmberProgram::getDescriptorConfig() const noexcept {
+    LavaDescCache::Config config { .device = upcast(this)->mDevice };
+    for (const auto& binding : getReflection().bindings) {
+        if (binding.set != 0) {
+            continue;
+        }
+        const size_t expected = config.uniformBuffers.size() + config.imageSamplers.size() +
+                config.inputAttachments.size();
+        if (binding.binding != expected || binding.count != 1) {
+            llog.error("Binding {} does not follow the LavaDescCache convention.", binding.binding);
+            continue;
+        }
+        switch (binding.type) {
+            case VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER:
+                if (!config.imageSamplers.empty() || !config.inputAttachments.empty()) {
+                    llog.error("Uniform buffer {} must precede all images.", binding.binding);
+                }
+                config.uniformBuffers.push_back(VK_NULL_HANDLE);
+                break;
+            case VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER:
+                if (!config.inputAttachments.empty()) {
+                    llog.error("Sampler {} must precede all input attachments.", binding.binding);
+                }
+                config.imageSamplers.push_back({});
+                break;
+            case VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT:
+                config.inputAttachments.push_back({});
+                break;
+            default:
+                llog.error("Binding {} has a type that LavaDescCache does not support.",
+                        binding.binding);
+                continue;
+        }
+        config.stageFlags.push_back(binding.stages);
+    }
+    return config;
+}
+
+LavaPipeCache::VertexState AmberProgram::getVertexState(VkPrimitiveTopology topology,
+        bool interleaved) const noexcept {
+    LavaPipeCache::VertexState state { .topology = topology };
+    uint32_t offset = 0;
+    for (const auto& input : upcast(this)->mVertReflection.inputs) {
+        const uint32_t size = getFormatSize(input.format);
+        if (input.format == VK_FORMAT_UNDEFINED || size == 0) {
+            llog.error("Vertex input at location {} has an unsupported type.", input.location);
+            continue;
+        }
+        const uint32_t binding = interleaved ? 0 : (uint32_t) state.buffers.size();
+        state.attributes.push_back({
+            .location = input.location,
+            .binding = binding,
+            .format = input.format,
+            .offset = interleaved ? offset : 0,
+        });
+        if (!interleaved) {
+            state.buffers.push_back({ .binding = binding, .stride = size });
+        }
+        offset += size;
+    }
+    if (interleaved && offset > 0) {
+        state.buffers.push_back({ .binding = 0, .stride = offset });
+    }
+    return state;
+}
+
 string AmberProgram::getChunk(const string& filename, const string& chunkName) noexcept {
-    const regex pattern(R"([\s]+)");
-    sregex_token_iterator it(chunkName.begin(), chunkName.end(), pattern, -1);
-    vector<string> chunkids(it, {});
-    vector<string> tokens;
+    lock_guard<mutex> lock(gChunkMutex);
+    auto& index = gChunkIndices[filename];
+    struct stat st;
+    if (stat(filename.c_str(), &st)) {
+        llog.error("Unable to open {}", filename);
+        return {};
+    }
+    if (!index || index->modificationTime != getModificationTime(st) ||
+            index->size != (size_t) st.st_size) {
+        index.reset(new ChunkIndex);
+        if (!index->build(filename)) {
+            llog.error("Unable to read {}", filename);
+            index.reset();
+            return {};
+        }
+    }
 
+    // The chunk name can be a whitespace-separated list, in which case the chunks are joined.
     string chunk = "#version 450\n";
-    for (auto chunkid : chunkids) {
-        chunk += "#line ";
-        ifstream ifs(filename);
-        bool extracting = false;
-        int lineno = 1;
-        for (string line; getline(ifs, line); ++lineno) {
-            sregex_token_iterator it(line.begin(), line.end(), pattern, -1);
-            vector<string> tokens(it, {});
-            if (tokens.size() >= 2 && tokens[1] == chunkid) {
-                chunk += to_string(lineno + 1) + "\n";
-                extracting = true;
-                continue;
-            } else if (!extracting) {
-                continue;
-            }
-            if (!line.compare(0, 2, "--")) {
-                extracting = false;
-            } else {
-                chunk += line + "\n";
-            }
+    for (size_t pos = 0; pos < chunkName.size();) {
+        while (pos < chunkName.size() && isspace(chunkName[pos])) {
+            pos++;
+        }
+        size_t end = pos;
+        while (end < chunkName.size() && !isspace(chunkName[end])) {
+            end++;
+        }
+        if (end == pos) {
+            break;
+        }
+        const string chunkid = chunkName.substr(pos, end - pos);
+        pos = end;
+        auto iter = index->chunks.find(chunkid);
+        if (iter == index->chunks.end()) {
+            llog.error("Unable to find {} in {}", chunkid, filename);
+            continue;
+        }
+        const Chunk& found = iter->second;
+        chunk += "#line " + to_string(found.lineNumber) + "\n";
+        chunk.append(index->data + found.offset, found.length);
+        if (found.length > 0 && chunk.back() != '\n') {
+            chunk += '\n';
         }
     }
     return chunk;
 }
 
 void AmberProgram::watchDirectory(const string& directory, FileListener onChange) noexcept {
-    #ifdef SUPPORT_FILEWATCHER
+    #ifdef FILEWATCHER
     AmberProgramImpl& impl = *upcast(this);
     impl.mFileListener.callback = onChange;
     impl.mFileWatcher.addWatch(directory, &impl.mFileListener);
@@ -170,7 +633,7 @@ void AmberProgram::watchDirectory(const string& directory, FileListener onChange
 }
 
 void AmberProgram::checkDirectory() noexcept {
-    #ifdef SUPPORT_FILEWATCHER
+    #ifdef FILEWATCHER
     AmberProgramImpl& impl = *upcast(this);
     impl.mFileWatcher.update();
     #endif
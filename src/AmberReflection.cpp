@@ -0,0 +1,457 @@
+// The MIT License
+// Copyright (c) 2018 Philip Rideout
+
+#include <par/LavaLoader.h>
+#include <par/AmberCompiler.h>
+#include <par/LavaLog.h>
+
+#include <algorithm>
+#include <unordered_map>
+
+using namespace par;
+using namespace std;
+
+// Implements AmberCompiler::reflect with a single pass over the SPIR-V instruction stream, followed
+// by a walk over the variables that it found. Only the handful of opcodes that describe interface
+// variables and their types are interpreted.
+
+namespace {
+
+constexpr uint32_t SPIRV_MAGIC = 0x07230203;
+constexpr uint32_t SPIRV_HEADER_SIZE = 5;
+
+// Opcodes.
+constexpr uint32_t OP_EXECUTION_MODE = 16;
+constexpr uint32_t OP_TYPE_BOOL = 20;
+constexpr uint32_t OP_TYPE_INT = 21;
+constexpr uint32_t OP_TYPE_FLOAT = 22;
+constexpr uint32_t OP_TYPE_VECTOR = 23;
+constexpr uint32_t OP_TYPE_MATRIX = 24;
+constexpr uint32_t OP_TYPE_IMAGE = 25;
+constexpr uint32_t OP_TYPE_SAMPLER = 26;
+constexpr uint32_t OP_TYPE_SAMPLED_IMAGE = 27;
+constexpr uint32_t OP_TYPE_ARRAY = 28;
+constexpr uint32_t OP_TYPE_RUNTIME_ARRAY = 29;
+constexpr uint32_t OP_TYPE_STRUCT = 30;
+constexpr uint32_t OP_TYPE_POINTER = 32;
+constexpr uint32_t OP_CONSTANT = 43;
+constexpr uint32_t OP_CONSTANT_COMPOSITE = 44;
+constexpr uint32_t OP_SPEC_CONSTANT_TRUE = 48;
+constexpr uint32_t OP_SPEC_CONSTANT_FALSE = 49;
+constexpr uint32_t OP_SPEC_CONSTANT = 50;
+constexpr uint32_t OP_SPEC_CONSTANT_COMPOSITE = 51;
+constexpr uint32_t OP_VARIABLE = 59;
+constexpr uint32_t OP_DECORATE = 71;
+constexpr uint32_t OP_MEMBER_DECORATE = 72;
+
+// Decorations.
+constexpr uint32_t DECORATION_SPEC_ID = 1;
+constexpr uint32_t DECORATION_BLOCK = 2;
+constexpr uint32_t DECORATION_BUFFER_BLOCK = 3;
+constexpr uint32_t DECORATION_ARRAY_STRIDE = 6;
+constexpr uint32_t DECORATION_MATRIX_STRIDE = 7;
+constexpr uint32_t DECORATION_BUILTIN = 11;
+constexpr uint32_t DECORATION_LOCATION = 30;
+constexpr uint32_t DECORATION_BINDING = 33;
+constexpr uint32_t DECORATION_DESCRIPTOR_SET = 34;
+constexpr uint32_t DECORATION_OFFSET = 35;
+
+// Storage classes, execution modes, image dimensions, and builtins.
+constexpr uint32_t STORAGE_UNIFORM_CONSTANT = 0;
+constexpr uint32_t STORAGE_INPUT = 1;
+constexpr uint32_t STORAGE_UNIFORM = 2;
+constexpr uint32_t STORAGE_PUSH_CONSTANT = 9;
+constexpr uint32_t STORAGE_STORAGE_BUFFER = 12;
+constexpr uint32_t MODE_LOCAL_SIZE = 17;
+constexpr uint32_t DIM_BUFFER = 5;
+constexpr uint32_t DIM_SUBPASS_DATA = 6;
+constexpr uint32_t BUILTIN_WORKGROUP_SIZE = 25;
+
+struct Type {
+    uint32_t opcode = 0;
+    vector<uint32_t> operands;      // Words that follow the result id.
+};
+
+struct Decorations {
+    bool block = false;
+    bool bufferBlock = false;
+    bool builtin = false;
+    uint32_t builtinKind = 0;
+    uint32_t location = ~0u;
+    uint32_t binding = 0;
+    uint32_t set = 0;
+    uint32_t specId = ~0u;
+    uint32_t arrayStride = 0;
+    unordered_map<uint32_t, uint32_t> memberOffsets;
+    unordered_map<uint32_t, uint32_t> memberMatrixStrides;
+};
+
+struct Variable {
+    uint32_t id;
+    uint32_t pointerType;
+    uint32_t storage;
+};
+
+struct Module {
+    unordered_map<uint32_t, Type> types;
+    unordered_map<uint32_t, uint32_t> constants;
+    unordered_map<uint32_t, vector<uint32_t>> composites;
+    unordered_map<uint32_t, Decorations> decorations;
+    vector<Variable> variables;
+    vector<uint32_t> specConstants;
+    uint32_t localSize[3] = {1, 1, 1};
+
+    Decorations const* getDecorations(uint32_t id) const {
+        auto iter = decorations.find(id);
+        return iter == decorations.end() ? nullptr : &iter->second;
+    }
+
+    Type const* getType(uint32_t id) const {
+        auto iter = types.find(id);
+        return iter == types.end() ? nullptr : &iter->second;
+    }
+
+    uint32_t getArrayLength(Type const* type) const {
+        auto iter = constants.find(type->operands[1]);
+        return iter == constants.end() ? 1 : iter->second;
+    }
+
+    uint32_t getSize(uint32_t typeId, uint32_t matrixStride = 0) const;
+    VkFormat getFormat(uint32_t typeId) const;
+    bool getDescriptorType(uint32_t typeId, uint32_t storage, VkDescriptorType* descType,
+            uint32_t* count) const;
+};
+
+// Returns the size of a type in bytes, honoring explicit layout decorations where present.
+uint32_t Module::getSize(uint32_t typeId, uint32_t matrixStride) const {
+    Type const* type = getType(typeId);
+    if (!type) {
+        return 0;
+    }
+    switch (type->opcode) {
+        case OP_TYPE_BOOL:
+            return 4;
+        case OP_TYPE_INT:
+        case OP_TYPE_FLOAT:
+            return type->operands[0] / 8;
+        case OP_TYPE_VECTOR:
+            return getSize(type->operands[0]) * type->operands[1];
+        case OP_TYPE_MATRIX:
+            return type->operands[1] * (matrixStride ? matrixStride : getSize(type->operands[0]));
+        case OP_TYPE_ARRAY: {
+            Decorations const* decorations = getDecorations(typeId);
+            const uint32_t stride = decorations && decorations->arrayStride ?
+                    decorations->arrayStride : getSize(type->operands[0]);
+            return stride * getArrayLength(type);
+        }
+        case OP_TYPE_STRUCT: {
+            Decorations const* decorations = getDecorations(typeId);
+            uint32_t size = 0;
+            for (uint32_t member = 0; member < type->operands.size(); member++) {
+                uint32_t offset = size;
+                uint32_t stride = 0;
+                if (decorations && decorations->memberOffsets.count(member)) {
+                    offset = decorations->memberOffsets.at(member);
+                }
+                if (decorations && decorations->memberMatrixStrides.count(member)) {
+                    stride = decorations->memberMatrixStrides.at(member);
+                }
+                size = std::max(size, offset + getSize(type->operands[member], stride));
+            }
+            return size;
+        }
+    }
+    return 0;
+}
+
+VkFormat Module::getFormat(uint32_t typeId) const {
+    Type const* type = getType(typeId);
+    if (!type) {
+        return VK_FORMAT_UNDEFINED;
+    }
+    uint32_t ncomponents = 1;
+    if (type->opcode == OP_TYPE_VECTOR) {
+        ncomponents = type->operands[1];
+        type = getType(type->operands[0]);
+    }
+    if (!type || ncomponents < 1 || ncomponents > 4 || type->operands[0] != 32) {
+        return VK_FORMAT_UNDEFINED;
+    }
+    static const VkFormat floats[] = {
+        VK_FORMAT_R32_SFLOAT, VK_FORMAT_R32G32_SFLOAT,
+        VK_FORMAT_R32G32B32_SFLOAT, VK_FORMAT_R32G32B32A32_SFLOAT,
+    };
+    static const VkFormat sints[] = {
+        VK_FORMAT_R32_SINT, VK_FORMAT_R32G32_SINT,
+        VK_FORMAT_R32G32B32_SINT, VK_FORMAT_R32G32B32A32_SINT,
+    };
+    static const VkFormat uints[] = {
+        VK_FORMAT_R32_UINT, VK_FORMAT_R32G32_UINT,
+        VK_FORMAT_R32G32B32_UINT, VK_FORMAT_R32G32B32A32_UINT,
+    };
+    if (type->opcode == OP_TYPE_FLOAT) {
+        return floats[ncomponents - 1];
+    }
+    if (type->opcode == OP_TYPE_INT) {
+        return type->operands[1] ? sints[ncomponents - 1] : uints[ncomponents - 1];
+    }
+    return VK_FORMAT_UNDEFINED;
+}
+
+bool Module::getDescriptorType(uint32_t typeId, uint32_t storage, VkDescriptorType* descType,
+        uint32_t* count) const {
+    Type const* type = getType(typeId);
+    *count = 1;
+    while (type && (type->opcode == OP_TYPE_ARRAY || type->opcode == OP_TYPE_RUNTIME_ARRAY)) {
+        *count *= type->opcode == OP_TYPE_ARRAY ? getArrayLength(type) : 1;
+        typeId = type->operands[0];
+        type = getType(typeId);
+    }
+    if (!type) {
+        return false;
+    }
+    if (storage == STORAGE_STORAGE_BUFFER) {
+        *descType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        return true;
+    }
+    if (storage == STORAGE_UNIFORM) {
+        Decorations const* decorations = getDecorations(typeId);
+        const bool bufferBlock = decorations && decorations->bufferBlock;
+        *descType = bufferBlock ? VK_DESCRIPTOR_TYPE_STORAGE_BUFFER :
+                VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+        return true;
+    }
+    switch (type->opcode) {
+        case OP_TYPE_SAMPLER:
+            *descType = VK_DESCRIPTOR_TYPE_SAMPLER;
+            return true;
+        case OP_TYPE_SAMPLED_IMAGE:
+            *descType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+            return true;
+        case OP_TYPE_IMAGE: {
+            const uint32_t dim = type->operands[1];
+            const bool storageImage = type->operands[5] == 2;
+            if (dim == DIM_SUBPASS_DATA) {
+                *descType = VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT;
+            } else if (dim == DIM_BUFFER) {
+                *descType = storageImage ? VK_DESCRIPTOR_TYPE_STORAGE_TEXEL_BUFFER :
+                        VK_DESCRIPTOR_TYPE_UNIFORM_TEXEL_BUFFER;
+            } else {
+                *descType = storageImage ? VK_DESCRIPTOR_TYPE_STORAGE_IMAGE :
+                        VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE;
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+VkShaderStageFlags getStageFlags(AmberCompiler::Stage stage) {
+    switch (stage) {
+        case AmberCompiler::VERTEX: return VK_SHADER_STAGE_VERTEX_BIT;
+        case AmberCompiler::FRAGMENT: return VK_SHADER_STAGE_FRAGMENT_BIT;
+        case AmberCompiler::COMPUTE: return VK_SHADER_STAGE_COMPUTE_BIT;
+    }
+    return 0;
+}
+
+} // anonymous namespace
+
+bool AmberCompiler::reflect(Stage stage, const vector<uint32_t>& spirv,
+        Reflection* reflection) noexcept {
+    *reflection = {};
+    if (spirv.size() < SPIRV_HEADER_SIZE || spirv[0] != SPIRV_MAGIC) {
+        llog.error("Invalid SPIR-V.");
+        return false;
+    }
+
+    // Gather types, constants, decorations and variables.
+    Module module;
+    vector<uint32_t> localSizeId;
+    for (size_t pos = SPIRV_HEADER_SIZE; pos < spirv.size();) {
+        const uint32_t opcode = spirv[pos] & 0xffff;
+        const uint32_t nwords = spirv[pos] >> 16;
+        if (nwords == 0 || pos + nwords > spirv.size()) {
+            llog.error("Truncated SPIR-V.");
+            return false;
+        }
+        uint32_t const* args = spirv.data() + pos + 1;
+        const uint32_t nargs = nwords - 1;
+        pos += nwords;
+        switch (opcode) {
+            case OP_EXECUTION_MODE:
+                if (nargs >= 5 && args[1] == MODE_LOCAL_SIZE) {
+                    copy(args + 2, args + 5, module.localSize);
+                }
+                break;
+            case OP_TYPE_BOOL:
+            case OP_TYPE_INT:
+            case OP_TYPE_FLOAT:
+            case OP_TYPE_VECTOR:
+            case OP_TYPE_MATRIX:
+            case OP_TYPE_IMAGE:
+            case OP_TYPE_SAMPLER:
+            case OP_TYPE_SAMPLED_IMAGE:
+            case OP_TYPE_ARRAY:
+            case OP_TYPE_RUNTIME_ARRAY:
+            case OP_TYPE_STRUCT:
+            case OP_TYPE_POINTER:
+                if (nargs >= 1) {
+                    Type& type = module.types[args[0]];
+                    type.opcode = opcode;
+                    type.operands.assign(args + 1, args + nargs);
+                }
+                break;
+            case OP_SPEC_CONSTANT_TRUE:
+            case OP_SPEC_CONSTANT_FALSE:
+                if (nargs >= 2) {
+                    module.constants[args[1]] = opcode == OP_SPEC_CONSTANT_TRUE;
+                    module.specConstants.push_back(args[1]);
+                }
+                break;
+            case OP_CONSTANT:
+            case OP_SPEC_CONSTANT:
+                if (nargs >= 3) {
+                    module.constants[args[1]] = args[2];
+                }
+                if (nargs >= 3 && opcode == OP_SPEC_CONSTANT) {
+                    module.specConstants.push_back(args[1]);
+                }
+                break;
+            case OP_CONSTANT_COMPOSITE:
+            case OP_SPEC_CONSTANT_COMPOSITE:
+                if (nargs >= 2) {
+                    module.composites[args[1]].assign(args + 2, args + nargs);
+                }
+                break;
+            case OP_VARIABLE:
+                if (nargs >= 3) {
+                    module.variables.push_back({args[1], args[0], args[2]});
+                }
+                break;
+            case OP_DECORATE: {
+                if (nargs < 2) {
+                    break;
+                }
+                Decorations& decorations = module.decorations[args[0]];
+                const uint32_t literal = nargs >= 3 ? args[2] : 0;
+                switch (args[1]) {
+                    case DECORATION_SPEC_ID: decorations.specId = literal; break;
+                    case DECORATION_BLOCK: decorations.block = true; break;
+                    case DECORATION_BUFFER_BLOCK: decorations.bufferBlock = true; break;
+                    case DECORATION_ARRAY_STRIDE: decorations.arrayStride = literal; break;
+                    case DECORATION_LOCATION: decorations.location = literal; break;
+                    case DECORATION_BINDING: decorations.binding = literal; break;
+                    case DECORATION_DESCRIPTOR_SET: decorations.set = literal; break;
+                    case DECORATION_BUILTIN:
+                        decorations.builtin = true;
+                        decorations.builtinKind = literal;
+                        if (literal == BUILTIN_WORKGROUP_SIZE) {
+                            localSizeId.push_back(args[0]);
+                        }
+                        break;
+                }
+                break;
+            }
+            case OP_MEMBER_DECORATE: {
+                if (nargs < 4) {
+                    break;
+                }
+                Decorations& decorations = module.decorations[args[0]];
+                if (args[2] == DECORATION_OFFSET) {
+                    decorations.memberOffsets[args[1]] = args[3];
+                } else if (args[2] == DECORATION_MATRIX_STRIDE) {
+                    decorations.memberMatrixStrides[args[1]] = args[3];
+                }
+                break;
+            }
+        }
+    }
+
+    // A constant decorated with the WorkgroupSize builtin overrides the LocalSize execution mode.
+    // When the workgroup size comes from specialization constants, this holds the default values.
+    fill(reflection->localSizeIds, reflection->localSizeIds + 3, ~0u);
+    for (uint32_t id : localSizeId) {
+        auto iter = module.composites.find(id);
+        if (iter != module.composites.end() && iter->second.size() == 3) {
+            for (int i = 0; i < 3; i++) {
+                const uint32_t component = iter->second[i];
+                auto constant = module.constants.find(component);
+                if (constant != module.constants.end()) {
+                    module.localSize[i] = constant->second;
+                }
+                Decorations const* decorations = module.getDecorations(component);
+                if (decorations) {
+                    reflection->localSizeIds[i] = decorations->specId;
+                }
+            }
+        }
+    }
+    copy(module.localSize, module.localSize + 3, reflection->localSize);
+
+    // Scalar specialization constants, other than the ones that determine the workgroup size.
+    for (uint32_t id : module.specConstants) {
+        Decorations const* decorations = module.getDecorations(id);
+        if (!decorations || decorations->specId == ~0u ||
+                find(reflection->localSizeIds, reflection->localSizeIds + 3, decorations->specId) !=
+                reflection->localSizeIds + 3) {
+            continue;
+        }
+        reflection->constants.push_back({decorations->specId, module.constants[id]});
+    }
+
+    // Walk the interface variables.
+    const VkShaderStageFlags stageFlags = getStageFlags(stage);
+    for (const Variable& var : module.variables) {
+        Type const* pointer = module.getType(var.pointerType);
+        if (!pointer || pointer->opcode != OP_TYPE_POINTER || pointer->operands.size() < 2) {
+            continue;
+        }
+        const uint32_t typeId = pointer->operands[1];
+        Decorations const* decorations = module.getDecorations(var.id);
+        switch (var.storage) {
+            case STORAGE_INPUT: {
+                if (stage != VERTEX || !decorations || decorations->builtin ||
+                        decorations->location == ~0u) {
+                    break;
+                }
+                reflection->inputs.push_back({decorations->location, module.getFormat(typeId)});
+                break;
+            }
+            case STORAGE_PUSH_CONSTANT: {
+                const uint32_t size = module.getSize(typeId);
+                if (size > 0) {
+                    reflection->pushConstants.push_back({stageFlags, 0, size});
+                }
+                break;
+            }
+            case STORAGE_UNIFORM_CONSTANT:
+            case STORAGE_UNIFORM:
+            case STORAGE_STORAGE_BUFFER: {
+                Reflection::Binding binding {
+                    .set = decorations ? decorations->set : 0,
+                    .binding = decorations ? decorations->binding : 0,
+                    .stages = stageFlags,
+                };
+                if (module.getDescriptorType(typeId, var.storage, &binding.type,
+                        &binding.count)) {
+                    reflection->bindings.push_back(binding);
+                }
+                break;
+            }
+        }
+    }
+    sort(reflection->bindings.begin(), reflection->bindings.end(),
+            [](const Reflection::Binding& a, const Reflection::Binding& b) {
+        return a.set < b.set || (a.set == b.set && a.binding < b.binding);
+    });
+    sort(reflection->constants.begin(), reflection->constants.end(),
+            [](const Reflection::Constant& a, const Reflection::Constant& b) {
+        return a.id < b.id;
+    });
+    sort(reflection->inputs.begin(), reflection->inputs.end(),
+            [](const Reflection::Input& a, const Reflection::Input& b) {
+        return a.location < b.location;
+    });
+    return true;
+}
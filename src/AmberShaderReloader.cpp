@@ -0,0 +1,240 @@
+// The MIT License
+// Copyright (c) 2018 Philip Rideout
+
+#include <par/LavaLoader.h>
+#include <par/AmberCompiler.h>
+#include <par/AmberProgram.h>
+#include <par/AmberShaderReloader.h>
+#include <par/LavaLog.h>
+#include <par/LavaPipeCache.h>
+
+#include <algorithm>
+#include <chrono>
+#include <future>
+#include <unordered_map>
+#include <vector>
+
+#include <sys/stat.h>
+
+#include "LavaInternal.h"
+
+using namespace par;
+using namespace std;
+
+namespace {
+
+using Clock = chrono::high_resolution_clock;
+
+// Polling is cheap (one stat call per file) but there is no need to do it every frame.
+constexpr auto POLL_INTERVAL = chrono::milliseconds(250);
+
+struct WatchedProgram {
+    AmberProgram* program;
+    string filename;
+    string vchunk;
+    string fchunk;
+    string vglsl;
+    string fglsl;
+    LavaPipeCache* pipelines;
+};
+
+// A module that was compiled on the worker thread, or null if compilation failed.
+struct Result {
+    AmberProgram* program;
+    AmberCompiler::Stage stage;
+    VkShaderModule module;
+};
+
+struct AmberShaderReloaderImpl : AmberShaderReloader {
+    ~AmberShaderReloaderImpl() noexcept;
+    void poll() noexcept;
+    uint32_t apply(const vector<Result>& results, ReloadFn onReload) noexcept;
+    WatchedProgram* findProgram(AmberProgram* program) noexcept;
+    VkDevice device;
+    vector<WatchedProgram> programs;
+    unordered_map<string, int64_t> modificationTimes;
+    future<vector<Result>> pending;
+    Clock::time_point lastPoll;
+    Clock::time_point batchStart;
+};
+
+LAVA_DEFINE_UPCAST(AmberShaderReloader)
+
+int64_t getModificationTime(const string& filename) {
+    struct stat st;
+    if (stat(filename.c_str(), &st)) {
+        return 0;
+    }
+    #ifdef __APPLE__
+    return int64_t(st.st_mtimespec.tv_sec) * 1000000000 + st.st_mtimespec.tv_nsec;
+    #else
+    return int64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+    #endif
+}
+
+vector<Result> compileJobs(VkDevice device, vector<AmberCompiler::Job> jobs,
+        vector<AmberProgram*> owners) {
+    AmberCompiler::compileBatch(&jobs);
+    vector<Result> results;
+    for (size_t i = 0; i < jobs.size(); i++) {
+        VkShaderModule module = VK_NULL_HANDLE;
+        if (jobs[i].success) {
+            VkShaderModuleCreateInfo moduleCreateInfo {
+                .sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO,
+                .codeSize = jobs[i].spirv.size() * 4,
+                .pCode = jobs[i].spirv.data()
+            };
+            vkCreateShaderModule(device, &moduleCreateInfo, VKALLOC, &module);
+        }
+        results.push_back({owners[i], jobs[i].stage, module});
+    }
+    return results;
+}
+
+} // anonymous namespace
+
+AmberShaderReloader* AmberShaderReloader::create(Config config) noexcept {
+    auto impl = new AmberShaderReloaderImpl;
+    impl->device = config.device;
+    return impl;
+}
+
+void AmberShaderReloader::operator delete(void* ptr) noexcept {
+    auto impl = (AmberShaderReloaderImpl*) ptr;
+    ::delete impl;
+}
+
+AmberShaderReloaderImpl::~AmberShaderReloaderImpl() noexcept {
+    if (pending.valid()) {
+        for (const Result& result : pending.get()) {
+            if (result.module) {
+                vkDestroyShaderModule(device, result.module, VKALLOC);
+            }
+        }
+    }
+}
+
+WatchedProgram* AmberShaderReloaderImpl::findProgram(AmberProgram* program) noexcept {
+    for (auto& watched : programs) {
+        if (watched.program == program) {
+            return &watched;
+        }
+    }
+    return nullptr;
+}
+
+void AmberShaderReloader::addProgram(AmberProgram* program, const string& filename,
+        const string& vchunk, const string& fchunk, LavaPipeCache* pipelines) noexcept {
+    auto impl = upcast(this);
+    assert(!impl->findProgram(program));
+    if (!impl->modificationTimes.count(filename)) {
+        impl->modificationTimes[filename] = getModificationTime(filename);
+    }
+    impl->programs.push_back({
+        .program = program,
+        .filename = filename,
+        .vchunk = vchunk,
+        .fchunk = fchunk,
+        .vglsl = AmberProgram::getChunk(filename, vchunk),
+        .fglsl = AmberProgram::getChunk(filename, fchunk),
+        .pipelines = pipelines,
+    });
+}
+
+void AmberShaderReloader::removeProgram(AmberProgram* program) noexcept {
+    auto& programs = upcast(this)->programs;
+    programs.erase(remove_if(programs.begin(), programs.end(), [program](const WatchedProgram& w) {
+        return w.program == program;
+    }), programs.end());
+}
+
+uint32_t AmberShaderReloader::update(ReloadFn onReload) noexcept {
+    auto impl = upcast(this);
+    uint32_t count = 0;
+    if (impl->pending.valid() &&
+            impl->pending.wait_for(chrono::seconds(0)) == future_status::ready) {
+        count = impl->apply(impl->pending.get(), onReload);
+    }
+    const auto now = Clock::now();
+    if (!impl->pending.valid() && now - impl->lastPoll >= POLL_INTERVAL) {
+        impl->lastPoll = now;
+        impl->poll();
+    }
+    return count;
+}
+
+// Gathers the stages whose text has changed in modified files, and compiles them asynchronously.
+void AmberShaderReloaderImpl::poll() noexcept {
+    vector<string> changedFiles;
+    for (auto& pair : modificationTimes) {
+        const int64_t mtime = getModificationTime(pair.first);
+        if (mtime != pair.second) {
+            pair.second = mtime;
+            changedFiles.push_back(pair.first);
+        }
+    }
+    if (changedFiles.empty()) {
+        return;
+    }
+    vector<AmberCompiler::Job> jobs;
+    vector<AmberProgram*> owners;
+    for (auto& watched : programs) {
+        if (find(changedFiles.begin(), changedFiles.end(), watched.filename) ==
+                changedFiles.end()) {
+            continue;
+        }
+        string vglsl = AmberProgram::getChunk(watched.filename, watched.vchunk);
+        string fglsl = AmberProgram::getChunk(watched.filename, watched.fchunk);
+        if (vglsl != watched.vglsl) {
+            watched.vglsl = vglsl;
+            jobs.push_back({ .stage = AmberCompiler::VERTEX, .glsl = move(vglsl) });
+            owners.push_back(watched.program);
+        }
+        if (fglsl != watched.fglsl) {
+            watched.fglsl = fglsl;
+            jobs.push_back({ .stage = AmberCompiler::FRAGMENT, .glsl = move(fglsl) });
+            owners.push_back(watched.program);
+        }
+    }
+    if (jobs.empty()) {
+        return;
+    }
+    llog.info("Recompiling {} shaders...", jobs.size());
+    batchStart = Clock::now();
+    pending = async(launch::async, compileJobs, device, move(jobs), move(owners));
+}
+
+// Swaps new modules into programs and pipeline caches. Failed stages keep their old modules.
+uint32_t AmberShaderReloaderImpl::apply(const vector<Result>& results,
+        ReloadFn onReload) noexcept {
+    vector<AmberProgram*> reloaded;
+    for (const Result& result : results) {
+        WatchedProgram* watched = findProgram(result.program);
+        if (!watched || !result.module) {
+            if (result.module) {
+                vkDestroyShaderModule(device, result.module, VKALLOC);
+            }
+            continue;
+        }
+        AmberProgram* program = watched->program;
+        const bool vertex = result.stage == AmberCompiler::VERTEX;
+        const VkShaderModule old = vertex ? program->getVertexShader() :
+                program->getFragmentShader();
+        if (watched->pipelines) {
+            watched->pipelines->replaceShader(old, result.module);
+        }
+        program->replaceShaders(vertex ? result.module : VK_NULL_HANDLE,
+                vertex ? VK_NULL_HANDLE : result.module);
+        if (find(reloaded.begin(), reloaded.end(), program) == reloaded.end()) {
+            reloaded.push_back(program);
+        }
+    }
+    const double milliseconds = chrono::duration<double, milli>(Clock::now() - batchStart).count();
+    llog.info("Reloaded {} programs in {:.1f} ms", reloaded.size(), milliseconds);
+    if (onReload) {
+        for (AmberProgram* program : reloaded) {
+            onReload(program);
+        }
+    }
+    return reloaded.size();
+}
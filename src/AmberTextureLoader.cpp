@@ -0,0 +1,193 @@
+// The MIT License
+// Copyright (c) 2018 Philip Rideout
+
+#include <par/AmberTextureLoader.h>
+#include <par/LavaLog.h>
+#include <par/LavaTexture.h>
+
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <string.h>
+
+// The static flag keeps the decoder private to this file, so that clients can still include their
+// own copy of the stb_image implementation.
+#define STBI_FAILURE_USERMSG
+#define STB_IMAGE_STATIC
+#define STB_IMAGE_IMPLEMENTATION
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wunused-function"
+#include <stb_image.h>
+#pragma clang diagnostic pop
+
+#include "LavaInternal.h"
+
+using namespace par;
+using namespace std;
+
+namespace {
+
+struct Job {
+    string filename;
+    promise<LavaTexture*> result;
+};
+
+struct AmberTextureLoaderImpl : AmberTextureLoader {
+    AmberTextureLoaderImpl(Config config) noexcept;
+    ~AmberTextureLoaderImpl() noexcept;
+    void runWorker() noexcept;
+    LavaTexture* loadKtx(const string& filename) const noexcept;
+    LavaTexture* loadImage(const string& filename) const noexcept;
+    VkDevice device;
+    VkPhysicalDevice gpu;
+    VkFormat format;
+    bool generateMipmaps;
+    vector<thread> workers;
+    mutex queueMutex;
+    condition_variable queueCondition;
+    condition_variable idleCondition;
+    deque<Job> jobs;
+    uint32_t nactive = 0;
+    bool quitting = false;
+};
+
+LAVA_DEFINE_UPCAST(AmberTextureLoader)
+
+bool hasExtension(const string& filename, char const* extension) {
+    const size_t len = strlen(extension);
+    return filename.size() >= len &&
+            !strcasecmp(filename.c_str() + filename.size() - len, extension);
+}
+
+} // anonymous namespace
+
+AmberTextureLoader* AmberTextureLoader::create(Config config) noexcept {
+    return new AmberTextureLoaderImpl(config);
+}
+
+void AmberTextureLoader::operator delete(void* ptr) noexcept {
+    auto impl = (AmberTextureLoaderImpl*) ptr;
+    ::delete impl;
+}
+
+AmberTextureLoaderImpl::AmberTextureLoaderImpl(Config config) noexcept :
+        device(config.device), gpu(config.gpu), generateMipmaps(config.generateMipmaps) {
+    assert(config.device && config.gpu);
+    format = config.format ? config.format : VK_FORMAT_R8G8B8A8_UNORM;
+    uint32_t nthreads = config.threadCount ? config.threadCount : thread::hardware_concurrency();
+    nthreads = std::max(nthreads, 1u);
+    for (uint32_t i = 0; i < nthreads; i++) {
+        workers.emplace_back([this] { runWorker(); });
+    }
+}
+
+AmberTextureLoaderImpl::~AmberTextureLoaderImpl() noexcept {
+    {
+        lock_guard<mutex> lock(queueMutex);
+        quitting = true;
+        queueCondition.notify_all();
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    for (auto& job : jobs) {
+        job.result.set_value(nullptr);
+    }
+}
+
+void AmberTextureLoaderImpl::runWorker() noexcept {
+    while (true) {
+        Job job;
+        {
+            unique_lock<mutex> lock(queueMutex);
+            queueCondition.wait(lock, [this] { return quitting || !jobs.empty(); });
+            if (quitting) {
+                return;
+            }
+            job = move(jobs.front());
+            jobs.pop_front();
+            nactive++;
+        }
+        const bool ktx = hasExtension(job.filename, ".ktx") || hasExtension(job.filename, ".ktx2");
+        job.result.set_value(ktx ? loadKtx(job.filename) : loadImage(job.filename));
+        lock_guard<mutex> lock(queueMutex);
+        if (--nactive == 0 && jobs.empty()) {
+            idleCondition.notify_all();
+        }
+    }
+}
+
+LavaTexture* AmberTextureLoaderImpl::loadKtx(const string& filename) const noexcept {
+    ifstream file(filename, ios::binary | ios::ate);
+    if (!file) {
+        llog.error("Unable to open {}.", filename);
+        return nullptr;
+    }
+    vector<char> contents((size_t) file.tellg());
+    file.seekg(0);
+    file.read(contents.data(), contents.size());
+    LavaTexture* texture = LavaTexture::createFromKtx({
+        .device = device,
+        .gpu = gpu,
+        .data = contents.data(),
+        .size = (uint32_t) contents.size()
+    });
+    if (!texture) {
+        llog.error("Unable to load {}.", filename);
+    }
+    return texture;
+}
+
+LavaTexture* AmberTextureLoaderImpl::loadImage(const string& filename) const noexcept {
+    int width, height;
+    stbi_uc* texels = stbi_load(filename.c_str(), &width, &height, 0, 4);
+    if (!texels) {
+        llog.error("{}: {}.", filename, stbi_failure_reason());
+        return nullptr;
+    }
+
+    // stb_image always allocates its own result, so the decoded texels are copied into the
+    // staging area exactly once.
+    const uint32_t size = width * height * 4u;
+    LavaTexture* texture = LavaTexture::create({
+        .device = device,
+        .gpu = gpu,
+        .size = size,
+        .width = (uint32_t) width,
+        .height = (uint32_t) height,
+        .format = format,
+        .generateMipmaps = generateMipmaps,
+    });
+    memcpy(texture->mapStage(), texels, size);
+    texture->unmapStage();
+    stbi_image_free(texels);
+    return texture;
+}
+
+AmberTextureLoader::Future AmberTextureLoader::load(const string& filename) noexcept {
+    AmberTextureLoaderImpl& impl = *upcast(this);
+    Job job { filename };
+    Future future = job.result.get_future().share();
+    lock_guard<mutex> lock(impl.queueMutex);
+    impl.jobs.emplace_back(move(job));
+    impl.queueCondition.notify_one();
+    return future;
+}
+
+bool AmberTextureLoader::isReady(const Future& future) noexcept {
+    return future.wait_for(chrono::seconds(0)) == future_status::ready;
+}
+
+void AmberTextureLoader::wait() noexcept {
+    AmberTextureLoaderImpl& impl = *upcast(this);
+    unique_lock<mutex> lock(impl.queueMutex);
+    impl.idleCondition.wait(lock, [&impl] { return impl.jobs.empty() && impl.nactive == 0; });
+}
+
+uint32_t AmberTextureLoader::getThreadCount() const noexcept {
+    return (uint32_t) upcast(this)->workers.size();
+}
@@ -0,0 +1,386 @@
+// The MIT License
+// Copyright (c) 2018 Philip Rideout
+
+#include <par/LavaLoader.h>
+#include <par/LavaBufferHeap.h>
+#include <par/LavaLog.h>
+
+#include <vector>
+
+#include "LavaInternal.h"
+
+using namespace par;
+using namespace std;
+
+namespace {
+
+constexpr uint32_t DEFAULT_BLOCK_SIZE = 64 * 1024 * 1024;
+constexpr uint32_t KIND_COUNT = 4;
+constexpr uint32_t NONE = ~0u;
+
+// Sizes are binned using a tiny floating point representation with a 3-bit mantissa, which gives
+// 8 second-level bins per power of two. Sizes are expressed in units of the heap's alignment, so a
+// 32-bit unit count never overflows the 256 bins.
+constexpr uint32_t MANTISSA_BITS = 3;
+constexpr uint32_t MANTISSA_VALUE = 1 << MANTISSA_BITS;
+constexpr uint32_t MANTISSA_MASK = MANTISSA_VALUE - 1;
+constexpr uint32_t TOP_BINS = 32;
+constexpr uint32_t BIN_COUNT = TOP_BINS * MANTISSA_VALUE;
+
+uint32_t binRoundDown(uint32_t size) {
+    if (size < MANTISSA_VALUE) {
+        return size;
+    }
+    const uint32_t highestBit = 31 - __builtin_clz(size);
+    const uint32_t exponent = highestBit - MANTISSA_BITS + 1;
+    const uint32_t mantissa = (size >> (exponent - 1)) & MANTISSA_MASK;
+    return (exponent << MANTISSA_BITS) | mantissa;
+}
+
+uint32_t binRoundUp(uint32_t size) {
+    const uint32_t bin = binRoundDown(size);
+    if (size < MANTISSA_VALUE) {
+        return bin;
+    }
+    const uint32_t highestBit = 31 - __builtin_clz(size);
+    const uint32_t lowBits = (1u << (highestBit - MANTISSA_BITS)) - 1;
+    return (size & lowBits) ? bin + 1 : bin;
+}
+
+// Offset-only TLSF allocator. Free nodes live in doubly-linked lists, one per bin, and every node
+// is also linked to its physical neighbors so that adjacent free nodes can be merged.
+class Tlsf {
+public:
+    explicit Tlsf(uint32_t size);
+    uint32_t allocate(uint32_t size, uint32_t* offset);
+    void free(uint32_t node);
+    uint32_t getUsedSize() const { return mUsedSize; }
+private:
+    struct Node {
+        uint32_t offset;
+        uint32_t size;
+        uint32_t binPrev;
+        uint32_t binNext;
+        uint32_t neighborPrev;
+        uint32_t neighborNext;
+        bool used;
+    };
+    uint32_t findFree(uint32_t size) const;
+    uint32_t createNode(uint32_t offset, uint32_t size, uint32_t prev, uint32_t next);
+    void insertFree(uint32_t node);
+    void removeFree(uint32_t node);
+    void releaseNode(uint32_t node);
+    vector<Node> mNodes;
+    vector<uint32_t> mFreeNodes;
+    uint32_t mBinHeads[BIN_COUNT];
+    uint32_t mTopBitmap = 0;
+    uint8_t mBinBitmaps[TOP_BINS] = {};
+    uint32_t mUsedSize = 0;
+};
+
+Tlsf::Tlsf(uint32_t size) {
+    for (auto& head : mBinHeads) {
+        head = NONE;
+    }
+    insertFree(createNode(0, size, NONE, NONE));
+}
+
+uint32_t Tlsf::createNode(uint32_t offset, uint32_t size, uint32_t prev, uint32_t next) {
+    uint32_t index;
+    if (mFreeNodes.empty()) {
+        index = (uint32_t) mNodes.size();
+        mNodes.push_back({});
+    } else {
+        index = mFreeNodes.back();
+        mFreeNodes.pop_back();
+    }
+    mNodes[index] = { offset, size, NONE, NONE, prev, next, false };
+    return index;
+}
+
+void Tlsf::releaseNode(uint32_t node) {
+    mFreeNodes.push_back(node);
+}
+
+void Tlsf::insertFree(uint32_t index) {
+    Node& node = mNodes[index];
+    const uint32_t bin = binRoundDown(node.size);
+    node.binPrev = NONE;
+    node.binNext = mBinHeads[bin];
+    if (node.binNext != NONE) {
+        mNodes[node.binNext].binPrev = index;
+    }
+    mBinHeads[bin] = index;
+    mTopBitmap |= 1u << (bin >> MANTISSA_BITS);
+    mBinBitmaps[bin >> MANTISSA_BITS] |= 1u << (bin & MANTISSA_MASK);
+}
+
+void Tlsf::removeFree(uint32_t index) {
+    Node& node = mNodes[index];
+    if (node.binPrev != NONE) {
+        mNodes[node.binPrev].binNext = node.binNext;
+    } else {
+        const uint32_t bin = binRoundDown(node.size);
+        mBinHeads[bin] = node.binNext;
+        if (node.binNext == NONE) {
+            const uint32_t top = bin >> MANTISSA_BITS;
+            mBinBitmaps[top] &= ~(1u << (bin & MANTISSA_MASK));
+            if (mBinBitmaps[top] == 0) {
+                mTopBitmap &= ~(1u << top);
+            }
+        }
+    }
+    if (node.binNext != NONE) {
+        mNodes[node.binNext].binPrev = node.binPrev;
+    }
+}
+
+// Returns the node index and sets the offset, or returns NONE if there is no room.
+uint32_t Tlsf::allocate(uint32_t size, uint32_t* offset) {
+    const uint32_t index = findFree(size);
+    if (index == NONE) {
+        return NONE;
+    }
+    removeFree(index);
+
+    // Split off the remainder into a new free node.
+    const uint32_t remainder = mNodes[index].size - size;
+    if (remainder > 0) {
+        const uint32_t next = mNodes[index].neighborNext;
+        const uint32_t split = createNode(mNodes[index].offset + size, remainder, index, next);
+        if (next != NONE) {
+            mNodes[next].neighborPrev = split;
+        }
+        mNodes[index].neighborNext = split;
+        mNodes[index].size = size;
+        insertFree(split);
+    }
+    mNodes[index].used = true;
+    mUsedSize += size;
+    *offset = mNodes[index].offset;
+    return index;
+}
+
+// Returns a free node that is large enough for the given size, or NONE.
+uint32_t Tlsf::findFree(uint32_t size) const {
+    // Round up so that any node found in the bin is guaranteed to be large enough.
+    const uint32_t minBin = binRoundUp(size);
+    uint32_t top = minBin >> MANTISSA_BITS;
+    uint32_t bins = top < TOP_BINS ? mBinBitmaps[top] & (~0u << (minBin & MANTISSA_MASK)) : 0;
+    if (bins == 0) {
+        const uint32_t tops = top + 1 < TOP_BINS ? mTopBitmap & (~0u << (top + 1)) : 0;
+        if (tops != 0) {
+            top = __builtin_ctz(tops);
+            bins = mBinBitmaps[top];
+        }
+    }
+    if (bins != 0) {
+        return mBinHeads[(top << MANTISSA_BITS) | __builtin_ctz(bins)];
+    }
+
+    // Nodes in the rounded-down bin might still be large enough, for example when the request
+    // spans an entire block.
+    for (uint32_t index = mBinHeads[binRoundDown(size)]; index != NONE;
+            index = mNodes[index].binNext) {
+        if (mNodes[index].size >= size) {
+            return index;
+        }
+    }
+    return NONE;
+}
+
+void Tlsf::free(uint32_t index) {
+    assert(mNodes[index].used);
+    mUsedSize -= mNodes[index].size;
+    mNodes[index].used = false;
+
+    // Merge with the physical neighbors if they are free.
+    const uint32_t prev = mNodes[index].neighborPrev;
+    if (prev != NONE && !mNodes[prev].used) {
+        removeFree(prev);
+        mNodes[prev].size += mNodes[index].size;
+        mNodes[prev].neighborNext = mNodes[index].neighborNext;
+        if (mNodes[index].neighborNext != NONE) {
+            mNodes[mNodes[index].neighborNext].neighborPrev = prev;
+        }
+        releaseNode(index);
+        index = prev;
+    }
+    const uint32_t next = mNodes[index].neighborNext;
+    if (next != NONE && !mNodes[next].used) {
+        removeFree(next);
+        mNodes[index].size += mNodes[next].size;
+        mNodes[index].neighborNext = mNodes[next].neighborNext;
+        if (mNodes[next].neighborNext != NONE) {
+            mNodes[mNodes[next].neighborNext].neighborPrev = index;
+        }
+        releaseNode(next);
+    }
+    insertFree(index);
+}
+
+struct Block {
+    VkBuffer buffer;
+    VmaAllocation memory;
+    uint32_t units;
+    Tlsf allocator;
+};
+
+struct Grave {
+    uint64_t handle;
+    uint64_t frame;
+};
+
+struct LavaBufferHeapImpl : LavaBufferHeap {
+    LavaBufferHeapImpl(Config config) noexcept;
+    ~LavaBufferHeapImpl() noexcept;
+    Block* createBlock(Kind kind, uint32_t units) noexcept;
+    void recycle(uint64_t handle) noexcept;
+    VkDevice device;
+    VmaAllocator vma;
+    uint32_t blockSize;
+    uint32_t alignment[KIND_COUNT];
+    vector<Block*> blocks[KIND_COUNT];
+    vector<Grave> graveyard;
+    uint64_t currentFrame = 0;
+    uint32_t rangeCount = 0;
+};
+
+LAVA_DEFINE_UPCAST(LavaBufferHeap)
+
+constexpr VkBufferUsageFlags KIND_USAGE[KIND_COUNT] = {
+    VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+    VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
+    VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
+    VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT,
+};
+
+// Handles pack the kind, the block index, and the TLSF node index.
+uint64_t encodeHandle(uint32_t kind, uint32_t block, uint32_t node) {
+    return (uint64_t(kind) << 56) | (uint64_t(block) << 32) | node;
+}
+
+}
+
+LavaBufferHeap* LavaBufferHeap::create(Config config) noexcept {
+    return new LavaBufferHeapImpl(config);
+}
+
+void LavaBufferHeap::operator delete(void* ptr) {
+    auto impl = (LavaBufferHeapImpl*) ptr;
+    ::delete impl;
+}
+
+LavaBufferHeapImpl::LavaBufferHeapImpl(Config config) noexcept : device(config.device) {
+    assert(config.device && config.gpu);
+    vma = getVma(config.device, config.gpu);
+    blockSize = config.blockSize ? config.blockSize : DEFAULT_BLOCK_SIZE;
+    VkPhysicalDeviceProperties props;
+    vkGetPhysicalDeviceProperties(config.gpu, &props);
+    alignment[VERTEX] = 16;
+    alignment[INDEX] = 4;
+    alignment[UNIFORM] = (uint32_t) props.limits.minUniformBufferOffsetAlignment;
+    alignment[STORAGE] = (uint32_t) props.limits.minStorageBufferOffsetAlignment;
+    for (auto& align : alignment) {
+        align = align < 4 ? 4 : align;
+        LOG_CHECK((align & (align - 1)) == 0, "Buffer offset alignment must be a power of two.");
+    }
+}
+
+LavaBufferHeapImpl::~LavaBufferHeapImpl() noexcept {
+    for (auto& kind : blocks) {
+        for (Block* block : kind) {
+            untrackAllocation(vma, block->memory);
+            vmaDestroyBuffer(vma, block->buffer, block->memory);
+            delete block;
+        }
+    }
+}
+
+Block* LavaBufferHeapImpl::createBlock(Kind kind, uint32_t units) noexcept {
+    const uint32_t defaultUnits = blockSize / alignment[kind];
+    units = units > defaultUnits ? units : defaultUnits;
+    VkBufferCreateInfo bufferInfo {
+        .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+        .size = VkDeviceSize(units) * alignment[kind],
+        .usage = KIND_USAGE[kind] | VK_BUFFER_USAGE_TRANSFER_DST_BIT
+    };
+    VmaAllocationCreateInfo allocInfo { .usage = VMA_MEMORY_USAGE_GPU_ONLY };
+    VkBuffer buffer;
+    VmaAllocation memory;
+    VkResult result = vmaCreateBuffer(vma, &bufferInfo, &allocInfo, &buffer, &memory, nullptr);
+    if (result != VK_SUCCESS) {
+        llog.error("LavaBufferHeap: unable to allocate {} bytes.", bufferInfo.size);
+        return nullptr;
+    }
+    trackAllocation(vma, memory, MEMORY_BUFFER);
+    Block* block = new Block { buffer, memory, units, Tlsf(units) };
+    blocks[kind].push_back(block);
+    return block;
+}
+
+LavaBufferHeap::Range LavaBufferHeap::allocate(Kind kind, uint32_t size) noexcept {
+    auto impl = upcast(this);
+    assert(size > 0);
+    const uint32_t align = impl->alignment[kind];
+    const uint32_t units = (size + align - 1) / align;
+    auto& blocks = impl->blocks[kind];
+    uint32_t offset;
+    for (uint32_t i = 0; i < blocks.size(); i++) {
+        const uint32_t node = blocks[i]->allocator.allocate(units, &offset);
+        if (node != NONE) {
+            impl->rangeCount++;
+            return {blocks[i]->buffer, offset * align, size, encodeHandle(kind, i, node)};
+        }
+    }
+    Block* block = impl->createBlock(kind, units);
+    if (!block) {
+        return {};
+    }
+    const uint32_t node = block->allocator.allocate(units, &offset);
+    assert(node != NONE);
+    impl->rangeCount++;
+    return {block->buffer, offset * align, size, encodeHandle(kind, blocks.size() - 1, node)};
+}
+
+void LavaBufferHeap::free(const Range& range) noexcept {
+    auto impl = upcast(this);
+    assert(range.buffer);
+    impl->graveyard.push_back({range.handle, impl->currentFrame});
+}
+
+void LavaBufferHeapImpl::recycle(uint64_t handle) noexcept {
+    const uint32_t kind = handle >> 56;
+    const uint32_t block = (handle >> 32) & 0xffffff;
+    const uint32_t node = handle & 0xffffffff;
+    blocks[kind][block]->allocator.free(node);
+    rangeCount--;
+}
+
+void LavaBufferHeap::releaseUnused() noexcept {
+    auto impl = upcast(this);
+    const uint64_t currentFrame = ++impl->currentFrame;
+
+    // Graves are appended in frame order, so the expired ones are always at the front.
+    auto& graveyard = impl->graveyard;
+    size_t expired = 0;
+    while (expired < graveyard.size() &&
+            graveyard[expired].frame + FRAMES_IN_FLIGHT <= currentFrame) {
+        impl->recycle(graveyard[expired++].handle);
+    }
+    graveyard.erase(graveyard.begin(), graveyard.begin() + expired);
+}
+
+LavaBufferHeap::Stats LavaBufferHeap::getStats() const noexcept {
+    auto impl = upcast(this);
+    Stats stats {};
+    for (uint32_t kind = 0; kind < KIND_COUNT; kind++) {
+        for (Block* block : impl->blocks[kind]) {
+            stats.blockBytes += uint64_t(block->units) * impl->alignment[kind];
+            stats.usedBytes += uint64_t(block->allocator.getUsedSize()) * impl->alignment[kind];
+            stats.blockCount++;
+        }
+    }
+    stats.rangeCount = impl->rangeCount;
+    return stats;
+}
@@ -4,7 +4,9 @@
 #include <par/LavaLoader.h>
 #include <par/LavaContext.h>
 #include <par/LavaLog.h>
+#include <par/LavaTrace.h>
 
+#include <algorithm>
 #include <string>
 
 #include "LavaInternal.h"
@@ -21,6 +23,19 @@ namespace par {
 using namespace par;
 using namespace std;
 
+// The bundled Vulkan headers predate VK_EXT_memory_budget, so declare the bits that we need.
+#ifndef VK_EXT_memory_budget
+#define VK_EXT_MEMORY_BUDGET_EXTENSION_NAME "VK_EXT_memory_budget"
+static const VkStructureType VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_BUDGET_PROPERTIES_EXT =
+        (VkStructureType) 1000237000;
+typedef struct VkPhysicalDeviceMemoryBudgetPropertiesEXT {
+    VkStructureType sType;
+    void* pNext;
+    VkDeviceSize heapBudget[VK_MAX_MEMORY_HEAPS];
+    VkDeviceSize heapUsage[VK_MAX_MEMORY_HEAPS];
+} VkPhysicalDeviceMemoryBudgetPropertiesEXT;
+#endif
+
 static LavaVector<const char *> kRequiredExtensions {
     "VK_KHR_surface",
 #if defined(__APPLE__)
@@ -78,6 +93,10 @@ struct LavaContextImpl : LavaContext {
     VkPhysicalDeviceProperties mGpuProps;
     VkPhysicalDeviceFeatures mGpuFeatures;
     VkQueue mQueue;
+    uint32_t mQueueFamilyIndex;
+    bool mHasProperties2 = false;
+    bool mHasMemoryBudget = false;
+    RelocationCallback mRelocationCallback;
     VkFormat mSwapChainFormat;
     VkColorSpaceKHR mColorSpace;
     VkPhysicalDeviceMemoryProperties mMemoryProperties;
@@ -97,6 +116,8 @@ struct LavaContextImpl : LavaContext {
     VkFence mWorkFence;
     uint32_t mCurrentSwapIndex = ~0u;
     LavaRecording* mCurrentRecording {};
+    VkFence mRecordingFences[2] {};     // Most recent presentRecording fence for each swap image.
+    VmaStatInfo mDefragmentedStats {};  // Totals at the end of the last complete defragmentation.
     VkDebugReportCallbackEXT mDebugCallback {};
     VkClearValue mClearValue {};
     const Config mConfig;
@@ -127,6 +148,7 @@ LavaContextImpl::~LavaContextImpl() noexcept {
 }
 
 static bool isExtensionSupported(const string& ext) noexcept;
+static bool isDeviceExtensionSupported(VkPhysicalDevice gpu, const string& ext) noexcept;
 static bool areAllLayersSupported(const LavaVector<VkLayerProperties>& props,
     const LavaVector<const char*>& layerNames) noexcept;
 
@@ -159,6 +181,10 @@ LavaContextImpl::LavaContextImpl(Config config) noexcept :
         llog.info("Enabling instance extension {}.", VK_EXT_DEBUG_REPORT_EXTENSION_NAME);
         mEnabledExtensions.push_back(VK_EXT_DEBUG_REPORT_EXTENSION_NAME);
     }
+    if (isExtensionSupported(VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME)) {
+        mEnabledExtensions.push_back(VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME);
+        mHasProperties2 = true;
+    }
 
     // Create the instance.
     const VkApplicationInfo app {
@@ -255,6 +281,13 @@ void LavaContextImpl::initDevice(VkSurfaceKHR surface) noexcept {
     mEnabledExtensions.clear();
     mEnabledExtensions.push_back(VK_KHR_SWAPCHAIN_EXTENSION_NAME);
 
+    // The memory budget extension lets getMemoryStats report the budget for this process.
+    if (mHasProperties2 && isDeviceExtensionSupported(mGpu, VK_EXT_MEMORY_BUDGET_EXTENSION_NAME)) {
+        llog.info("Enabling device extension {}.", VK_EXT_MEMORY_BUDGET_EXTENSION_NAME);
+        mEnabledExtensions.push_back(VK_EXT_MEMORY_BUDGET_EXTENSION_NAME);
+        mHasMemoryBudget = true;
+    }
+
     // Obtain various information about the GPU.
     vkGetPhysicalDeviceProperties(mGpu, &mGpuProps);
     vkGetPhysicalDeviceFeatures(mGpu, &mGpuFeatures);
@@ -307,6 +340,7 @@ void LavaContextImpl::initDevice(VkSurfaceKHR surface) noexcept {
     LOG_CHECK(not error, "Unable to create Vulkan device.");
     vkGetPhysicalDeviceMemoryProperties(mGpu, &mMemoryProperties);
     vkGetDeviceQueue(mDevice, graphicsQueueNodeIndex, 0, &mQueue);
+    mQueueFamilyIndex = graphicsQueueNodeIndex;
 
     // Debug callbacks. This doesn't build on 32-bit Android.
     #if ULONG_MAX != UINT_MAX
@@ -391,7 +425,7 @@ void LavaContextImpl::initDevice(VkSurfaceKHR surface) noexcept {
     LOG_CHECK(2 >= surfCapabilities.minImageCount && 2 <= surfCapabilities.maxImageCount,
             "Double buffering not supported.");
 
-    // Create the VkSwapchainKHR
+    // Create the VkSwapchainKHR. If possible, allow the images to be copied from for readback.
     VkSurfaceTransformFlagBitsKHR preTransform;
     if (surfCapabilities.supportedTransforms & VK_SURFACE_TRANSFORM_IDENTITY_BIT_KHR) {
         preTransform = VK_SURFACE_TRANSFORM_IDENTITY_BIT_KHR;
@@ -405,7 +439,8 @@ void LavaContextImpl::initDevice(VkSurfaceKHR surface) noexcept {
         .imageFormat = mSwapChainFormat,
         .imageColorSpace = mColorSpace,
         .imageExtent = mExtent,
-        .imageUsage = VkImageUsageFlags(VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT),
+        .imageUsage = VkImageUsageFlags(VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT) |
+                (surfCapabilities.supportedUsageFlags & VK_IMAGE_USAGE_TRANSFER_SRC_BIT),
         .preTransform =  preTransform,
         .compositeAlpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR,
         .imageArrayLayers = 1,
@@ -794,10 +829,12 @@ bool LavaContextImpl::determineMemoryType(uint32_t typeBits, VkFlags requirement
 }
 
 VkCommandBuffer LavaContext::beginFrame() noexcept {
+    LAVA_TRACE_SCOPE("LavaContext::beginFrame");
     return upcast(this)->beginFrame();
 }
 
 void LavaContext::endFrame() noexcept {
+    LAVA_TRACE_SCOPE("LavaContext::endFrame");
     upcast(this)->endFrame();
 }
 
@@ -825,6 +862,10 @@ VkQueue LavaContext::getQueue() const noexcept {
     return upcast(this)->mQueue;
 }
 
+uint32_t LavaContext::getQueueFamilyIndex() const noexcept {
+    return upcast(this)->mQueueFamilyIndex;
+}
+
 VkFormat LavaContext::getFormat() const noexcept {
     return upcast(this)->mSwapChainFormat;
 }
@@ -837,6 +878,197 @@ const VkPhysicalDeviceMemoryProperties& LavaContext::getMemoryProperties() const
     return upcast(this)->mMemoryProperties;
 }
 
+LavaContext::MemoryStats LavaContext::getMemoryStats() const noexcept {
+    auto impl = upcast(this);
+    const VkPhysicalDeviceMemoryProperties& props = impl->mMemoryProperties;
+    VmaAllocator vma = getVma(impl->mDevice, impl->mGpu);
+    VmaStats vmaStats;
+    vmaCalculateStats(vma, &vmaStats);
+
+    VkPhysicalDeviceMemoryBudgetPropertiesEXT budget {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_BUDGET_PROPERTIES_EXT
+    };
+    MemoryStats stats {};
+    if (impl->mHasMemoryBudget && vkGetPhysicalDeviceMemoryProperties2KHR) {
+        VkPhysicalDeviceMemoryProperties2 props2 {
+            .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_PROPERTIES_2,
+            .pNext = &budget
+        };
+        vkGetPhysicalDeviceMemoryProperties2KHR(impl->mGpu, &props2);
+        stats.hasBudget = true;
+    }
+
+    stats.heapCount = props.memoryHeapCount;
+    for (uint32_t i = 0; i < props.memoryHeapCount; i++) {
+        const VmaStatInfo& info = vmaStats.memoryHeap[i];
+        MemoryHeapStats& heap = stats.heaps[i];
+        heap.size = props.memoryHeaps[i].size;
+        heap.blockBytes = info.usedBytes + info.unusedBytes;
+        heap.allocatedBytes = info.usedBytes;
+        heap.blockCount = info.blockCount;
+        heap.allocationCount = info.allocationCount;
+        heap.deviceLocal = props.memoryHeaps[i].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT;
+        heap.budget = stats.hasBudget ? budget.heapBudget[i] : heap.size;
+        heap.usage = stats.hasBudget ? budget.heapUsage[i] : heap.blockBytes;
+    }
+
+    const MemoryTotals totals = getMemoryTotals(vma);
+    auto category = [&totals](MemoryCategory cat) -> MemoryCategoryStats {
+        return { totals.bytes[cat], totals.count[cat] };
+    };
+    stats.buffers = category(MEMORY_BUFFER);
+    stats.textures = category(MEMORY_TEXTURE);
+    stats.attachments = category(MEMORY_ATTACHMENT);
+    stats.staging = category(MEMORY_STAGING);
+    return stats;
+}
+
+std::string LavaContext::getMemoryStatsJson(bool detailed) const noexcept {
+    auto impl = upcast(this);
+    const MemoryStats stats = getMemoryStats();
+    string json = "{\n\"Lava\": {\n\"HasBudget\": ";
+    json += stats.hasBudget ? "true" : "false";
+    json += ",\n\"Heaps\": [";
+    for (uint32_t i = 0; i < stats.heapCount; i++) {
+        const MemoryHeapStats& heap = stats.heaps[i];
+        json += i ? ",\n" : "\n";
+        json += "{\"Size\": " + to_string(heap.size);
+        json += ", \"Budget\": " + to_string(heap.budget);
+        json += ", \"Usage\": " + to_string(heap.usage);
+        json += ", \"BlockBytes\": " + to_string(heap.blockBytes);
+        json += ", \"AllocatedBytes\": " + to_string(heap.allocatedBytes);
+        json += ", \"Blocks\": " + to_string(heap.blockCount);
+        json += ", \"Allocations\": " + to_string(heap.allocationCount);
+        json += ", \"DeviceLocal\": ";
+        json += heap.deviceLocal ? "true}" : "false}";
+    }
+    json += "\n],\n\"Categories\": {";
+    auto category = [&json](const char* name, const MemoryCategoryStats& cat, bool last) {
+        json += "\n\"" + string(name) + "\": {\"Bytes\": " + to_string(cat.bytes);
+        json += ", \"Count\": " + to_string(cat.count) + (last ? "}" : "},");
+    };
+    category("Buffers", stats.buffers, false);
+    category("Textures", stats.textures, false);
+    category("Attachments", stats.attachments, false);
+    category("Staging", stats.staging, true);
+    json += "\n}\n},\n\"Vma\": ";
+    VmaAllocator vma = getVma(impl->mDevice, impl->mGpu);
+    char* vmaJson;
+    vmaBuildStatsString(vma, &vmaJson, detailed ? VK_TRUE : VK_FALSE);
+    json += vmaJson;
+    vmaFreeStatsString(vma, vmaJson);
+    json += "\n}\n";
+    return json;
+}
+
+// Returns true if some memory type that holds movable allocations has enough free space to absorb
+// the contents of an average block, which is roughly what it takes for defragmentation to release
+// a VkDeviceMemory block.
+static bool hasReclaimableBlocks(VmaAllocator vma, const vector<VmaAllocation>& allocations,
+        const VmaStats& stats) {
+    uint32_t checked = 0;
+    for (VmaAllocation allocation : allocations) {
+        VmaAllocationInfo info;
+        vmaGetAllocationInfo(vma, allocation, &info);
+        if (checked & (1u << info.memoryType)) {
+            continue;
+        }
+        checked |= 1u << info.memoryType;
+        const VmaStatInfo& type = stats.memoryType[info.memoryType];
+        if (type.blockCount > 1 && type.unusedBytes * type.blockCount >= type.usedBytes) {
+            return true;
+        }
+    }
+    return false;
+}
+
+LavaContext::DefragStats LavaContext::defragment(VkDeviceSize maxBytes,
+        uint32_t maxMilliseconds) noexcept {
+    // Moving a handful of allocations per step lets us check the time budget regularly.
+    constexpr uint32_t ALLOCATIONS_PER_STEP = 16;
+    auto impl = upcast(this);
+    VmaAllocator vma = getVma(impl->mDevice, impl->mGpu);
+    vector<VmaAllocation> allocations = getMovableAllocations(vma);
+    DefragStats stats {};
+    if (allocations.empty()) {
+        stats.complete = true;
+        return stats;
+    }
+
+    // Skip the wait below when there is nothing to gain, either because no block could be emptied
+    // or because nothing has been allocated or freed since the last complete pass.
+    VmaStats vmaStats;
+    vmaCalculateStats(vma, &vmaStats);
+    const VmaStatInfo& total = vmaStats.total;
+    const VmaStatInfo& last = impl->mDefragmentedStats;
+    if (!hasReclaimableBlocks(vma, allocations, vmaStats) || (total.blockCount ==
+            last.blockCount && total.allocationCount == last.allocationCount &&
+            total.usedBytes == last.usedBytes && total.unusedBytes == last.unusedBytes)) {
+        stats.complete = true;
+        return stats;
+    }
+
+    // Memory is moved with the CPU, so wait for the frames and work that might still be in flight.
+    // This does not include submissions that bypass LavaContext.
+    vector<VkFence> fences;
+    for (VkFence fence : {impl->mSwap[0].fence, impl->mSwap[1].fence, impl->mWorkFence,
+            impl->mRecordingFences[0], impl->mRecordingFences[1]}) {
+        if (fence) {
+            fences.push_back(fence);
+        }
+    }
+    vkWaitForFences(impl->mDevice, (uint32_t) fences.size(), fences.data(), VK_TRUE, ~0ull);
+
+    const uint64_t startTime = getCurrentTime();
+    vector<VkBool32> changed(allocations.size());
+    while (true) {
+        VmaDefragmentationInfo info {
+            .maxBytesToMove = maxBytes ? maxBytes - stats.bytesMoved : VK_WHOLE_SIZE,
+            .maxAllocationsToMove = ALLOCATIONS_PER_STEP
+        };
+        VmaDefragmentationStats step {};
+        std::fill(changed.begin(), changed.end(), VK_FALSE);
+        VkResult result = vmaDefragment(vma, allocations.data(), allocations.size(),
+                changed.data(), &info, &step);
+        stats.bytesMoved += step.bytesMoved;
+        stats.bytesFreed += step.bytesFreed;
+        stats.allocationsMoved += step.allocationsMoved;
+        stats.blocksFreed += step.deviceMemoryBlocksFreed;
+        for (size_t i = 0; i < allocations.size(); i++) {
+            if (!changed[i]) {
+                continue;
+            }
+            const Relocation reloc = relocateAllocation(vma, allocations[i]);
+            if (impl->mRelocationCallback) {
+                impl->mRelocationCallback(reloc);
+            }
+        }
+        if (result == VK_SUCCESS) {
+            stats.complete = true;
+            vmaCalculateStats(vma, &vmaStats);
+            impl->mDefragmentedStats = vmaStats.total;
+            break;
+        }
+        if (result != VK_INCOMPLETE) {
+            llog.error("vmaDefragment failed with error {}.", result);
+            break;
+        }
+        if (step.allocationsMoved == 0 || (maxBytes && stats.bytesMoved >= maxBytes)) {
+            break;
+        }
+        if (maxMilliseconds && getCurrentTime() - startTime >= maxMilliseconds) {
+            break;
+        }
+    }
+    llog.debug("Defragmentation moved {} allocations ({} bytes), freed {} blocks.",
+            stats.allocationsMoved, stats.bytesMoved, stats.blocksFreed);
+    return stats;
+}
+
+void LavaContext::setRelocationCallback(RelocationCallback callback) noexcept {
+    upcast(this)->mRelocationCallback = callback;
+}
+
 VkRenderPass LavaContext::getRenderPass() const noexcept {
     return upcast(this)->mRenderPass;
 }
@@ -862,6 +1094,7 @@ VkRenderPassBeginInfo const* LavaContext::getBeginInfo(uint32_t i) const noexcep
 }
 
 void LavaContext::waitFrame(int n) noexcept {
+    LAVA_TRACE_SCOPE("LavaContext::waitFrame");
     auto impl = upcast(this);
     if (n < 0) {
         const VkFence fences[] = {impl->mSwap[0].fence, impl->mSwap[1].fence};
@@ -938,6 +1171,11 @@ LavaRecording* LavaContext::createRecording(function<void(VkCommandBuffer, uint3
 void LavaContext::freeRecording(LavaRecording* recording) noexcept {
     auto impl = upcast(this);
     assert(recording);
+    for (VkFence& fence : impl->mRecordingFences) {
+        if (fence == recording->fence[0] || fence == recording->fence[1]) {
+            fence = VK_NULL_HANDLE;
+        }
+    }
     vkDestroyFence(impl->mDevice, recording->fence[0], VKALLOC);
     vkDestroyFence(impl->mDevice, recording->fence[1], VKALLOC);
     vkFreeCommandBuffers(impl->mDevice, impl->mCommandPool, 2, recording->cmd);
@@ -995,6 +1233,7 @@ void LavaContext::presentRecording(LavaRecording* recording) noexcept {
     vkResetFences(impl->mDevice, 1, &fence);
     vkQueueSubmit(impl->mQueue, 1, &submitInfo, fence);
     vkQueuePresentKHR(impl->mQueue, &presentInfo);
+    impl->mRecordingFences[index] = fence;
 }
 
 void LavaContext::waitRecording(LavaRecording* recording) noexcept {
@@ -1009,7 +1248,21 @@ static bool isExtensionSupported(const string& ext) noexcept {
     VkResult error = vkEnumerateInstanceExtensionProperties(nullptr, &props.size, props.alloc());
     LOG_CHECK(not error, "Unable to enumerate extension properties.");
     for (auto prop : props) {
-        if (ext != prop.extensionName) {
+        if (ext == prop.extensionName) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool isDeviceExtensionSupported(VkPhysicalDevice gpu, const string& ext) noexcept {
+    LavaVector<VkExtensionProperties> props;
+    vkEnumerateDeviceExtensionProperties(gpu, nullptr, &props.size, nullptr);
+    VkResult error = vkEnumerateDeviceExtensionProperties(gpu, nullptr, &props.size,
+            props.alloc());
+    LOG_CHECK(not error, "Unable to enumerate device extension properties.");
+    for (auto prop : props) {
+        if (ext == prop.extensionName) {
             return true;
         }
     }
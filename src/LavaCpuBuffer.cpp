@@ -17,6 +17,9 @@ struct LavaCpuBufferImpl : LavaCpuBuffer {
     VmaAllocation memory;
     VmaAllocator vma;
     uint32_t size;
+    uint32_t capacity;
+    uint8_t* mapped;
+    VkBufferCreateInfo bufferInfo;
 };
 
 LAVA_DEFINE_UPCAST(LavaCpuBuffer)
@@ -31,20 +34,45 @@ void LavaCpuBuffer::operator delete(void* ptr) {
 }
 
 LavaCpuBufferImpl::~LavaCpuBufferImpl() noexcept {
+    unregisterMovable(vma, memory);
+    untrackAllocation(vma, memory);
     vmaDestroyBuffer(vma, buffer, memory);
 }
 
 LavaCpuBufferImpl::LavaCpuBufferImpl(Config config) noexcept : device(config.device) {
     assert(config.device && config.gpu && config.size > 0);
     vma = getVma(config.device, config.gpu);
-    VkBufferCreateInfo bufferInfo {
+    bufferInfo = {
         .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
         .size = config.capacity ? config.capacity : config.size,
         .usage = config.usage
     };
     size = config.size;
-    VmaAllocationCreateInfo allocInfo { .usage = VMA_MEMORY_USAGE_CPU_TO_GPU };
-    vmaCreateBuffer(vma, &bufferInfo, &allocInfo, &buffer, &memory, nullptr);
+    capacity = bufferInfo.size;
+    VmaMemoryUsage usage = VMA_MEMORY_USAGE_CPU_TO_GPU;
+    switch (config.memory) {
+        case CPU_TO_GPU: break;
+        case CPU_ONLY: usage = VMA_MEMORY_USAGE_CPU_ONLY; break;
+        case GPU_TO_CPU: usage = VMA_MEMORY_USAGE_GPU_TO_CPU; break;
+    }
+    VmaAllocationCreateInfo allocInfo {
+        .flags = VMA_ALLOCATION_CREATE_MAPPED_BIT,
+        .usage = usage
+    };
+    VmaAllocationInfo info;
+    vmaCreateBuffer(vma, &bufferInfo, &allocInfo, &buffer, &memory, &info);
+    trackAllocation(vma, memory, (config.usage & VK_BUFFER_USAGE_TRANSFER_SRC_BIT) ?
+            MEMORY_STAGING : MEMORY_BUFFER);
+    mapped = (uint8_t*) info.pMappedData;
+    registerMovable(vma, memory, [this] {
+        LavaContext::Relocation reloc { .oldBuffer = buffer };
+        buffer = recreateBuffer(device, vma, memory, buffer, bufferInfo);
+        reloc.newBuffer = buffer;
+        VmaAllocationInfo info;
+        vmaGetAllocationInfo(vma, memory, &info);
+        mapped = (uint8_t*) info.pMappedData;
+        return reloc;
+    });
     if (config.source) {
         setData(config.source, config.size);
     }
@@ -53,23 +81,27 @@ LavaCpuBufferImpl::LavaCpuBufferImpl(Config config) noexcept : device(config.dev
 void LavaCpuBuffer::setData(void const* sourceData, uint32_t bytesToCopy, uint32_t offset)
         noexcept {
     auto impl = upcast(this);
-    LOG_CHECK(offset + bytesToCopy <= impl->size, "Out of bounds upload.");
-    uint8_t* mappedData;
-    vmaMapMemory(impl->vma, impl->memory, (void**) &mappedData);
-    memcpy(mappedData + offset, sourceData, bytesToCopy);
-    vmaUnmapMemory(impl->vma, impl->memory);
+    LOG_CHECK(offset + bytesToCopy <= impl->capacity, "Out of bounds upload.");
+    memcpy(impl->mapped + offset, sourceData, bytesToCopy);
+    flushAllocation(impl->device, impl->vma, impl->memory, offset, bytesToCopy);
 }
 
 uint8_t* LavaCpuBuffer::map() const noexcept {
-    auto impl = upcast(this);
-    uint8_t* mappedData;
-    vmaMapMemory(impl->vma, impl->memory, (void**) &mappedData);
-    return mappedData;
+    return upcast(this)->mapped;
 }
 
 void LavaCpuBuffer::unmap() const noexcept {
+    flush();
+}
+
+void LavaCpuBuffer::flush(VkDeviceSize offset, VkDeviceSize size) const noexcept {
+    auto impl = upcast(this);
+    flushAllocation(impl->device, impl->vma, impl->memory, offset, size);
+}
+
+void LavaCpuBuffer::invalidate(VkDeviceSize offset, VkDeviceSize size) const noexcept {
     auto impl = upcast(this);
-    vmaUnmapMemory(impl->vma, impl->memory);
+    invalidateAllocation(impl->device, impl->vma, impl->memory, offset, size);
 }
 
 VkBuffer LavaCpuBuffer::getBuffer() const noexcept {
@@ -4,6 +4,7 @@
 #include <par/LavaLoader.h>
 #include <par/LavaDescCache.h>
 #include <par/LavaLog.h>
+#include <par/LavaTrace.h>
 
 #include <unordered_map>
 
@@ -157,30 +158,23 @@ LavaDescCache* LavaDescCache::create(Config config) noexcept {
 
     vector<VkDescriptorSetLayoutBinding> bindings;
     bindings.reserve(impl->writes.size());
-    uint32_t binding = 0;
-    for (auto dummy LAVA_UNUSED : config.uniformBuffers) {
+    auto addBinding = [&bindings, &config](VkDescriptorType type, VkShaderStageFlags stages) {
+        const uint32_t binding = (uint32_t) bindings.size();
         bindings.emplace_back(VkDescriptorSetLayoutBinding {
-            .binding = binding++,
-            .descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
+            .binding = binding,
+            .descriptorType = type,
             .descriptorCount = 1,
-            .stageFlags = VK_SHADER_STAGE_ALL,
+            .stageFlags = binding < config.stageFlags.size() ? config.stageFlags[binding] : stages,
         });
+    };
+    for (auto dummy LAVA_UNUSED : config.uniformBuffers) {
+        addBinding(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_SHADER_STAGE_ALL);
     }
     for (auto dummy LAVA_UNUSED : config.imageSamplers) {
-        bindings.emplace_back(VkDescriptorSetLayoutBinding {
-            .binding = binding++,
-            .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
-            .descriptorCount = 1,
-            .stageFlags = VK_SHADER_STAGE_ALL,
-        });
+        addBinding(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_ALL);
     }
     for (auto dummy LAVA_UNUSED : config.inputAttachments) {
-        bindings.emplace_back(VkDescriptorSetLayoutBinding {
-            .binding = binding++,
-            .descriptorType = VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT,
-            .descriptorCount = 1,
-            .stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT,
-        });
+        addBinding(VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT, VK_SHADER_STAGE_FRAGMENT_BIT);
     }
 
     VkDescriptorSetLayoutCreateInfo info {
@@ -237,6 +231,7 @@ VkDescriptorSetLayout LavaDescCache::getLayout() const noexcept {
 
 bool LavaDescCache::getDescriptorSet(VkDescriptorSet* descriptorSet,
         vector<VkWriteDescriptorSet>* writes) noexcept {
+    LAVA_TRACE_SCOPE("LavaDescCache::getDescriptorSet");
     LavaDescCacheImpl& impl = *upcast(this);
     if (!impl.dirtyFlags) {
         impl.currentDescriptor->timestampMs = getCurrentTime();
@@ -457,6 +452,21 @@ void LavaDescCache::unsetUniformBuffer(VkBuffer uniformBuffer) noexcept {
     }
 }
 
+void LavaDescCache::replaceUniformBuffer(VkBuffer oldBuffer, VkBuffer newBuffer) noexcept {
+    LavaDescCacheImpl& impl = *upcast(this);
+    vector<uint32_t> bindings;
+    auto& buffers = impl.currentState.uniformBuffers;
+    for (uint32_t i = 0; i < buffers.size(); i++) {
+        if (buffers[i] == oldBuffer) {
+            bindings.push_back(i);
+        }
+    }
+    unsetUniformBuffer(oldBuffer);
+    for (uint32_t i : bindings) {
+        setUniformBuffer(i, newBuffer);
+    }
+}
+
 void LavaDescCache::unsetImageSampler(VkDescriptorImageInfo binding) noexcept {
     // TODO: assume that *all* of the Vulkan handles in "binding" are now extinct and use graveyard.
     LavaDescCacheImpl* impl = upcast(this);
@@ -16,6 +16,7 @@ struct LavaGpuBufferImpl : LavaGpuBuffer {
     VkBuffer buffer;
     VmaAllocation memory;
     VmaAllocator vma;
+    VkBufferCreateInfo bufferInfo;
 };
 
 LAVA_DEFINE_UPCAST(LavaGpuBuffer)
@@ -30,19 +31,28 @@ void LavaGpuBuffer::operator delete(void* ptr) {
 }
 
 LavaGpuBufferImpl::~LavaGpuBufferImpl() noexcept {
+    unregisterMovable(vma, memory);
+    untrackAllocation(vma, memory);
     vmaDestroyBuffer(vma, buffer, memory);
 }
 
 LavaGpuBufferImpl::LavaGpuBufferImpl(Config config) noexcept : device(config.device) {
     assert(config.device && config.gpu && config.size > 0);
     vma = getVma(config.device, config.gpu);
-    VkBufferCreateInfo bufferInfo {
+    bufferInfo = {
         .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
         .size = config.size,
         .usage = config.usage
     };
     VmaAllocationCreateInfo allocInfo { .usage = VMA_MEMORY_USAGE_GPU_ONLY };
     vmaCreateBuffer(vma, &bufferInfo, &allocInfo, &buffer, &memory, nullptr);
+    trackAllocation(vma, memory, MEMORY_BUFFER);
+    registerMovable(vma, memory, [this] {
+        LavaContext::Relocation reloc { .oldBuffer = buffer };
+        buffer = recreateBuffer(device, vma, memory, buffer, bufferInfo);
+        reloc.newBuffer = buffer;
+        return reloc;
+    });
 }
 
 VkBuffer LavaGpuBuffer::getBuffer() const noexcept {
@@ -8,11 +8,16 @@
 #include "LavaInternal.h"
 
 #include <chrono>
+#include <mutex>
 #include <unordered_map>
 
 namespace par {
 
 static std::unordered_map<VkDevice, VmaAllocator> sVmaAllocators;
+static std::unordered_map<VmaAllocator, MemoryTotals> sMemoryTotals;
+static std::mutex sMemoryTotalsMutex;
+static std::unordered_map<VmaAllocator, std::unordered_map<VmaAllocation, RelocateFn>> sMovables;
+static std::mutex sMovablesMutex;
 
 VmaAllocator getVma(VkDevice device, VkPhysicalDevice gpu) {
     VmaAllocator& vma = sVmaAllocators[device];
@@ -51,16 +56,227 @@ void createVma(VkDevice device, VkPhysicalDevice gpu) {
 }
 
 void destroyVma(VkDevice device) {
-    vmaDestroyAllocator(sVmaAllocators[device]);
+    VmaAllocator vma = sVmaAllocators[device];
+    {
+        std::lock_guard<std::mutex> lock(sMemoryTotalsMutex);
+        sMemoryTotals.erase(vma);
+    }
+    {
+        std::lock_guard<std::mutex> lock(sMovablesMutex);
+        sMovables.erase(vma);
+    }
+    vmaDestroyAllocator(vma);
     sVmaAllocators[device] = VK_NULL_HANDLE;
 }
 
+void trackAllocation(VmaAllocator vma, VmaAllocation allocation, MemoryCategory category) {
+    if (allocation == VK_NULL_HANDLE) {
+        return;
+    }
+    VmaAllocationInfo info;
+    vmaGetAllocationInfo(vma, allocation, &info);
+    vmaSetAllocationUserData(vma, allocation, (void*) uintptr_t(category + 1));
+    std::lock_guard<std::mutex> lock(sMemoryTotalsMutex);
+    MemoryTotals& totals = sMemoryTotals[vma];
+    totals.bytes[category] += info.size;
+    totals.count[category]++;
+}
+
+void untrackAllocation(VmaAllocator vma, VmaAllocation allocation) {
+    if (allocation == VK_NULL_HANDLE) {
+        return;
+    }
+    VmaAllocationInfo info;
+    vmaGetAllocationInfo(vma, allocation, &info);
+    const uintptr_t tag = (uintptr_t) info.pUserData;
+    if (tag == 0 || tag > MEMORY_CATEGORY_COUNT) {
+        return;
+    }
+    const uint32_t category = uint32_t(tag - 1);
+    std::lock_guard<std::mutex> lock(sMemoryTotalsMutex);
+    MemoryTotals& totals = sMemoryTotals[vma];
+    totals.bytes[category] -= info.size;
+    totals.count[category]--;
+}
+
+MemoryTotals getMemoryTotals(VmaAllocator vma) {
+    std::lock_guard<std::mutex> lock(sMemoryTotalsMutex);
+    return sMemoryTotals[vma];
+}
+
+void registerMovable(VmaAllocator vma, VmaAllocation allocation, RelocateFn relocate) {
+    std::lock_guard<std::mutex> lock(sMovablesMutex);
+    sMovables[vma][allocation] = std::move(relocate);
+}
+
+void unregisterMovable(VmaAllocator vma, VmaAllocation allocation) {
+    std::lock_guard<std::mutex> lock(sMovablesMutex);
+    sMovables[vma].erase(allocation);
+}
+
+std::vector<VmaAllocation> getMovableAllocations(VmaAllocator vma) {
+    std::lock_guard<std::mutex> lock(sMovablesMutex);
+    std::vector<VmaAllocation> result;
+    for (const auto& pair : sMovables[vma]) {
+        result.push_back(pair.first);
+    }
+    return result;
+}
+
+LavaContext::Relocation relocateAllocation(VmaAllocator vma, VmaAllocation allocation) {
+    // Copy the callback so that it can safely register or unregister other allocations.
+    RelocateFn relocate;
+    {
+        std::lock_guard<std::mutex> lock(sMovablesMutex);
+        relocate = sMovables[vma][allocation];
+    }
+    return relocate ? relocate() : LavaContext::Relocation {};
+}
+
+VkBuffer recreateBuffer(VkDevice device, VmaAllocator vma, VmaAllocation allocation,
+        VkBuffer buffer, const VkBufferCreateInfo& info) {
+    vkDestroyBuffer(device, buffer, VKALLOC);
+    vkCreateBuffer(device, &info, VKALLOC, &buffer);
+    // Querying the requirements is redundant but keeps the validation layer quiet.
+    VkMemoryRequirements requirements;
+    vkGetBufferMemoryRequirements(device, buffer, &requirements);
+    vmaBindBufferMemory(vma, allocation, buffer);
+    return buffer;
+}
+
 uint64_t getCurrentTime() {
     auto now = std::chrono::system_clock::now();
     auto duration = now.time_since_epoch();
     return std::chrono::duration_cast<std::chrono::milliseconds>(duration).count();
 }
 
+uint32_t getBytesPerPixel(VkFormat format) {
+    switch (format) {
+        case VK_FORMAT_R8_UNORM:
+        case VK_FORMAT_R8_SRGB:
+            return 1;
+        case VK_FORMAT_R8G8_UNORM:
+        case VK_FORMAT_R16_SFLOAT:
+            return 2;
+        case VK_FORMAT_R8G8B8A8_UNORM:
+        case VK_FORMAT_R8G8B8A8_SRGB:
+        case VK_FORMAT_B8G8R8A8_UNORM:
+        case VK_FORMAT_B8G8R8A8_SRGB:
+        case VK_FORMAT_R32_SFLOAT:
+        case VK_FORMAT_R16G16_SFLOAT:
+            return 4;
+        case VK_FORMAT_R16G16B16A16_SFLOAT:
+        case VK_FORMAT_R32G32_SFLOAT:
+            return 8;
+        case VK_FORMAT_R32G32B32A32_SFLOAT:
+            return 16;
+        default:
+            return 0;
+    }
+}
+
+FormatBlock getFormatBlock(VkFormat format) {
+    if (format >= VK_FORMAT_ASTC_4x4_UNORM_BLOCK && format <= VK_FORMAT_ASTC_12x12_SRGB_BLOCK) {
+        static const uint8_t kAstcFootprints[][2] = {
+            {4, 4}, {5, 4}, {5, 5}, {6, 5}, {6, 6}, {8, 5}, {8, 6},
+            {8, 8}, {10, 5}, {10, 6}, {10, 8}, {10, 10}, {12, 10}, {12, 12},
+        };
+        auto footprint = kAstcFootprints[(format - VK_FORMAT_ASTC_4x4_UNORM_BLOCK) / 2];
+        return {footprint[0], footprint[1], 16};
+    }
+    switch (format) {
+        case VK_FORMAT_BC1_RGB_UNORM_BLOCK:
+        case VK_FORMAT_BC1_RGB_SRGB_BLOCK:
+        case VK_FORMAT_BC1_RGBA_UNORM_BLOCK:
+        case VK_FORMAT_BC1_RGBA_SRGB_BLOCK:
+        case VK_FORMAT_BC4_UNORM_BLOCK:
+        case VK_FORMAT_BC4_SNORM_BLOCK:
+        case VK_FORMAT_ETC2_R8G8B8_UNORM_BLOCK:
+        case VK_FORMAT_ETC2_R8G8B8_SRGB_BLOCK:
+        case VK_FORMAT_ETC2_R8G8B8A1_UNORM_BLOCK:
+        case VK_FORMAT_ETC2_R8G8B8A1_SRGB_BLOCK:
+        case VK_FORMAT_EAC_R11_UNORM_BLOCK:
+        case VK_FORMAT_EAC_R11_SNORM_BLOCK:
+            return {4, 4, 8};
+        case VK_FORMAT_BC2_UNORM_BLOCK:
+        case VK_FORMAT_BC2_SRGB_BLOCK:
+        case VK_FORMAT_BC3_UNORM_BLOCK:
+        case VK_FORMAT_BC3_SRGB_BLOCK:
+        case VK_FORMAT_BC5_UNORM_BLOCK:
+        case VK_FORMAT_BC5_SNORM_BLOCK:
+        case VK_FORMAT_BC6H_UFLOAT_BLOCK:
+        case VK_FORMAT_BC6H_SFLOAT_BLOCK:
+        case VK_FORMAT_BC7_UNORM_BLOCK:
+        case VK_FORMAT_BC7_SRGB_BLOCK:
+        case VK_FORMAT_ETC2_R8G8B8A8_UNORM_BLOCK:
+        case VK_FORMAT_ETC2_R8G8B8A8_SRGB_BLOCK:
+        case VK_FORMAT_EAC_R11G11_UNORM_BLOCK:
+        case VK_FORMAT_EAC_R11G11_SNORM_BLOCK:
+            return {4, 4, 16};
+        default:
+            return {1, 1, getBytesPerPixel(format)};
+    }
+}
+
+VkDeviceSize getImageSize(VkFormat format, uint32_t width, uint32_t height) {
+    const FormatBlock block = getFormatBlock(format);
+    const VkDeviceSize columns = (width + block.width - 1) / block.width;
+    const VkDeviceSize rows = (height + block.height - 1) / block.height;
+    return columns * rows * block.bytes;
+}
+
+// Returns the size of the VkDeviceMemory that the allocation lives in. This version of VMA has no
+// public query for it, but its implementation is compiled into this file.
+static VkDeviceSize getMemorySize(VmaAllocation allocation) {
+    if (allocation->GetType() == VmaAllocation_T::ALLOCATION_TYPE_BLOCK) {
+        return allocation->GetBlock()->m_Metadata.GetSize();
+    }
+    return allocation->GetSize();
+}
+
+// Expands the given range to nonCoherentAtomSize and returns false if no flush is required. The
+// expanded range is clamped to the end of the VkDeviceMemory, as required by the spec.
+static bool getMappedRange(VmaAllocator vma, VmaAllocation allocation, VkDeviceSize offset,
+        VkDeviceSize size, VkMappedMemoryRange* range) {
+    VmaAllocationInfo info;
+    vmaGetAllocationInfo(vma, allocation, &info);
+    VkMemoryPropertyFlags flags;
+    vmaGetMemoryTypeProperties(vma, info.memoryType, &flags);
+    if (flags & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT) {
+        return false;
+    }
+    const VkPhysicalDeviceProperties* props;
+    vmaGetPhysicalDeviceProperties(vma, &props);
+    const VkDeviceSize atom = props->limits.nonCoherentAtomSize;
+    const VkDeviceSize begin = (info.offset + offset) / atom * atom;
+    const VkDeviceSize nbytes = size == VK_WHOLE_SIZE ? info.size - offset : size;
+    const VkDeviceSize end = info.offset + offset + nbytes;
+    const VkDeviceSize alignedSize = (end - begin + atom - 1) / atom * atom;
+    *range = {
+        .sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE,
+        .memory = info.deviceMemory,
+        .offset = begin,
+        .size = begin + alignedSize < getMemorySize(allocation) ? alignedSize : VK_WHOLE_SIZE,
+    };
+    return true;
+}
+
+void flushAllocation(VkDevice device, VmaAllocator vma, VmaAllocation allocation,
+        VkDeviceSize offset, VkDeviceSize size) {
+    VkMappedMemoryRange range;
+    if (getMappedRange(vma, allocation, offset, size, &range)) {
+        vkFlushMappedMemoryRanges(device, 1, &range);
+    }
+}
+
+void invalidateAllocation(VkDevice device, VmaAllocator vma, VmaAllocation allocation,
+        VkDeviceSize offset, VkDeviceSize size) {
+    VkMappedMemoryRange range;
+    if (getMappedRange(vma, allocation, offset, size, &range)) {
+        vkInvalidateMappedMemoryRanges(device, 1, &range);
+    }
+}
+
 size_t murmurHash(uint32_t const* words, uint32_t nwords, uint32_t seed) {
     if (nwords == 0) {
         return 0;
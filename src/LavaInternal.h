@@ -3,6 +3,9 @@
 
 #pragma once
 
+#include <par/LavaContext.h>
+
+#include <functional>
 #include <vector>
 
 #define VKALLOC nullptr
@@ -33,6 +36,12 @@ inline LAVA_UNUSED CLASS##Impl const* upcast(CLASS const* that) noexcept { \
 
 namespace par {
 
+// LavaContext is double-buffered, so an object that is retired during a frame may still be
+// referenced by up to two command buffers that have not finished executing. Classes that defer
+// destruction or reuse count frames with a once-per-frame call (e.g. releaseUnused) and wait this
+// many frames before recycling.
+constexpr uint32_t FRAMES_IN_FLIGHT = 2;
+
 VmaAllocator getVma(VkDevice device, VkPhysicalDevice gpu);
 void createVma(VkDevice device, VkPhysicalDevice gpu);
 void destroyVma(VkDevice device);
@@ -40,6 +49,89 @@ void destroyVma(VkDevice device);
 uint64_t getCurrentTime();
 size_t murmurHash(uint32_t const* words, uint32_t nwords, uint32_t seed);
 
+// Returns the size of a single texel for uncompressed color formats, or 0 if unknown.
+uint32_t getBytesPerPixel(VkFormat format);
+
+// Describes the smallest addressable unit of a format. Uncompressed formats have 1x1 blocks, while
+// block-compressed formats (BCn, ETC2, EAC, ASTC) have larger footprints. Unknown formats have a
+// block size of 0.
+struct FormatBlock {
+    uint32_t width;
+    uint32_t height;
+    uint32_t bytes;
+};
+FormatBlock getFormatBlock(VkFormat format);
+
+// Returns the number of bytes in a tightly packed 2D image, or 0 if the format is unknown.
+VkDeviceSize getImageSize(VkFormat format, uint32_t width, uint32_t height);
+
+// Describes the images in a KTX or KTX2 container. Within each level, images are ordered by layer
+// and then by face, and each image contains all of its slices. Rows are tightly packed except in
+// KTX1 files with uncompressed formats, where rows are aligned to 4 bytes.
+struct KtxInfo {
+    VkFormat format;
+    uint32_t width;
+    uint32_t height;
+    uint32_t depth;
+    uint32_t layerCount;
+    uint32_t faceCount;
+    uint32_t levelCount;
+    struct Level {
+        uint8_t const* data;
+        VkDeviceSize imageStride;
+        uint32_t rowPitch;
+    };
+    std::vector<Level> levels;
+};
+
+// Validates the given KTX or KTX2 blob and returns false after logging an error if it cannot be
+// loaded. The level pointers reference the original blob.
+bool parseKtx(void const* data, size_t size, KtxInfo* info);
+
+// Returns the uncompressed format that transcodeImage() produces for the given compressed format,
+// or VK_FORMAT_UNDEFINED if no CPU decoder exists.
+VkFormat getTranscodeFormat(VkFormat format);
+
+// Decodes a block-compressed image into tightly packed RGBA8 texels.
+void transcodeImage(VkFormat format, uint8_t const* source, uint32_t width, uint32_t height,
+        uint8_t* dest);
+
+// Makes host writes visible to the GPU and vice versa. These are no-ops for host-coherent memory.
+void flushAllocation(VkDevice device, VmaAllocator vma, VmaAllocation allocation,
+        VkDeviceSize offset, VkDeviceSize size);
+void invalidateAllocation(VkDevice device, VmaAllocator vma, VmaAllocation allocation,
+        VkDeviceSize offset, VkDeviceSize size);
+
+// Attributes VMA allocations to a category so that LavaContext can report per-category totals.
+// The category is stored in the allocation's user data.
+enum MemoryCategory {
+    MEMORY_BUFFER,
+    MEMORY_TEXTURE,
+    MEMORY_ATTACHMENT,
+    MEMORY_STAGING,
+    MEMORY_CATEGORY_COUNT
+};
+struct MemoryTotals {
+    VkDeviceSize bytes[MEMORY_CATEGORY_COUNT];
+    uint32_t count[MEMORY_CATEGORY_COUNT];
+};
+void trackAllocation(VmaAllocator vma, VmaAllocation allocation, MemoryCategory category);
+void untrackAllocation(VmaAllocator vma, VmaAllocation allocation);
+MemoryTotals getMemoryTotals(VmaAllocator vma);
+
+// Allows LavaContext::defragment to move the given allocation. After the memory has moved, the
+// callback must re-create the Vulkan objects that are bound to it and report the old and new
+// handles. Owners must unregister the allocation before destroying it.
+using RelocateFn = std::function<LavaContext::Relocation()>;
+void registerMovable(VmaAllocator vma, VmaAllocation allocation, RelocateFn relocate);
+void unregisterMovable(VmaAllocator vma, VmaAllocation allocation);
+std::vector<VmaAllocation> getMovableAllocations(VmaAllocator vma);
+LavaContext::Relocation relocateAllocation(VmaAllocator vma, VmaAllocation allocation);
+
+// Destroys a buffer whose allocation has been moved and binds a new one in its place.
+VkBuffer recreateBuffer(VkDevice device, VmaAllocator vma, VmaAllocation allocation,
+        VkBuffer buffer, const VkBufferCreateInfo& info);
+
 template<typename T>
 struct MurmurHashFn {
     uint32_t operator()(const T& key) const {
@@ -0,0 +1,438 @@
+// The MIT License
+// Copyright (c) 2018 Philip Rideout
+
+#include <par/LavaLoader.h>
+#include <par/LavaLog.h>
+#include <par/LavaTexture.h>
+
+#include <algorithm>
+
+#include <assert.h>
+#include <string.h>
+
+#include "LavaInternal.h"
+
+using namespace par;
+using namespace std;
+
+namespace {
+
+constexpr uint8_t KTX1_IDENTIFIER[12] = {
+    0xAB, 'K', 'T', 'X', ' ', '1', '1', 0xBB, '\r', '\n', 0x1A, '\n'
+};
+
+constexpr uint8_t KTX2_IDENTIFIER[12] = {
+    0xAB, 'K', 'T', 'X', ' ', '2', '0', 0xBB, '\r', '\n', 0x1A, '\n'
+};
+
+constexpr uint32_t KTX1_ENDIANNESS = 0x04030201;
+
+struct Ktx1Header {
+    uint8_t identifier[12];
+    uint32_t endianness;
+    uint32_t glType;
+    uint32_t glTypeSize;
+    uint32_t glFormat;
+    uint32_t glInternalFormat;
+    uint32_t glBaseInternalFormat;
+    uint32_t pixelWidth;
+    uint32_t pixelHeight;
+    uint32_t pixelDepth;
+    uint32_t numberOfArrayElements;
+    uint32_t numberOfFaces;
+    uint32_t numberOfMipmapLevels;
+    uint32_t bytesOfKeyValueData;
+};
+
+struct Ktx2Header {
+    uint8_t identifier[12];
+    uint32_t vkFormat;
+    uint32_t typeSize;
+    uint32_t pixelWidth;
+    uint32_t pixelHeight;
+    uint32_t pixelDepth;
+    uint32_t layerCount;
+    uint32_t faceCount;
+    uint32_t levelCount;
+    uint32_t supercompressionScheme;
+    uint32_t dfdByteOffset;
+    uint32_t dfdByteLength;
+    uint32_t kvdByteOffset;
+    uint32_t kvdByteLength;
+    uint64_t sgdByteOffset;
+    uint64_t sgdByteLength;
+};
+
+struct Ktx2Level {
+    uint64_t byteOffset;
+    uint64_t byteLength;
+    uint64_t uncompressedByteLength;
+};
+
+// KTX1 files identify their format with an OpenGL enum.
+VkFormat getFormatFromGl(uint32_t glInternalFormat) {
+    if (glInternalFormat >= 0x93B0 && glInternalFormat <= 0x93BD) {
+        return (VkFormat) (VK_FORMAT_ASTC_4x4_UNORM_BLOCK + (glInternalFormat - 0x93B0) * 2);
+    }
+    if (glInternalFormat >= 0x93D0 && glInternalFormat <= 0x93DD) {
+        return (VkFormat) (VK_FORMAT_ASTC_4x4_SRGB_BLOCK + (glInternalFormat - 0x93D0) * 2);
+    }
+    switch (glInternalFormat) {
+        case 0x8229: return VK_FORMAT_R8_UNORM;
+        case 0x822B: return VK_FORMAT_R8G8_UNORM;
+        case 0x8058: return VK_FORMAT_R8G8B8A8_UNORM;
+        case 0x8C43: return VK_FORMAT_R8G8B8A8_SRGB;
+        case 0x822D: return VK_FORMAT_R16_SFLOAT;
+        case 0x822F: return VK_FORMAT_R16G16_SFLOAT;
+        case 0x881A: return VK_FORMAT_R16G16B16A16_SFLOAT;
+        case 0x822E: return VK_FORMAT_R32_SFLOAT;
+        case 0x8230: return VK_FORMAT_R32G32_SFLOAT;
+        case 0x8814: return VK_FORMAT_R32G32B32A32_SFLOAT;
+        case 0x83F0: return VK_FORMAT_BC1_RGB_UNORM_BLOCK;
+        case 0x83F1: return VK_FORMAT_BC1_RGBA_UNORM_BLOCK;
+        case 0x83F2: return VK_FORMAT_BC2_UNORM_BLOCK;
+        case 0x83F3: return VK_FORMAT_BC3_UNORM_BLOCK;
+        case 0x8C4C: return VK_FORMAT_BC1_RGB_SRGB_BLOCK;
+        case 0x8C4D: return VK_FORMAT_BC1_RGBA_SRGB_BLOCK;
+        case 0x8C4E: return VK_FORMAT_BC2_SRGB_BLOCK;
+        case 0x8C4F: return VK_FORMAT_BC3_SRGB_BLOCK;
+        case 0x8DBB: return VK_FORMAT_BC4_UNORM_BLOCK;
+        case 0x8DBC: return VK_FORMAT_BC4_SNORM_BLOCK;
+        case 0x8DBD: return VK_FORMAT_BC5_UNORM_BLOCK;
+        case 0x8DBE: return VK_FORMAT_BC5_SNORM_BLOCK;
+        case 0x8E8C: return VK_FORMAT_BC7_UNORM_BLOCK;
+        case 0x8E8D: return VK_FORMAT_BC7_SRGB_BLOCK;
+        case 0x8E8E: return VK_FORMAT_BC6H_SFLOAT_BLOCK;
+        case 0x8E8F: return VK_FORMAT_BC6H_UFLOAT_BLOCK;
+        case 0x8D64: return VK_FORMAT_ETC2_R8G8B8_UNORM_BLOCK;
+        case 0x9274: return VK_FORMAT_ETC2_R8G8B8_UNORM_BLOCK;
+        case 0x9275: return VK_FORMAT_ETC2_R8G8B8_SRGB_BLOCK;
+        case 0x9276: return VK_FORMAT_ETC2_R8G8B8A1_UNORM_BLOCK;
+        case 0x9277: return VK_FORMAT_ETC2_R8G8B8A1_SRGB_BLOCK;
+        case 0x9278: return VK_FORMAT_ETC2_R8G8B8A8_UNORM_BLOCK;
+        case 0x9279: return VK_FORMAT_ETC2_R8G8B8A8_SRGB_BLOCK;
+        case 0x9270: return VK_FORMAT_EAC_R11_UNORM_BLOCK;
+        case 0x9271: return VK_FORMAT_EAC_R11_SNORM_BLOCK;
+        case 0x9272: return VK_FORMAT_EAC_R11G11_UNORM_BLOCK;
+        case 0x9273: return VK_FORMAT_EAC_R11G11_SNORM_BLOCK;
+        default: return VK_FORMAT_UNDEFINED;
+    }
+}
+
+// Images larger than this in any dimension exceed every Vulkan implementation's limits, and
+// rejecting them up front keeps the image size computations from overflowing.
+constexpr uint32_t MAX_DIMENSION = 1u << 16;
+
+// Multiplies the image stride by the number of images in a level, returning false on overflow.
+bool getLevelSize(VkDeviceSize imageStride, uint32_t layerCount, uint32_t faceCount,
+        VkDeviceSize* result) {
+    const VkDeviceSize images = (VkDeviceSize) layerCount * faceCount;
+    if (imageStride && images > UINT64_MAX / imageStride) {
+        return false;
+    }
+    *result = imageStride * images;
+    return true;
+}
+
+// Checks the dimensions shared by both container versions, which LavaTexture would otherwise
+// reject with a fatal error or misinterpret.
+bool validateKtxInfo(KtxInfo const& info) {
+    if (info.width == 0 || info.width > MAX_DIMENSION || info.height > MAX_DIMENSION ||
+            info.depth > MAX_DIMENSION) {
+        llog.error("KTX image has invalid dimensions {}x{}x{}.", info.width, info.height,
+                info.depth);
+        return false;
+    }
+    if (info.faceCount != 1 && info.faceCount != 6) {
+        llog.error("KTX image has {} faces, expected 1 or 6.", info.faceCount);
+        return false;
+    }
+    if (info.faceCount == 6 && (info.width != info.height || info.depth > 1)) {
+        llog.error("KTX cubemap faces must be square and two-dimensional.");
+        return false;
+    }
+    if (info.depth > 1 && info.layerCount > 1) {
+        llog.error("KTX 3D images cannot have array layers.");
+        return false;
+    }
+    const uint32_t fullChain = LavaTexture::getMipCount(info.width, info.height, info.depth);
+    if (info.levelCount > fullChain) {
+        llog.error("KTX image has {} levels, but its mip chain has only {}.", info.levelCount,
+                fullChain);
+        return false;
+    }
+    return true;
+}
+
+bool parseKtx1(uint8_t const* blob, size_t size, KtxInfo* info) {
+    if (size < sizeof(Ktx1Header)) {
+        llog.error("KTX file is truncated.");
+        return false;
+    }
+    Ktx1Header header;
+    memcpy(&header, blob, sizeof(header));
+    if (header.endianness != KTX1_ENDIANNESS) {
+        llog.error("Big-endian KTX files are not supported.");
+        return false;
+    }
+    info->format = getFormatFromGl(header.glInternalFormat);
+    if (info->format == VK_FORMAT_UNDEFINED) {
+        llog.error("Unknown KTX internal format 0x{:x}.", header.glInternalFormat);
+        return false;
+    }
+    const FormatBlock block = getFormatBlock(info->format);
+    const bool compressed = block.width > 1;
+    info->width = header.pixelWidth;
+    info->height = std::max(header.pixelHeight, 1u);
+    info->depth = std::max(header.pixelDepth, 1u);
+    info->layerCount = std::max(header.numberOfArrayElements, 1u);
+    info->faceCount = std::max(header.numberOfFaces, 1u);
+    info->levelCount = std::max(header.numberOfMipmapLevels, 1u);
+    if (!validateKtxInfo(*info)) {
+        return false;
+    }
+
+    // Each level is prefixed with its size. Faces of non-array cubemaps are padded to 4 bytes, and
+    // so are the rows of uncompressed images.
+    const bool nonArrayCube = header.numberOfArrayElements == 0 && info->faceCount == 6;
+    size_t offset = sizeof(Ktx1Header) + header.bytesOfKeyValueData;
+    for (uint32_t level = 0; level < info->levelCount; level++) {
+        if (offset + 4 > size) {
+            llog.error("KTX file is truncated.");
+            return false;
+        }
+        uint32_t imageSize;
+        memcpy(&imageSize, blob + offset, 4);
+        offset += 4;
+        const uint32_t width = std::max(info->width >> level, 1u);
+        const uint32_t height = std::max(info->height >> level, 1u);
+        const uint32_t depth = std::max(info->depth >> level, 1u);
+        KtxInfo::Level desc;
+        desc.data = blob + offset;
+        desc.rowPitch = compressed ? 0 : (width * block.bytes + 3) & ~3u;
+        const VkDeviceSize faceSize = depth * (compressed ?
+                getImageSize(info->format, width, height) : (VkDeviceSize) desc.rowPitch * height);
+        desc.imageStride = nonArrayCube ? (faceSize + 3) & ~3ull : faceSize;
+        const VkDeviceSize levelSize = nonArrayCube ? desc.imageStride * 6 : imageSize;
+        VkDeviceSize requiredSize;
+        if (!getLevelSize(desc.imageStride, info->layerCount, info->faceCount, &requiredSize) ||
+                levelSize < requiredSize || levelSize > size - offset) {
+            llog.error("KTX level {} is truncated.", level);
+            return false;
+        }
+        info->levels.push_back(desc);
+        offset += (levelSize + 3) & ~3ull;
+    }
+    return true;
+}
+
+bool parseKtx2(uint8_t const* blob, size_t size, KtxInfo* info) {
+    if (size < sizeof(Ktx2Header)) {
+        llog.error("KTX2 file is truncated.");
+        return false;
+    }
+    Ktx2Header header;
+    memcpy(&header, blob, sizeof(header));
+    if (header.vkFormat == VK_FORMAT_UNDEFINED || header.supercompressionScheme != 0) {
+        llog.error("Supercompressed or universal KTX2 files are not supported.");
+        return false;
+    }
+    info->format = (VkFormat) header.vkFormat;
+    if (getFormatBlock(info->format).bytes == 0) {
+        llog.error("Unknown KTX2 format {}.", header.vkFormat);
+        return false;
+    }
+    info->width = header.pixelWidth;
+    info->height = std::max(header.pixelHeight, 1u);
+    info->depth = std::max(header.pixelDepth, 1u);
+    info->layerCount = std::max(header.layerCount, 1u);
+    info->faceCount = std::max(header.faceCount, 1u);
+    info->levelCount = std::max(header.levelCount, 1u);
+    if (!validateKtxInfo(*info)) {
+        return false;
+    }
+
+    // The level index follows the header and always starts with the base level.
+    const size_t indexOffset = sizeof(Ktx2Header);
+    if (indexOffset + info->levelCount * sizeof(Ktx2Level) > size) {
+        llog.error("KTX2 level index is truncated.");
+        return false;
+    }
+    for (uint32_t level = 0; level < info->levelCount; level++) {
+        Ktx2Level entry;
+        memcpy(&entry, blob + indexOffset + level * sizeof(Ktx2Level), sizeof(entry));
+        const uint32_t width = std::max(info->width >> level, 1u);
+        const uint32_t height = std::max(info->height >> level, 1u);
+        const uint32_t depth = std::max(info->depth >> level, 1u);
+        KtxInfo::Level desc;
+        desc.rowPitch = 0;
+        desc.imageStride = getImageSize(info->format, width, height) * depth;
+        // The offset and length come straight from the file, so avoid summing them.
+        VkDeviceSize requiredSize;
+        if (!getLevelSize(desc.imageStride, info->layerCount, info->faceCount, &requiredSize) ||
+                entry.byteLength < requiredSize || entry.byteOffset > size ||
+                entry.byteLength > size - entry.byteOffset) {
+            llog.error("KTX2 level {} is truncated.", level);
+            return false;
+        }
+        desc.data = blob + entry.byteOffset;
+        info->levels.push_back(desc);
+    }
+    return true;
+}
+
+// Expands a 5:6:5 color into 8-bit channels.
+void unpack565(uint16_t color, uint8_t* rgb) {
+    const uint32_t r = (color >> 11) & 31, g = (color >> 5) & 63, b = color & 31;
+    rgb[0] = (r << 3) | (r >> 2);
+    rgb[1] = (g << 2) | (g >> 4);
+    rgb[2] = (b << 3) | (b >> 2);
+}
+
+// Decodes the BC1 color portion of a block into 16 RGBA texels, leaving alpha untouched unless the
+// block uses the punch-through mode.
+void decodeColorBlock(uint8_t const* block, bool allowPunchThrough, uint8_t texels[16][4]) {
+    const uint16_t c0 = block[0] | (block[1] << 8);
+    const uint16_t c1 = block[2] | (block[3] << 8);
+    uint8_t palette[4][4] = {};
+    unpack565(c0, palette[0]);
+    unpack565(c1, palette[1]);
+    palette[0][3] = palette[1][3] = palette[2][3] = palette[3][3] = 255;
+    const bool fourColors = c0 > c1 || !allowPunchThrough;
+    for (int c = 0; c < 3; c++) {
+        if (fourColors) {
+            palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+            palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+        } else {
+            palette[2][c] = (palette[0][c] + palette[1][c]) / 2;
+            palette[3][c] = 0;
+        }
+    }
+    const uint32_t indices = block[4] | (block[5] << 8) | (block[6] << 16) | (block[7] << 24);
+    for (int i = 0; i < 16; i++) {
+        const uint8_t* color = palette[(indices >> (2 * i)) & 3];
+        texels[i][0] = color[0];
+        texels[i][1] = color[1];
+        texels[i][2] = color[2];
+        if (!fourColors) {
+            texels[i][3] = color[3];
+        }
+    }
+}
+
+// Decodes an 8-byte BC4 (or BC3 alpha) block into the given channel of 16 RGBA texels.
+void decodeChannelBlock(uint8_t const* block, int channel, uint8_t texels[16][4]) {
+    uint8_t palette[8];
+    palette[0] = block[0];
+    palette[1] = block[1];
+    if (palette[0] > palette[1]) {
+        for (int i = 1; i < 7; i++) {
+            palette[i + 1] = ((7 - i) * palette[0] + i * palette[1]) / 7;
+        }
+    } else {
+        for (int i = 1; i < 5; i++) {
+            palette[i + 1] = ((5 - i) * palette[0] + i * palette[1]) / 5;
+        }
+        palette[6] = 0;
+        palette[7] = 255;
+    }
+    uint64_t indices = 0;
+    for (int i = 0; i < 6; i++) {
+        indices |= (uint64_t) block[2 + i] << (8 * i);
+    }
+    for (int i = 0; i < 16; i++) {
+        texels[i][channel] = palette[(indices >> (3 * i)) & 7];
+    }
+}
+
+void decodeBlock(VkFormat format, uint8_t const* block, uint8_t texels[16][4]) {
+    for (int i = 0; i < 16; i++) {
+        texels[i][0] = texels[i][1] = texels[i][2] = 0;
+        texels[i][3] = 255;
+    }
+    switch (format) {
+        case VK_FORMAT_BC1_RGB_UNORM_BLOCK:
+        case VK_FORMAT_BC1_RGB_SRGB_BLOCK:
+            decodeColorBlock(block, true, texels);
+            for (int i = 0; i < 16; i++) {
+                texels[i][3] = 255;
+            }
+            break;
+        case VK_FORMAT_BC1_RGBA_UNORM_BLOCK:
+        case VK_FORMAT_BC1_RGBA_SRGB_BLOCK:
+            decodeColorBlock(block, true, texels);
+            break;
+        case VK_FORMAT_BC2_UNORM_BLOCK:
+        case VK_FORMAT_BC2_SRGB_BLOCK:
+            for (int i = 0; i < 16; i++) {
+                const uint8_t alpha = (block[i / 2] >> (4 * (i & 1))) & 15;
+                texels[i][3] = alpha | (alpha << 4);
+            }
+            decodeColorBlock(block + 8, false, texels);
+            break;
+        case VK_FORMAT_BC3_UNORM_BLOCK:
+        case VK_FORMAT_BC3_SRGB_BLOCK:
+            decodeChannelBlock(block, 3, texels);
+            decodeColorBlock(block + 8, false, texels);
+            break;
+        case VK_FORMAT_BC4_UNORM_BLOCK:
+            decodeChannelBlock(block, 0, texels);
+            break;
+        case VK_FORMAT_BC5_UNORM_BLOCK:
+            decodeChannelBlock(block, 0, texels);
+            decodeChannelBlock(block + 8, 1, texels);
+            break;
+        default:
+            assert(false && "Unsupported transcode format.");
+    }
+}
+
+} // anonymous namespace
+
+bool par::parseKtx(void const* data, size_t size, KtxInfo* info) {
+    auto blob = (uint8_t const*) data;
+    info->levels.clear();
+    if (size >= 12 && !memcmp(blob, KTX1_IDENTIFIER, 12)) {
+        return parseKtx1(blob, size, info);
+    }
+    if (size >= 12 && !memcmp(blob, KTX2_IDENTIFIER, 12)) {
+        return parseKtx2(blob, size, info);
+    }
+    llog.error("Missing KTX identifier.");
+    return false;
+}
+
+VkFormat par::getTranscodeFormat(VkFormat format) {
+    switch (format) {
+        case VK_FORMAT_BC1_RGB_UNORM_BLOCK:
+        case VK_FORMAT_BC1_RGBA_UNORM_BLOCK:
+        case VK_FORMAT_BC2_UNORM_BLOCK:
+        case VK_FORMAT_BC3_UNORM_BLOCK:
+        case VK_FORMAT_BC4_UNORM_BLOCK:
+        case VK_FORMAT_BC5_UNORM_BLOCK:
+            return VK_FORMAT_R8G8B8A8_UNORM;
+        case VK_FORMAT_BC1_RGB_SRGB_BLOCK:
+        case VK_FORMAT_BC1_RGBA_SRGB_BLOCK:
+        case VK_FORMAT_BC2_SRGB_BLOCK:
+        case VK_FORMAT_BC3_SRGB_BLOCK:
+            return VK_FORMAT_R8G8B8A8_SRGB;
+        default:
+            return VK_FORMAT_UNDEFINED;
+    }
+}
+
+void par::transcodeImage(VkFormat format, uint8_t const* source, uint32_t width, uint32_t height,
+        uint8_t* dest) {
+    const uint32_t blockBytes = getFormatBlock(format).bytes;
+    uint8_t texels[16][4];
+    for (uint32_t by = 0; by < height; by += 4) {
+        for (uint32_t bx = 0; bx < width; bx += 4, source += blockBytes) {
+            decodeBlock(format, source, texels);
+            const uint32_t ncols = std::min(width - bx, 4u);
+            const uint32_t nrows = std::min(height - by, 4u);
+            for (uint32_t row = 0; row < nrows; row++) {
+                memcpy(dest + ((by + row) * width + bx) * 4, texels[row * 4], ncols * 4);
+            }
+        }
+    }
+}
@@ -7,17 +7,22 @@ using namespace par;
 
 static bool sFirst = true;
 
+#if defined(__ANDROID__)
+static const char* sPattern = "%^%v%$";
+#else
+static const char* sPattern = "%T %t %^%v%$";
+#endif
+
 LavaLog par::llog;
 
 LavaLog::LavaLog() {
     if (sFirst) {
         #if defined(__ANDROID__)
         mLogger = spdlog::android_logger("console", "lava");
-        mLogger->set_pattern("%^%v%$");
         #else
         mLogger = spdlog::stdout_color_mt("console");
-        mLogger->set_pattern("%T %t %^%v%$");
         #endif
+        mLogger->set_pattern(sPattern);
         #ifndef NDEBUG
         //mLogger->set_level(spdlog::level::debug);
         #endif
@@ -26,3 +31,32 @@ LavaLog::LavaLog() {
         mLogger = spdlog::get("console");
     }
 }
+
+// The new logger shares the sinks of the old one, so the output is unchanged. It takes over the
+// registry name, so that spdlog::get("console") continues to return the active logger.
+void LavaLog::replaceLogger(std::shared_ptr<spdlog::logger> logger) noexcept {
+    mLogger->flush();
+    logger->set_pattern(sPattern);
+    logger->set_level(mLogger->level());
+    spdlog::drop("console");
+    spdlog::register_logger(logger);
+    mLogger = logger;
+}
+
+void LavaLog::enableAsync(size_t queueSize, Overflow overflow) noexcept {
+    LOG_CHECK(queueSize && !(queueSize & (queueSize - 1)), "Queue size must be a power of two.");
+    const auto policy = overflow == Overflow::BLOCK ? spdlog::async_overflow_policy::block_retry :
+            spdlog::async_overflow_policy::discard_log_msg;
+    const auto& sinks = mLogger->sinks();
+    replaceLogger(std::make_shared<spdlog::async_logger>("console", sinks.begin(), sinks.end(),
+            queueSize, policy));
+}
+
+void LavaLog::disableAsync() noexcept {
+    const auto& sinks = mLogger->sinks();
+    replaceLogger(std::make_shared<spdlog::logger>("console", sinks.begin(), sinks.end()));
+}
+
+void LavaLog::flush() const noexcept {
+    mLogger->flush();
+}
@@ -4,6 +4,7 @@
 #include <par/LavaLoader.h>
 #include <par/LavaPipeCache.h>
 #include <par/LavaLog.h>
+#include <par/LavaTrace.h>
 
 #include <unordered_map>
 
@@ -15,12 +16,19 @@ namespace par {
 
 namespace {
 
+// Deep copy of a VkSpecializationInfo.
+struct Specialization {
+    vector<VkSpecializationMapEntry> entries;
+    vector<uint8_t> data;
+};
+
 struct CacheKey {
     LavaPipeCache::RasterState raster;
     VkShaderModule vshader;
     VkShaderModule fshader;
     VkRenderPass renderPass;
     LavaPipeCache::VertexState vertex;
+    Specialization specialization;
 };
 
 struct CacheVal {
@@ -47,7 +55,12 @@ struct HashFn {
         uint32_t hash3 = murmurHash((uint32_t const *) key.vertex.buffers.data(),
                 (key.vertex.buffers.size() * sizeof(VkVertexInputBindingDescription)) / 4,
                 hash2);
-        return hash3;
+        uint32_t hash4 = murmurHash((uint32_t const *) key.specialization.entries.data(),
+                (key.specialization.entries.size() * sizeof(VkSpecializationMapEntry)) / 4,
+                hash3);
+        uint32_t hash5 = murmurHash((uint32_t const *) key.specialization.data.data(),
+                key.specialization.data.size() / 4, hash4);
+        return hash5;
     }
 };
 
@@ -63,9 +76,24 @@ struct IsEqual {
         return a.location == b.location && a.binding == b.binding && a.format == b.format &&
                 a.offset == b.offset;
     }
+    bool operator()(const VkSpecializationMapEntry& a, const VkSpecializationMapEntry& b) const {
+        return a.constantID == b.constantID && a.offset == b.offset && a.size == b.size;
+    }
     bool operator()(const CacheKey& a, const CacheKey& b) const {
         return (*this)(a.raster, b.raster) && (*this)(a.vertex, b.vertex) &&
-                a.vshader == b.vshader && a.fshader == b.fshader && a.renderPass == b.renderPass;
+                a.vshader == b.vshader && a.fshader == b.fshader && a.renderPass == b.renderPass &&
+                (*this)(a.specialization, b.specialization);
+    }
+    bool operator()(const Specialization& a, const Specialization& b) const {
+        if (a.entries.size() != b.entries.size() || a.data != b.data) {
+            return false;
+        }
+        for (size_t i = 0; i < a.entries.size(); ++i) {
+            if (!(*this)(a.entries[i], b.entries[i])) {
+                return false;
+            }
+        }
+        return true;
     }
     bool operator()(const RasterState& a, const RasterState& b) const {
         return 0 == memcmp((const void*) &a, (const void*) &b, sizeof(b));
@@ -94,6 +122,11 @@ struct IsEqual {
     }
 };
 
+struct Grave {
+    VkPipeline handle;
+    uint64_t frame;
+};
+
 using Cache = unordered_map<CacheKey, CacheVal, HashFn, IsEqual>;
 
 namespace DirtyFlag {
@@ -101,16 +134,21 @@ namespace DirtyFlag {
     static constexpr uint8_t VERTEX = 1 << 1;
     static constexpr uint8_t SHADER = 1 << 2;
     static constexpr uint8_t PASS   = 1 << 3;
+    static constexpr uint8_t SPECIALIZATION = 1 << 4;
 }
 
 struct LavaPipeCacheImpl : LavaPipeCache {
     ~LavaPipeCacheImpl() noexcept;
+    void evictPipeline(Cache::const_iterator iter) noexcept;
     CacheVal* currentPipeline = nullptr;
     VkDevice device;
     Cache cache;
+    vector<Grave> graveyard;
+    uint64_t currentFrame = 0;
     CacheKey currentState;
     uint8_t dirtyFlags = 0xf;
     VkPipelineLayout pipelineLayout;
+    static Specialization copySpecialization(VkSpecializationInfo const* info) noexcept;
 };
 
 LAVA_DEFINE_UPCAST(LavaPipeCache)
@@ -165,12 +203,16 @@ LavaPipeCache* LavaPipeCache::create(Config config) noexcept {
         .renderPass = config.renderPass
     };
     auto& layouts = config.descriptorLayouts;
+    auto& ranges = config.pushConstants;
     VkPipelineLayoutCreateInfo info {
         .sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
         .setLayoutCount = (uint32_t) layouts.size(),
-        .pSetLayouts = layouts.empty() ? nullptr : layouts.data()
+        .pSetLayouts = layouts.empty() ? nullptr : layouts.data(),
+        .pushConstantRangeCount = (uint32_t) ranges.size(),
+        .pPushConstantRanges = ranges.empty() ? nullptr : ranges.data()
     };
     vkCreatePipelineLayout(impl->device, &info, VKALLOC, &impl->pipelineLayout);
+    impl->currentState.specialization = impl->copySpecialization(config.specialization);
     return impl;
 }
 
@@ -183,6 +225,9 @@ LavaPipeCacheImpl::~LavaPipeCacheImpl() noexcept {
     for (auto& pair : cache) {
         vkDestroyPipeline(device, pair.second.handle, VKALLOC);
     }
+    for (auto& grave : graveyard) {
+        vkDestroyPipeline(device, grave.handle, VKALLOC);
+    }
     vkDestroyPipelineLayout(device, pipelineLayout, VKALLOC);
 }
 
@@ -198,6 +243,7 @@ VkPipeline LavaPipeCache::getPipeline() noexcept {
 }
 
 bool LavaPipeCache::getPipeline(VkPipeline* pipeline) noexcept {
+    LAVA_TRACE_SCOPE("LavaPipeCache::getPipeline");
     auto impl = upcast(this);
     if (not impl->dirtyFlags) {
         *pipeline = impl->currentPipeline->handle;
@@ -246,17 +292,28 @@ bool LavaPipeCache::getPipeline(VkPipeline* pipeline) noexcept {
         .pAttachments = key.fshader ? &key.raster.blending : nullptr,
     };
 
+    VkSpecializationInfo specialization {
+        .mapEntryCount = (uint32_t) key.specialization.entries.size(),
+        .pMapEntries = key.specialization.entries.data(),
+        .dataSize = key.specialization.data.size(),
+        .pData = key.specialization.data.data()
+    };
+    VkSpecializationInfo const* pspecialization =
+            key.specialization.entries.empty() ? nullptr : &specialization;
+
     VkPipelineShaderStageCreateInfo vshader {
         .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
         .stage = VK_SHADER_STAGE_VERTEX_BIT,
         .module = key.vshader,
-        .pName = "main"
+        .pName = "main",
+        .pSpecializationInfo = pspecialization
     };
     VkPipelineShaderStageCreateInfo fshader {
         .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
         .stage = VK_SHADER_STAGE_FRAGMENT_BIT,
         .module = key.fshader,
-        .pName = "main"
+        .pName = "main",
+        .pSpecializationInfo = pspecialization
     };
     VkPipelineShaderStageCreateInfo shaders[] = { vshader, fshader };
 
@@ -341,17 +398,76 @@ void LavaPipeCache::setRenderPass(VkRenderPass renderPass) noexcept {
     }
 }
 
+Specialization LavaPipeCacheImpl::copySpecialization(VkSpecializationInfo const* info) noexcept {
+    if (!info || info->mapEntryCount == 0) {
+        return {};
+    }
+    auto data = (uint8_t const*) info->pData;
+    return {
+        .entries = {info->pMapEntries, info->pMapEntries + info->mapEntryCount},
+        .data = {data, data + info->dataSize}
+    };
+}
+
+void LavaPipeCache::setSpecializationInfo(VkSpecializationInfo const* info) noexcept {
+    LavaPipeCacheImpl* impl = upcast(this);
+    Specialization specialization = impl->copySpecialization(info);
+    if (!IsEqual()(specialization, impl->currentState.specialization)) {
+        impl->currentState.specialization = move(specialization);
+        impl->dirtyFlags |= DirtyFlag::SPECIALIZATION;
+    }
+}
+
+void LavaPipeCache::replaceShader(VkShaderModule oldModule, VkShaderModule newModule) noexcept {
+    LavaPipeCacheImpl* impl = upcast(this);
+    auto& cache = impl->cache;
+    for (Cache::const_iterator iter = cache.begin(); iter != cache.end();) {
+        if (iter->first.vshader == oldModule || iter->first.fshader == oldModule) {
+            impl->evictPipeline(iter++);
+        } else {
+            ++iter;
+        }
+    }
+    if (impl->currentState.vshader == oldModule) {
+        setVertexShader(newModule);
+    }
+    if (impl->currentState.fshader == oldModule) {
+        setFragmentShader(newModule);
+    }
+}
+
 void LavaPipeCache::releaseUnused(uint64_t milliseconds) noexcept {
     LavaPipeCacheImpl* impl = upcast(this);
+    const uint64_t currentFrame = ++impl->currentFrame;
     const uint64_t expiration = getCurrentTime() - milliseconds;
     auto& cache = impl->cache;
-    for (decltype(impl->cache)::const_iterator iter = cache.begin(); iter != cache.end();) {
+    for (Cache::const_iterator iter = cache.begin(); iter != cache.end();) {
         if (iter->second.timestamp < expiration) {
-            iter = cache.erase(iter);
+            impl->evictPipeline(iter++);
         } else {
             ++iter;
         }
     }
+
+    // Graves are appended in frame order, so the expired ones are always at the front.
+    auto& graveyard = impl->graveyard;
+    size_t expired = 0;
+    while (expired < graveyard.size() &&
+            graveyard[expired].frame + FRAMES_IN_FLIGHT <= currentFrame) {
+        vkDestroyPipeline(impl->device, graveyard[expired++].handle, VKALLOC);
+    }
+    graveyard.erase(graveyard.begin(), graveyard.begin() + expired);
+}
+
+// Removes the cache entry immediately, but defers destruction of the pipeline since it might be
+// referenced by a command buffer that has not finished executing.
+void LavaPipeCacheImpl::evictPipeline(Cache::const_iterator iter) noexcept {
+    if (currentPipeline == &iter->second) {
+        currentPipeline = nullptr;
+        dirtyFlags |= DirtyFlag::SHADER;
+    }
+    graveyard.push_back({iter->second.handle, currentFrame});
+    cache.erase(iter);
 }
 
 } // par namespace
\ No newline at end of file
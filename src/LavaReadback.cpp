@@ -0,0 +1,407 @@
+// The MIT License
+// Copyright (c) 2018 Philip Rideout
+
+#include <par/LavaLoader.h>
+#include <par/LavaReadback.h>
+#include <par/LavaLog.h>
+
+#include <array>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <stdio.h>
+
+#include "LavaInternal.h"
+
+using namespace par;
+using namespace std;
+
+namespace {
+
+constexpr uint32_t DEFAULT_CAPACITY = 3;
+constexpr uint32_t DEFAULT_QUEUE_DEPTH = 8;
+constexpr uint64_t FLUSH_TIMEOUT_MS = 1000;
+
+struct Slot {
+    VkBuffer buffer;
+    VmaAllocation memory;
+    uint8_t* mapped;
+    VkEvent event;
+    uint64_t frameNumber;
+};
+
+struct QueuedFrame {
+    vector<uint8_t> pixels;
+    uint64_t frameNumber;
+};
+
+struct LavaReadbackImpl : LavaReadback {
+    LavaReadbackImpl(Config config) noexcept;
+    ~LavaReadbackImpl() noexcept;
+    void deliver(const Slot& slot, const FrameCallback& callback) noexcept;
+    void retire() noexcept;
+    void runWorker() noexcept;
+    void writeFrame(const QueuedFrame& frame) const noexcept;
+    VkDevice device;
+    VmaAllocator vma;
+    uint32_t width;
+    uint32_t height;
+    VkFormat format;
+    uint32_t frameSize;
+    vector<Slot> slots;
+    uint32_t head = 0;
+    uint32_t tail = 0;
+    uint32_t npending = 0;
+    uint64_t frameCount = 0;
+    uint64_t droppedFrames = 0;
+
+    // Streaming state, shared with the worker thread.
+    thread worker;
+    mutex queueMutex;
+    condition_variable queueCondition;
+    deque<QueuedFrame> queue;
+    Sink sink;
+    bool streaming = false;
+    bool quitting = false;
+};
+
+LAVA_DEFINE_UPCAST(LavaReadback)
+
+// Writes an 8-bit RGBA PNG using stored (uncompressed) deflate blocks. This keeps the core library
+// free of third-party dependencies; clients that need small files can consume RAW frames instead.
+void writePng(FILE* file, uint8_t const* rgba, uint32_t width, uint32_t height, bool bgra) {
+    // Built once in a thread-safe manner, since several readbacks may stream on their own threads.
+    static const array<uint32_t, 256> crcTable = [] {
+        array<uint32_t, 256> table;
+        for (uint32_t n = 0; n < 256; n++) {
+            uint32_t c = n;
+            for (int k = 0; k < 8; k++) {
+                c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+            }
+            table[n] = c;
+        }
+        return table;
+    }();
+    auto crc = [](uint8_t const* data, size_t len, uint32_t c) {
+        for (size_t i = 0; i < len; i++) {
+            c = crcTable[(c ^ data[i]) & 0xff] ^ (c >> 8);
+        }
+        return c;
+    };
+    auto put32 = [](vector<uint8_t>& v, uint32_t x) {
+        v.push_back(x >> 24); v.push_back(x >> 16); v.push_back(x >> 8); v.push_back(x);
+    };
+    auto writeChunk = [&](char const* type, const vector<uint8_t>& payload) {
+        vector<uint8_t> chunk;
+        put32(chunk, (uint32_t) payload.size());
+        chunk.insert(chunk.end(), type, type + 4);
+        chunk.insert(chunk.end(), payload.begin(), payload.end());
+        const uint32_t c = crc(chunk.data() + 4, chunk.size() - 4, 0xffffffffu) ^ 0xffffffffu;
+        put32(chunk, c);
+        fwrite(chunk.data(), 1, chunk.size(), file);
+    };
+
+    // Filtered scanlines: each row is prefixed with a zero "None" filter byte.
+    const uint32_t stride = width * 4;
+    vector<uint8_t> raw;
+    raw.reserve((stride + 1) * height);
+    for (uint32_t y = 0; y < height; y++) {
+        raw.push_back(0);
+        uint8_t const* row = rgba + y * stride;
+        for (uint32_t x = 0; x < width; x++, row += 4) {
+            raw.push_back(row[bgra ? 2 : 0]);
+            raw.push_back(row[1]);
+            raw.push_back(row[bgra ? 0 : 2]);
+            raw.push_back(row[3]);
+        }
+    }
+
+    // Wrap the scanlines in a zlib stream composed of stored blocks.
+    vector<uint8_t> zlib { 0x78, 0x01 };
+    uint32_t a = 1, b = 0;
+    for (size_t offset = 0; offset < raw.size();) {
+        const uint16_t len = (uint16_t) min<size_t>(65535, raw.size() - offset);
+        const bool last = offset + len == raw.size();
+        zlib.push_back(last ? 1 : 0);
+        zlib.push_back(len & 0xff); zlib.push_back(len >> 8);
+        zlib.push_back(~len & 0xff); zlib.push_back((~len >> 8) & 0xff);
+        for (uint32_t i = 0; i < len; i++) {
+            const uint8_t byte = raw[offset + i];
+            zlib.push_back(byte);
+            a = (a + byte) % 65521;
+            b = (b + a) % 65521;
+        }
+        offset += len;
+    }
+    put32(zlib, (b << 16) | a);
+
+    vector<uint8_t> header;
+    put32(header, width);
+    put32(header, height);
+    header.insert(header.end(), { 8, 6, 0, 0, 0 });
+    static const uint8_t signature[] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+    fwrite(signature, 1, sizeof(signature), file);
+    writeChunk("IHDR", header);
+    writeChunk("IDAT", zlib);
+    writeChunk("IEND", {});
+}
+
+} // anonymous namespace
+
+LavaReadback* LavaReadback::create(Config config) noexcept {
+    return new LavaReadbackImpl(config);
+}
+
+void LavaReadback::operator delete(void* ptr) {
+    auto impl = (LavaReadbackImpl*) ptr;
+    ::delete impl;
+}
+
+LavaReadbackImpl::LavaReadbackImpl(Config config) noexcept : device(config.device) {
+    assert(config.device && config.gpu && config.width > 0 && config.height > 0);
+    vma = getVma(config.device, config.gpu);
+    width = config.width;
+    height = config.height;
+    format = config.format;
+    const uint32_t bpp = getBytesPerPixel(format);
+    LOG_CHECK(bpp > 0, "Unsupported readback format.");
+    frameSize = width * height * bpp;
+    slots.resize(config.capacity ? config.capacity : DEFAULT_CAPACITY);
+    VkBufferCreateInfo bufferInfo {
+        .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+        .size = frameSize,
+        .usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT
+    };
+    VmaAllocationCreateInfo allocInfo {
+        .flags = VMA_ALLOCATION_CREATE_MAPPED_BIT,
+        .usage = VMA_MEMORY_USAGE_GPU_TO_CPU
+    };
+    VkEventCreateInfo eventInfo { .sType = VK_STRUCTURE_TYPE_EVENT_CREATE_INFO };
+    for (auto& slot : slots) {
+        VmaAllocationInfo info;
+        vmaCreateBuffer(vma, &bufferInfo, &allocInfo, &slot.buffer, &slot.memory, &info);
+        trackAllocation(vma, slot.memory, MEMORY_STAGING);
+        slot.mapped = (uint8_t*) info.pMappedData;
+        vkCreateEvent(device, &eventInfo, VKALLOC, &slot.event);
+    }
+}
+
+LavaReadbackImpl::~LavaReadbackImpl() noexcept {
+    upcast(this)->stopStreaming();
+    for (auto& slot : slots) {
+        vkDestroyEvent(device, slot.event, VKALLOC);
+        untrackAllocation(vma, slot.memory);
+        vmaDestroyBuffer(vma, slot.buffer, slot.memory);
+    }
+}
+
+bool LavaReadback::capture(VkCommandBuffer cmd, VkImage image, VkImageLayout layout) noexcept {
+    LavaReadbackImpl& impl = *upcast(this);
+    const uint64_t frameNumber = impl.frameCount++;
+    if (impl.npending == impl.slots.size()) {
+        impl.droppedFrames++;
+        llog.debug("Readback ring is full, dropping frame {}.", frameNumber);
+        return false;
+    }
+    Slot& slot = impl.slots[impl.head];
+    slot.frameNumber = frameNumber;
+    impl.head = (impl.head + 1) % impl.slots.size();
+    impl.npending++;
+
+    const VkImageSubresourceRange range {
+        .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+        .levelCount = 1,
+        .layerCount = 1,
+    };
+    VkImageMemoryBarrier barrier1 {
+        .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+        .image = image,
+        .oldLayout = layout,
+        .newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+        .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .subresourceRange = range,
+        .srcAccessMask = VK_ACCESS_MEMORY_WRITE_BIT,
+        .dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT
+    };
+    VkBufferImageCopy region {
+        .imageSubresource = {
+            .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+            .layerCount = 1,
+        },
+        .imageExtent = {
+            .width = impl.width,
+            .height = impl.height,
+            .depth = 1,
+        }
+    };
+    VkImageMemoryBarrier barrier2 {
+        .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+        .image = image,
+        .oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+        .newLayout = layout,
+        .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .subresourceRange = range,
+        .srcAccessMask = VK_ACCESS_TRANSFER_READ_BIT,
+        .dstAccessMask = VK_ACCESS_MEMORY_READ_BIT
+    };
+    VkBufferMemoryBarrier hostBarrier {
+        .sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER,
+        .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+        .dstAccessMask = VK_ACCESS_HOST_READ_BIT,
+        .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .buffer = slot.buffer,
+        .size = VK_WHOLE_SIZE
+    };
+    vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
+            VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 1, &barrier1);
+    vkCmdCopyImageToBuffer(cmd, image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, slot.buffer,
+            1, &region);
+    vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT,
+            VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, 0, 0, nullptr, 0, nullptr, 1, &barrier2);
+    vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT,
+            VK_PIPELINE_STAGE_HOST_BIT, 0, 0, nullptr, 1, &hostBarrier, 0, nullptr);
+    vkCmdSetEvent(cmd, slot.event, VK_PIPELINE_STAGE_TRANSFER_BIT);
+    return true;
+}
+
+void LavaReadbackImpl::deliver(const Slot& slot, const FrameCallback& callback) noexcept {
+    invalidateAllocation(device, vma, slot.memory, 0, frameSize);
+    if (callback) {
+        const Frame frame {
+            .data = slot.mapped,
+            .size = frameSize,
+            .width = width,
+            .height = height,
+            .format = format,
+            .frameNumber = slot.frameNumber,
+        };
+        callback(frame);
+    }
+    if (streaming) {
+        lock_guard<mutex> lock(queueMutex);
+        if (queue.size() >= sink.queueDepth) {
+            droppedFrames++;
+            llog.warn("Readback sink is falling behind, dropping frame {}.", slot.frameNumber);
+            return;
+        }
+        queue.emplace_back(QueuedFrame {
+            .pixels = vector<uint8_t>(slot.mapped, slot.mapped + frameSize),
+            .frameNumber = slot.frameNumber,
+        });
+        queueCondition.notify_one();
+    }
+}
+
+void LavaReadbackImpl::retire() noexcept {
+    vkResetEvent(device, slots[tail].event);
+    tail = (tail + 1) % slots.size();
+    npending--;
+}
+
+uint32_t LavaReadback::poll(FrameCallback callback) noexcept {
+    LavaReadbackImpl& impl = *upcast(this);
+    uint32_t ndelivered = 0;
+    while (impl.npending > 0) {
+        const Slot& slot = impl.slots[impl.tail];
+        if (vkGetEventStatus(impl.device, slot.event) != VK_EVENT_SET) {
+            break;
+        }
+        impl.deliver(slot, callback);
+        impl.retire();
+        ndelivered++;
+    }
+    return ndelivered;
+}
+
+uint32_t LavaReadback::flush(FrameCallback callback) noexcept {
+    LavaReadbackImpl& impl = *upcast(this);
+    const uint64_t expiration = getCurrentTime() + FLUSH_TIMEOUT_MS;
+    uint32_t ndelivered = 0;
+    while (impl.npending > 0) {
+        ndelivered += poll(callback);
+        if (impl.npending > 0 && getCurrentTime() > expiration) {
+            // The copies may still be in flight, so the slots stay pending rather than having
+            // their events reset underneath a command buffer that has yet to signal them.
+            llog.error("Readback flush timed out, were the command buffers submitted?");
+            break;
+        }
+        this_thread::yield();
+    }
+    return ndelivered;
+}
+
+void LavaReadback::startStreaming(const Sink& sink) noexcept {
+    LavaReadbackImpl& impl = *upcast(this);
+    stopStreaming();
+    impl.sink = sink;
+    impl.sink.queueDepth = sink.queueDepth ? sink.queueDepth : DEFAULT_QUEUE_DEPTH;
+    const VkFormat fmt = impl.format;
+    const bool rgba8 = fmt == VK_FORMAT_R8G8B8A8_UNORM || fmt == VK_FORMAT_R8G8B8A8_SRGB ||
+            fmt == VK_FORMAT_B8G8R8A8_UNORM || fmt == VK_FORMAT_B8G8R8A8_SRGB;
+    if (impl.sink.fileFormat == PNG && !rgba8) {
+        llog.warn("PNG streaming requires an 8-bit RGBA format, writing RAW frames instead.");
+        impl.sink.fileFormat = RAW;
+    }
+    impl.quitting = false;
+    impl.streaming = true;
+    impl.worker = thread([&impl] { impl.runWorker(); });
+}
+
+void LavaReadback::stopStreaming() noexcept {
+    LavaReadbackImpl& impl = *upcast(this);
+    if (!impl.streaming) {
+        return;
+    }
+    {
+        lock_guard<mutex> lock(impl.queueMutex);
+        impl.quitting = true;
+        impl.queueCondition.notify_one();
+    }
+    impl.worker.join();
+    impl.streaming = false;
+}
+
+uint64_t LavaReadback::getDroppedFrameCount() const noexcept {
+    return upcast(this)->droppedFrames;
+}
+
+void LavaReadbackImpl::runWorker() noexcept {
+    while (true) {
+        QueuedFrame frame;
+        {
+            unique_lock<mutex> lock(queueMutex);
+            queueCondition.wait(lock, [this] { return quitting || !queue.empty(); });
+            if (queue.empty()) {
+                return;
+            }
+            frame = move(queue.front());
+            queue.pop_front();
+        }
+        writeFrame(frame);
+    }
+}
+
+void LavaReadbackImpl::writeFrame(const QueuedFrame& frame) const noexcept {
+    char filename[32];
+    snprintf(filename, sizeof(filename), "%06llu.%s", (unsigned long long) frame.frameNumber,
+            sink.fileFormat == PNG ? "png" : "raw");
+    const string path = (sink.folder.empty() ? "" : sink.folder + "/") + sink.prefix + filename;
+    FILE* file = fopen(path.c_str(), "wb");
+    if (!file) {
+        llog.error("Unable to open {} for writing.", path);
+        return;
+    }
+    if (sink.fileFormat == PNG) {
+        const bool bgra = format == VK_FORMAT_B8G8R8A8_UNORM || format == VK_FORMAT_B8G8R8A8_SRGB;
+        writePng(file, frame.pixels.data(), width, height, bgra);
+    } else {
+        fwrite(frame.pixels.data(), 1, frame.pixels.size(), file);
+    }
+    fclose(file);
+}
@@ -0,0 +1,180 @@
+// The MIT License
+// Copyright (c) 2018 Philip Rideout
+
+#include <par/LavaLoader.h>
+#include <par/LavaSamplerCache.h>
+#include <par/LavaLog.h>
+
+#include <unordered_map>
+
+#include <assert.h>
+#include <string.h>
+
+#include "LavaInternal.h"
+
+using namespace par;
+using namespace std;
+
+namespace {
+
+// Holds every field of VkSamplerCreateInfo except for sType and pNext. Each field is 4 bytes, so
+// there is no padding to hash.
+struct SamplerKey {
+    VkSamplerCreateFlags flags;
+    VkFilter magFilter;
+    VkFilter minFilter;
+    VkSamplerMipmapMode mipmapMode;
+    VkSamplerAddressMode addressModeU;
+    VkSamplerAddressMode addressModeV;
+    VkSamplerAddressMode addressModeW;
+    float mipLodBias;
+    VkBool32 anisotropyEnable;
+    float maxAnisotropy;
+    VkBool32 compareEnable;
+    VkCompareOp compareOp;
+    float minLod;
+    float maxLod;
+    VkBorderColor borderColor;
+    VkBool32 unnormalizedCoordinates;
+};
+
+struct SamplerVal {
+    VkSampler handle;
+    uint32_t refs;
+    uint64_t frame;     // Frame at which the reference count last dropped to zero.
+};
+
+struct SamplerIsEqual {
+    bool operator()(const SamplerKey& a, const SamplerKey& b) const {
+        return 0 == memcmp((const void*) &a, (const void*) &b, sizeof(b));
+    }
+};
+
+using Cache = unordered_map<SamplerKey, SamplerVal, MurmurHashFn<SamplerKey>, SamplerIsEqual>;
+
+struct LavaSamplerCacheImpl : LavaSamplerCache {
+    VkDevice device;
+    uint32_t capacity;
+    uint64_t currentFrame = 0;
+    Cache cache;
+    unordered_map<VkSampler, SamplerKey> keys;
+    Stats stats {};
+};
+
+LAVA_DEFINE_UPCAST(LavaSamplerCache)
+
+SamplerKey makeKey(const VkSamplerCreateInfo& info) {
+    return {
+        .flags = info.flags,
+        .magFilter = info.magFilter,
+        .minFilter = info.minFilter,
+        .mipmapMode = info.mipmapMode,
+        .addressModeU = info.addressModeU,
+        .addressModeV = info.addressModeV,
+        .addressModeW = info.addressModeW,
+        .mipLodBias = info.mipLodBias,
+        .anisotropyEnable = info.anisotropyEnable,
+        .maxAnisotropy = info.maxAnisotropy,
+        .compareEnable = info.compareEnable,
+        .compareOp = info.compareOp,
+        .minLod = info.minLod,
+        .maxLod = info.maxLod,
+        .borderColor = info.borderColor,
+        .unnormalizedCoordinates = info.unnormalizedCoordinates,
+    };
+}
+
+} // anonymous namespace
+
+LavaSamplerCache* LavaSamplerCache::create(Config config) noexcept {
+    auto impl = new LavaSamplerCacheImpl;
+    impl->device = config.device;
+    VkPhysicalDeviceProperties props;
+    vkGetPhysicalDeviceProperties(config.gpu, &props);
+    const uint32_t limit = props.limits.maxSamplerAllocationCount;
+    impl->capacity = config.capacity ? std::min(config.capacity, limit) : limit;
+    return impl;
+}
+
+void LavaSamplerCache::operator delete(void* ptr) {
+    auto impl = (LavaSamplerCacheImpl*) ptr;
+    for (auto& pair : impl->cache) {
+        vkDestroySampler(impl->device, pair.second.handle, VKALLOC);
+    }
+    ::delete impl;
+}
+
+VkSampler LavaSamplerCache::getSampler(const VkSamplerCreateInfo& info) noexcept {
+    LOG_CHECK(!info.pNext, "Sampler extension structures are not supported.");
+    auto impl = upcast(this);
+    const SamplerKey key = makeKey(info);
+    auto iter = impl->cache.find(key);
+    if (iter != impl->cache.end()) {
+        SamplerVal& val = iter->second;
+        if (val.refs++ == 0) {
+            impl->stats.idleCount--;
+        }
+        impl->stats.hits++;
+        return val.handle;
+    }
+    impl->stats.misses++;
+
+    // When the cache is full, evict the least-recently released sampler that is out of flight.
+    if (impl->cache.size() >= impl->capacity) {
+        auto victim = impl->cache.end();
+        for (auto it = impl->cache.begin(); it != impl->cache.end(); ++it) {
+            const SamplerVal& val = it->second;
+            if (val.refs == 0 && val.frame + FRAMES_IN_FLIGHT <= impl->currentFrame &&
+                    (victim == impl->cache.end() || val.frame < victim->second.frame)) {
+                victim = it;
+            }
+        }
+        if (victim == impl->cache.end()) {
+            llog.error("Unable to evict a sampler, {} are in use.", impl->cache.size());
+            return VK_NULL_HANDLE;
+        }
+        vkDestroySampler(impl->device, victim->second.handle, VKALLOC);
+        impl->keys.erase(victim->second.handle);
+        impl->cache.erase(victim);
+        impl->stats.idleCount--;
+        impl->stats.evictions++;
+    }
+
+    VkSamplerCreateInfo createInfo = info;
+    createInfo.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+    createInfo.pNext = nullptr;
+    VkSampler handle;
+    if (vkCreateSampler(impl->device, &createInfo, VKALLOC, &handle) != VK_SUCCESS) {
+        llog.error("Unable to create sampler.");
+        return VK_NULL_HANDLE;
+    }
+    impl->cache.emplace(key, SamplerVal {handle, 1, 0});
+    impl->keys.emplace(handle, key);
+    return handle;
+}
+
+void LavaSamplerCache::releaseSampler(VkSampler sampler) noexcept {
+    auto impl = upcast(this);
+    auto iter = impl->keys.find(sampler);
+    LOG_CHECK(iter != impl->keys.end(), "Unknown sampler.");
+    if (iter == impl->keys.end()) {
+        return;
+    }
+    SamplerVal& val = impl->cache.find(iter->second)->second;
+    assert(val.refs > 0);
+    if (--val.refs == 0) {
+        val.frame = impl->currentFrame;
+        impl->stats.idleCount++;
+    }
+}
+
+void LavaSamplerCache::releaseUnused() noexcept {
+    upcast(this)->currentFrame++;
+}
+
+LavaSamplerCache::Stats LavaSamplerCache::getStats() const noexcept {
+    auto impl = upcast(this);
+    Stats stats = impl->stats;
+    stats.samplerCount = impl->cache.size();
+    return stats;
+}
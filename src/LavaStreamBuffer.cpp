@@ -0,0 +1,144 @@
+// The MIT License
+// Copyright (c) 2018 Philip Rideout
+
+#include <par/LavaLoader.h>
+#include <par/LavaStreamBuffer.h>
+#include <par/LavaLog.h>
+
+#include "LavaInternal.h"
+
+using namespace par;
+
+namespace {
+
+struct LavaStreamBufferImpl : LavaStreamBuffer {
+    LavaStreamBufferImpl(Config config) noexcept;
+    ~LavaStreamBufferImpl() noexcept;
+    VkDevice device;
+    VmaAllocator vma;
+    VkBuffer buffer;
+    VmaAllocation memory;
+    uint8_t* mapped;
+    uint32_t capacity;
+    uint32_t alignment;
+
+    // The ring is FIFO, so the tail is implicitly at (head - used), modulo capacity. Each frame
+    // remembers how many bytes it consumed (including alignment and wrap-around padding) so that
+    // retiring it simply decrements "used".
+    uint32_t head = 0;
+    uint32_t used = 0;
+    uint32_t frameStart = 0;
+    uint32_t frameUsed[FRAMES_IN_FLIGHT] = {};
+    uint64_t currentFrame = 0;
+};
+
+LAVA_DEFINE_UPCAST(LavaStreamBuffer)
+
+}
+
+LavaStreamBuffer* LavaStreamBuffer::create(Config config) noexcept {
+    return new LavaStreamBufferImpl(config);
+}
+
+void LavaStreamBuffer::operator delete(void* ptr) {
+    auto impl = (LavaStreamBufferImpl*) ptr;
+    ::delete impl;
+}
+
+LavaStreamBufferImpl::~LavaStreamBufferImpl() noexcept {
+    untrackAllocation(vma, memory);
+    vmaDestroyBuffer(vma, buffer, memory);
+}
+
+LavaStreamBufferImpl::LavaStreamBufferImpl(Config config) noexcept : device(config.device) {
+    assert(config.device && config.gpu && config.capacity > 0);
+    vma = getVma(config.device, config.gpu);
+    VkPhysicalDeviceProperties props;
+    vkGetPhysicalDeviceProperties(config.gpu, &props);
+    alignment = (uint32_t) props.limits.minUniformBufferOffsetAlignment;
+    alignment = alignment < 4 ? 4 : alignment;
+    capacity = config.capacity;
+    VkBufferCreateInfo bufferInfo {
+        .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+        .size = capacity,
+        .usage = config.usage ? config.usage : (VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT |
+                VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT)
+    };
+    VmaAllocationCreateInfo allocInfo {
+        .flags = VMA_ALLOCATION_CREATE_MAPPED_BIT,
+        .usage = VMA_MEMORY_USAGE_CPU_TO_GPU
+    };
+    VmaAllocationInfo info;
+    vmaCreateBuffer(vma, &bufferInfo, &allocInfo, &buffer, &memory, &info);
+    trackAllocation(vma, memory, MEMORY_BUFFER);
+    mapped = (uint8_t*) info.pMappedData;
+}
+
+void LavaStreamBuffer::beginFrame() noexcept {
+    auto impl = upcast(this);
+    const uint32_t slot = ++impl->currentFrame % FRAMES_IN_FLIGHT;
+    assert(impl->used >= impl->frameUsed[slot]);
+    impl->used -= impl->frameUsed[slot];
+    impl->frameUsed[slot] = 0;
+    if (impl->used == 0) {
+        impl->head = 0;
+    }
+    impl->frameStart = impl->head;
+}
+
+void LavaStreamBuffer::endFrame() noexcept {
+    auto impl = upcast(this);
+    const uint32_t start = impl->frameStart;
+    const uint32_t end = impl->head;
+    if (start < end) {
+        flushAllocation(impl->device, impl->vma, impl->memory, start, end - start);
+    } else if (start > end || impl->frameUsed[impl->currentFrame % FRAMES_IN_FLIGHT] > 0) {
+        flushAllocation(impl->device, impl->vma, impl->memory, start, impl->capacity - start);
+        if (end > 0) {
+            flushAllocation(impl->device, impl->vma, impl->memory, 0, end);
+        }
+    }
+    impl->frameStart = end;
+}
+
+LavaStreamBuffer::Allocation LavaStreamBuffer::allocate(uint32_t size) noexcept {
+    auto impl = upcast(this);
+    const uint32_t mask = impl->alignment - 1;
+    uint32_t offset = (impl->head + mask) & ~mask;
+    uint32_t padding = offset - impl->head;
+
+    // If the range does not fit at the end of the ring, skip to the beginning.
+    if (offset + size > impl->capacity) {
+        padding = impl->capacity - impl->head;
+        offset = 0;
+    }
+    const uint32_t consumed = padding + size;
+    if (size > impl->capacity || impl->used + consumed > impl->capacity) {
+        llog.error("LavaStreamBuffer is full ({} bytes in flight).", impl->used);
+        return {impl->buffer, 0, nullptr};
+    }
+    impl->head = offset + size;
+    impl->used += consumed;
+    impl->frameUsed[impl->currentFrame % FRAMES_IN_FLIGHT] += consumed;
+    return {impl->buffer, offset, impl->mapped + offset};
+}
+
+LavaStreamBuffer::Allocation LavaStreamBuffer::push(void const* data, uint32_t size) noexcept {
+    Allocation alloc = allocate(size);
+    if (alloc.data) {
+        memcpy(alloc.data, data, size);
+    }
+    return alloc;
+}
+
+VkBuffer LavaStreamBuffer::getBuffer() const noexcept {
+    return upcast(this)->buffer;
+}
+
+uint32_t LavaStreamBuffer::getAlignment() const noexcept {
+    return upcast(this)->alignment;
+}
+
+uint32_t LavaStreamBuffer::getUsedBytes() const noexcept {
+    return upcast(this)->used;
+}
@@ -6,6 +6,7 @@
 #include <par/LavaLog.h>
 
 #include <unordered_map>
+#include <vector>
 
 #include "LavaInternal.h"
 
@@ -19,14 +20,40 @@ enum AttachmentType {
     DEPTH,
 };
 
+struct PoolKey {
+    uint32_t width;
+    uint32_t height;
+    VkFormat format;
+    VkImageUsageFlags usage;
+    VkSampleCountFlagBits samples;
+};
+
 struct AttachmentImpl : LavaSurfCache::Attachment {
     VmaAllocation mem;
     AttachmentType type;
+    PoolKey key;
+    VkDeviceSize bytes;
+    VkImageCreateInfo imageInfo;
+    VkImageViewCreateInfo viewInfo;
+};
+
+struct PoolVal {
+    AttachmentImpl* attachment;
+    uint64_t frame;
+    uint64_t timestamp;
+};
+
+struct PoolIsEqual {
+    bool operator()(const PoolKey& a, const PoolKey& b) const {
+        return 0 == memcmp((const void*) &a, (const void*) &b, sizeof(b));
+    }
 };
 
+// Framebuffers are keyed on attachment generations rather than pointers, since a freed attachment
+// might be recycled, or its address might be reused by the heap.
 struct FbCacheKey {
-    LavaSurfCache::Attachment const* color;
-    LavaSurfCache::Attachment const* depth;
+    uint64_t color;
+    uint64_t depth;
 };
 
 struct FbCacheVal {
@@ -38,6 +65,11 @@ struct FbCacheVal {
     FbCacheVal& operator=(FbCacheVal &&) = default;
 };
 
+struct FbGrave {
+    VkFramebuffer handle;
+    uint64_t frame;
+};
+
 struct RpCacheKey {
     VkFormat clayout;
     VkFormat dlayout;
@@ -61,12 +93,22 @@ struct RpHashFn { uint64_t operator()(const RpCacheKey& key) const; };
 
 using FbCache = unordered_map<FbCacheKey, FbCacheVal, FbHashFn, FbIsEqual>;
 using RpCache = unordered_map<RpCacheKey, RpCacheVal, RpHashFn, RpIsEqual>;
+using Pool = unordered_map<PoolKey, vector<PoolVal>, MurmurHashFn<PoolKey>, PoolIsEqual>;
 
 struct LavaSurfCacheImpl : LavaSurfCache {
+    void destroyAttachment(AttachmentImpl const* attach) const noexcept;
+    LavaContext::Relocation relocateAttachment(AttachmentImpl* attach) const noexcept;
     VkDevice device;
     VmaAllocator vma;
-    FbCache fbcache;
     RpCache rpcache;
+    uint64_t maxPooledBytes;
+    uint64_t currentFrame = 0;
+    // The pool and framebuffer cache are mutable because freeing an attachment is logically const.
+    mutable FbCache fbcache;
+    mutable vector<FbGrave> graveyard;
+    mutable Pool pool;
+    mutable PoolStats stats {};
+    mutable uint64_t nextGeneration = 1;
 };
 
 LAVA_DEFINE_UPCAST(LavaSurfCache)
@@ -77,6 +119,7 @@ LavaSurfCache* LavaSurfCache::create(const Config& config) noexcept {
     auto impl = new LavaSurfCacheImpl;
     impl->device = config.device;
     impl->vma = getVma(config.device, config.gpu);
+    impl->maxPooledBytes = config.maxPooledBytes;
     return impl;
 }
 
@@ -86,35 +129,78 @@ void LavaSurfCache::operator delete(void* ptr) {
     for (auto& pair : impl->fbcache) {
         vkDestroyFramebuffer(device, pair.second.handle, VKALLOC);
     }
+    for (auto& grave : impl->graveyard) {
+        vkDestroyFramebuffer(device, grave.handle, VKALLOC);
+    }
     for (auto& pair : impl->rpcache) {
         vkDestroyRenderPass(device, pair.second.handle, VKALLOC);
     }
+    for (auto& pair : impl->pool) {
+        for (auto& val : pair.second) {
+            impl->destroyAttachment(val.attachment);
+        }
+    }
     ::delete impl;
 }
 
 LavaSurfCache::Attachment const* LavaSurfCache::createColorAttachment(
         const AttachmentConfig& config) const noexcept {
     auto impl = upcast(this);
+    const PoolKey key {
+        .width = config.width,
+        .height = config.height,
+        .format = config.format,
+        .usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT |
+                (config.enableRead ? VK_IMAGE_USAGE_TRANSFER_SRC_BIT : VkImageUsageFlags {}) |
+                (config.enableUpload ? VK_IMAGE_USAGE_TRANSFER_DST_BIT : VkImageUsageFlags {}),
+        .samples = config.samples ? config.samples : VK_SAMPLE_COUNT_1_BIT,
+    };
+
+    // Recycle the least-recently freed attachment that is no longer in flight.
+    auto iter = impl->pool.find(key);
+    if (iter != impl->pool.end()) {
+        auto& vals = iter->second;
+        if (!vals.empty() && vals.front().frame + FRAMES_IN_FLIGHT <= impl->currentFrame) {
+            AttachmentImpl* attach = vals.front().attachment;
+            vals.erase(vals.begin());
+            unregisterMovable(impl->vma, attach->mem);
+            attach->generation = impl->nextGeneration++;
+            impl->stats.hits++;
+            impl->stats.pooledCount--;
+            impl->stats.pooledBytes -= attach->bytes;
+            impl->stats.liveCount++;
+            impl->stats.liveBytes += attach->bytes;
+            return attach;
+        }
+    }
+
     AttachmentImpl* attach = new AttachmentImpl();
     attach->width = config.width;
     attach->height = config.height;
     attach->format = config.format;
+    attach->generation = impl->nextGeneration++;
     attach->type = COLOR;
-    VkImageCreateInfo imageInfo {
+    attach->key = key;
+    attach->imageInfo = {
         .sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
         .imageType = VK_IMAGE_TYPE_2D,
         .extent = {config.width, config.height, 1},
         .format = config.format,
         .mipLevels = 1,
         .arrayLayers = 1,
-        .usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT |
-                (config.enableRead ? VK_IMAGE_USAGE_TRANSFER_SRC_BIT : VkImageUsageFlags {}) |
-                (config.enableUpload ? VK_IMAGE_USAGE_TRANSFER_DST_BIT : VkImageUsageFlags {}),
-        .samples = VK_SAMPLE_COUNT_1_BIT,
+        .usage = key.usage,
+        .samples = key.samples,
     };
     VmaAllocationCreateInfo allocInfo { .usage = VMA_MEMORY_USAGE_GPU_ONLY };
-    vmaCreateImage(impl->vma, &imageInfo, &allocInfo, &attach->image, &attach->mem, nullptr);
-    VkImageViewCreateInfo colorViewInfo {
+    VmaAllocationInfo memInfo;
+    vmaCreateImage(impl->vma, &attach->imageInfo, &allocInfo, &attach->image, &attach->mem,
+            &memInfo);
+    attach->bytes = memInfo.size;
+    trackAllocation(impl->vma, attach->mem, MEMORY_ATTACHMENT);
+    impl->stats.misses++;
+    impl->stats.liveCount++;
+    impl->stats.liveBytes += attach->bytes;
+    attach->viewInfo = {
         .sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
         .image = attach->image,
         .viewType = VK_IMAGE_VIEW_TYPE_2D,
@@ -125,7 +211,7 @@ LavaSurfCache::Attachment const* LavaSurfCache::createColorAttachment(
             .layerCount = 1
         }
     };
-    vkCreateImageView(impl->device, &colorViewInfo, VKALLOC, &attach->imageView);
+    vkCreateImageView(impl->device, &attach->viewInfo, VKALLOC, &attach->imageView);
     return attach;
 }
 
@@ -249,20 +335,99 @@ void LavaSurfCache::finalizeAttachment(Attachment const* attachment, VkCommandBu
 
 void LavaSurfCache::freeAttachment(Attachment const* attachment) const noexcept {
     auto impl = upcast(this);
-    auto attach = (AttachmentImpl const*) attachment;
-    vmaDestroyImage(impl->vma, attach->image, attach->mem);
-    vkDestroyImageView(impl->device, attach->imageView, VKALLOC);
+    auto attach = (AttachmentImpl*) attachment;
+    impl->stats.liveCount--;
+    impl->stats.liveBytes -= attach->bytes;
+    impl->stats.pooledCount++;
+    impl->stats.pooledBytes += attach->bytes;
+    impl->pool[attach->key].push_back({attach, impl->currentFrame, getCurrentTime()});
+
+    // Pooled attachments have undefined contents, so defragmentation is free to move them.
+    registerMovable(impl->vma, attach->mem, [impl, attach] {
+        return impl->relocateAttachment(attach);
+    });
+
+    // Evict every framebuffer that refers to this attachment. The framebuffers might be referenced
+    // by a command buffer that hasn't finished executing, so use the graveyard to defer their
+    // destruction.
+    auto& fbcache = impl->fbcache;
+    for (decltype(impl->fbcache)::const_iterator iter = fbcache.begin(); iter != fbcache.end();) {
+        const auto& key = iter->first;
+        if (key.color == attach->generation || key.depth == attach->generation) {
+            impl->graveyard.push_back({iter->second.handle, impl->currentFrame});
+            iter = fbcache.erase(iter);
+        } else {
+            ++iter;
+        }
+    }
+}
+
+// Re-creates the image and view of a pooled attachment after defragmentation has moved its memory.
+// No framebuffers refer to pooled attachments, since they are evicted when the attachment is freed.
+LavaContext::Relocation LavaSurfCacheImpl::relocateAttachment(AttachmentImpl* attach)
+        const noexcept {
+    LavaContext::Relocation reloc {
+        .oldImage = attach->image,
+        .oldView = attach->imageView
+    };
+    vkDestroyImageView(device, attach->imageView, VKALLOC);
+    vkDestroyImage(device, attach->image, VKALLOC);
+    vkCreateImage(device, &attach->imageInfo, VKALLOC, &attach->image);
+    VkMemoryRequirements requirements;
+    vkGetImageMemoryRequirements(device, attach->image, &requirements);
+    vmaBindImageMemory(vma, attach->mem, attach->image);
+    attach->viewInfo.image = attach->image;
+    vkCreateImageView(device, &attach->viewInfo, VKALLOC, &attach->imageView);
+    reloc.newImage = attach->image;
+    reloc.newView = attach->imageView;
+    return reloc;
+}
+
+void LavaSurfCacheImpl::destroyAttachment(AttachmentImpl const* attach) const noexcept {
+    unregisterMovable(vma, attach->mem);
+    untrackAllocation(vma, attach->mem);
+    vmaDestroyImage(vma, attach->image, attach->mem);
+    vkDestroyImageView(device, attach->imageView, VKALLOC);
     delete attach;
 }
 
+void LavaSurfCache::trimPool(uint64_t maxBytes) noexcept {
+    LavaSurfCacheImpl* impl = upcast(this);
+    while (impl->stats.pooledBytes > maxBytes) {
+        // Find the least-recently freed attachment that is no longer in flight.
+        vector<PoolVal>* oldest = nullptr;
+        for (auto& pair : impl->pool) {
+            auto& vals = pair.second;
+            if (vals.empty() || vals.front().frame + FRAMES_IN_FLIGHT > impl->currentFrame) {
+                continue;
+            }
+            if (!oldest || vals.front().timestamp < oldest->front().timestamp) {
+                oldest = &vals;
+            }
+        }
+        if (!oldest) {
+            break;
+        }
+        AttachmentImpl* attach = oldest->front().attachment;
+        oldest->erase(oldest->begin());
+        impl->stats.pooledCount--;
+        impl->stats.pooledBytes -= attach->bytes;
+        impl->destroyAttachment(attach);
+    }
+}
+
+LavaSurfCache::PoolStats LavaSurfCache::getPoolStats() const noexcept {
+    return upcast(this)->stats;
+}
+
 VkFramebuffer LavaSurfCache::getFramebuffer(const Params& params) noexcept {
     assert(params.color && !params.depth && "Not yet implemented.");
     const uint32_t width = params.color ? params.color->width : params.depth->width;
     const uint32_t height = params.color ? params.color->height : params.depth->height;
     auto impl = upcast(this);
     const FbCacheKey key {
-        .color = params.color,
-        .depth = params.depth,
+        .color = params.color ? params.color->generation : 0,
+        .depth = params.depth ? params.depth->generation : 0,
     };
     auto iter = impl->fbcache.find(key);
     if (iter != impl->fbcache.end()) {
@@ -368,12 +533,38 @@ VkRenderPass LavaSurfCache::getRenderPass(const Params& params, VkRenderPassBegi
 void LavaSurfCache::releaseUnused(uint64_t milliseconds) noexcept {
     LavaSurfCacheImpl* impl = upcast(this);
     const uint64_t expiration = getCurrentTime() - milliseconds;
+    const uint64_t currentFrame = ++impl->currentFrame;
+    for (auto& pair : impl->pool) {
+        // Each list is sorted by the time of release, so expired attachments are at the front.
+        auto& vals = pair.second;
+        auto first = vals.begin();
+        auto last = first;
+        while (last != vals.end() && last->timestamp < expiration &&
+                last->frame + FRAMES_IN_FLIGHT <= currentFrame) {
+            impl->stats.pooledCount--;
+            impl->stats.pooledBytes -= last->attachment->bytes;
+            impl->destroyAttachment(last->attachment);
+            ++last;
+        }
+        vals.erase(first, last);
+    }
+    if (impl->maxPooledBytes) {
+        trimPool(impl->maxPooledBytes);
+    }
+    decltype(impl->graveyard) graveyard;
+    graveyard.swap(impl->graveyard);
+    for (auto& grave : graveyard) {
+        if (grave.frame + FRAMES_IN_FLIGHT <= currentFrame) {
+            vkDestroyFramebuffer(impl->device, grave.handle, VKALLOC);
+        } else {
+            impl->graveyard.push_back(grave);
+        }
+    }
     auto& fbcache = impl->fbcache;
     using FbIter = decltype(impl->fbcache)::const_iterator;
     for (FbIter iter = fbcache.begin(); iter != fbcache.end();) {
         if (iter->second.timestamp < expiration) {
-            VkFramebuffer fb = iter->second.handle;
-            vkDestroyFramebuffer(impl->device, fb, VKALLOC);
+            impl->graveyard.push_back({iter->second.handle, currentFrame});
             iter = fbcache.erase(iter);
         } else {
             ++iter;
@@ -397,9 +588,7 @@ bool FbIsEqual::operator()(const FbCacheKey& a, const FbCacheKey& b) const {
 }
 
 uint64_t FbHashFn::operator()(const FbCacheKey& key) const {
-    uint64_t a = (uint64_t) key.color;
-    uint64_t b = (uint64_t) key.depth;
-    return a ^ b;
+    return murmurHash((uint32_t const*) &key, sizeof(key) / 4, 0u);
 }
 
 bool RpIsEqual::operator()(const RpCacheKey& a, const RpCacheKey& b) const {
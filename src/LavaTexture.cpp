@@ -4,153 +4,527 @@
 #include <par/LavaLoader.h>
 #include <par/LavaTexture.h>
 #include <par/LavaLog.h>
+#include <par/LavaTrace.h>
+
+#include <algorithm>
+#include <vector>
 
 #include "LavaInternal.h"
 
 using namespace par;
+using namespace std;
 
 struct LavaTextureImpl : LavaTexture {
     LavaTextureImpl(Config config) noexcept;
     ~LavaTextureImpl() noexcept;
     VkDevice device;
-    VmaAllocation stageMem;
+    VmaAllocation stageMem = VK_NULL_HANDLE;
     VmaAllocation imageMem;
     VmaAllocator vma;
     VkFormat format;
     VkExtent3D size;
-    VkBuffer stage;
+    VkBuffer stage = VK_NULL_HANDLE;
     VkImage image;
     VkImageView view;
+    Type type;
+    uint32_t levelCount;
+    uint32_t uploadedLevels;
+    uint32_t layerCount;
+    vector<VkBufferImageCopy> regions;
+    mutable bool initialized = false;
     void uploadStage(VkCommandBuffer cmd) const noexcept;
+    void uploadRegions(VkCommandBuffer cmd, Region const* regions, uint32_t count) const noexcept;
+    VkExtent3D getExtent(uint32_t level) const noexcept;
 };
 
 LAVA_DEFINE_UPCAST(LavaTexture)
 
+static VkImageSubresourceRange makeRange(uint32_t baseLevel, uint32_t levelCount,
+        uint32_t baseLayer = 0, uint32_t layerCount = VK_REMAINING_ARRAY_LAYERS) {
+    return VkImageSubresourceRange {
+        .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+        .baseMipLevel = baseLevel,
+        .levelCount = levelCount,
+        .baseArrayLayer = baseLayer,
+        .layerCount = layerCount,
+    };
+}
+
+static VkImageMemoryBarrier makeBarrier(VkImage image, VkImageSubresourceRange range,
+        VkImageLayout oldLayout, VkImageLayout newLayout, VkAccessFlags srcAccess,
+        VkAccessFlags dstAccess) {
+    return VkImageMemoryBarrier {
+        .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+        .image = image,
+        .oldLayout = oldLayout,
+        .newLayout = newLayout,
+        .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .subresourceRange = range,
+        .srcAccessMask = srcAccess,
+        .dstAccessMask = dstAccess
+    };
+}
+
 LavaTexture* LavaTexture::create(Config config) noexcept {
     return new LavaTextureImpl(config);
 }
 
+LavaTexture* LavaTexture::createFromKtx(KtxConfig config) noexcept {
+    KtxInfo ktx;
+    if (!parseKtx(config.data, config.size, &ktx)) {
+        return nullptr;
+    }
+
+    // Check if the stored format can be sampled, otherwise fall back to a CPU decoder.
+    VkFormat format = ktx.format;
+    VkFormatProperties props;
+    vkGetPhysicalDeviceFormatProperties(config.gpu, format, &props);
+    if (!(props.optimalTilingFeatures & VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT)) {
+        format = getTranscodeFormat(ktx.format);
+        if (format == VK_FORMAT_UNDEFINED) {
+            llog.error("Format {} is not supported by the device.", ktx.format);
+            return nullptr;
+        }
+        llog.warn("Format {} is not supported by the device, transcoding.", ktx.format);
+    }
+
+    Type type = ktx.layerCount > 1 ? TEXTURE_2D_ARRAY : TEXTURE_2D;
+    if (ktx.faceCount == 6) {
+        type = ktx.layerCount > 1 ? TEXTURE_CUBE_ARRAY : TEXTURE_CUBE;
+    } else if (ktx.depth > 1) {
+        type = TEXTURE_3D;
+    }
+    const uint32_t layerCount = ktx.layerCount * ktx.faceCount;
+    VkDeviceSize stageSize = 0;
+    for (uint32_t level = 0; level < ktx.levelCount; level++) {
+        const uint32_t width = std::max(ktx.width >> level, 1u);
+        const uint32_t height = std::max(ktx.height >> level, 1u);
+        const uint32_t depth = std::max(ktx.depth >> level, 1u);
+        stageSize += getImageSize(format, width, height) * depth * layerCount;
+    }
+    if (stageSize > UINT32_MAX) {
+        llog.error("KTX image data ({} bytes) exceeds the staging limit.", stageSize);
+        return nullptr;
+    }
+    auto impl = new LavaTextureImpl({
+        .device = config.device,
+        .gpu = config.gpu,
+        .size = (uint32_t) stageSize,
+        .width = ktx.width,
+        .height = ktx.height,
+        .format = format,
+        .mipLevels = ktx.levelCount,
+        .arrayLayers = layerCount,
+        .type = type,
+        .depth = ktx.depth,
+    });
+
+    // Write each image directly into the staging area, repacking rows or decoding blocks if needed.
+    uint8_t* dest;
+    vmaMapMemory(impl->vma, impl->stageMem, (void**) &dest);
+    for (uint32_t level = 0; level < ktx.levelCount; level++) {
+        const KtxInfo::Level& src = ktx.levels[level];
+        const uint32_t width = std::max(ktx.width >> level, 1u);
+        const uint32_t height = std::max(ktx.height >> level, 1u);
+        const uint32_t depth = std::max(ktx.depth >> level, 1u);
+        const VkDeviceSize sliceSize = getImageSize(format, width, height);
+        const VkDeviceSize srcSliceSize = src.imageStride / depth;
+        const uint32_t rowSize = width * getFormatBlock(format).bytes;
+        for (uint32_t image = 0; image < layerCount; image++) {
+            uint8_t const* source = src.data + src.imageStride * image;
+            if (format != ktx.format) {
+                for (uint32_t slice = 0; slice < depth; slice++, dest += sliceSize) {
+                    transcodeImage(ktx.format, source + slice * srcSliceSize, width, height, dest);
+                }
+            } else if (src.rowPitch && src.rowPitch != rowSize) {
+                for (uint32_t row = 0; row < height * depth; row++, dest += rowSize) {
+                    memcpy(dest, source + row * src.rowPitch, rowSize);
+                }
+            } else {
+                memcpy(dest, source, sliceSize * depth);
+                dest += sliceSize * depth;
+            }
+        }
+    }
+    vmaUnmapMemory(impl->vma, impl->stageMem);
+    return impl;
+}
+
 void LavaTexture::operator delete(void* ptr) noexcept {
     auto impl = (LavaTextureImpl*) ptr;
     ::delete impl;
 }
 
 LavaTextureImpl::~LavaTextureImpl() noexcept {
-    vmaDestroyBuffer(vma, stage, stageMem);
+    untrackAllocation(vma, stageMem);
+    untrackAllocation(vma, imageMem);
+    if (stage) {
+        vmaDestroyBuffer(vma, stage, stageMem);
+    }
     vmaDestroyImage(vma, image, imageMem);
     vkDestroyImageView(device, view, VKALLOC);
 }
 
 LavaTextureImpl::LavaTextureImpl(Config config) noexcept : device(config.device) {
-    assert(config.device && config.gpu && config.size > 0);
+    assert(config.device && config.gpu);
     format = config.format;
+    type = config.type;
     size = { config.width, config.height, 1 };
+    layerCount = std::max(config.arrayLayers, 1u);
     vma = getVma(config.device, config.gpu);
-    VkBufferCreateInfo bufferInfo {
-        .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
-        .size = config.size,
-        .usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT
-    };
+
+    VkImageType imageType = VK_IMAGE_TYPE_2D;
+    VkImageViewType viewType = layerCount > 1 ? VK_IMAGE_VIEW_TYPE_2D_ARRAY : VK_IMAGE_VIEW_TYPE_2D;
+    VkImageCreateFlags imageFlags = 0;
+    switch (type) {
+        case TEXTURE_2D:
+            break;
+        case TEXTURE_2D_ARRAY:
+            viewType = VK_IMAGE_VIEW_TYPE_2D_ARRAY;
+            break;
+        case TEXTURE_CUBE:
+        case TEXTURE_CUBE_ARRAY:
+            layerCount = std::max(layerCount, 6u);
+            LOG_CHECK(layerCount % 6 == 0, "Cubemaps require six layers per cube.");
+            LOG_CHECK(type == TEXTURE_CUBE_ARRAY || layerCount == 6, "Use a cube array instead.");
+            LOG_CHECK(config.width == config.height, "Cubemap faces must be square.");
+            viewType = type == TEXTURE_CUBE ? VK_IMAGE_VIEW_TYPE_CUBE :
+                    VK_IMAGE_VIEW_TYPE_CUBE_ARRAY;
+            imageFlags = VK_IMAGE_CREATE_CUBE_COMPATIBLE_BIT;
+            break;
+        case TEXTURE_3D:
+            LOG_CHECK(layerCount == 1, "3D textures cannot have array layers.");
+            size.depth = std::max(config.depth, 1u);
+            imageType = VK_IMAGE_TYPE_3D;
+            viewType = VK_IMAGE_VIEW_TYPE_3D;
+            break;
+    }
+
+    // Determine how many levels are provided by the client and how many should be generated.
+    const uint32_t fullChain = getMipCount(size.width, size.height, size.depth);
+    uploadedLevels = config.mipLevels ? std::min(config.mipLevels, fullChain) : 1;
+    levelCount = config.generateMipmaps ? fullChain : uploadedLevels;
+    if (levelCount > uploadedLevels) {
+        constexpr VkFormatFeatureFlags required = VK_FORMAT_FEATURE_BLIT_SRC_BIT |
+                VK_FORMAT_FEATURE_BLIT_DST_BIT | VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT;
+        VkFormatProperties props;
+        vkGetPhysicalDeviceFormatProperties(config.gpu, format, &props);
+        if ((props.optimalTilingFeatures & required) != required) {
+            llog.warn("Format {} does not support linear blits, skipping mipmap generation.",
+                    format);
+            levelCount = uploadedLevels;
+        }
+    }
+
+    // Compute the location of each provided level within the staging buffer. Each level contains
+    // all of its layers, and each layer contains all of its slices.
+    const bool packed = uploadedLevels > 1 || layerCount > 1 || size.depth > 1;
+    LOG_CHECK(!packed || getFormatBlock(format).bytes > 0, "Unknown format for packed upload.");
+    VkDeviceSize offset = 0;
+    for (uint32_t level = 0; level < uploadedLevels; level++) {
+        const VkExtent3D extent = getExtent(level);
+        regions.push_back({
+            .bufferOffset = offset,
+            .imageSubresource = {
+                .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+                .mipLevel = level,
+                .layerCount = layerCount,
+            },
+            .imageExtent = extent
+        });
+        offset += getImageSize(format, extent.width, extent.height) * extent.depth * layerCount;
+    }
+    LOG_CHECK(!packed || offset <= config.size, "Mip chain exceeds the source size.");
+
+    // The staging area is optional for textures that are populated with uploadRegions.
+    if (config.size > 0) {
+        VkBufferCreateInfo bufferInfo {
+            .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+            .size = config.size,
+            .usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT
+        };
+        VmaAllocationCreateInfo stageInfo { .usage = VMA_MEMORY_USAGE_CPU_TO_GPU };
+        vmaCreateBuffer(vma, &bufferInfo, &stageInfo, &stage, &stageMem, nullptr);
+        trackAllocation(vma, stageMem, MEMORY_STAGING);
+        if (config.source) {
+            void* mappedData;
+            vmaMapMemory(vma, stageMem, &mappedData);
+            memcpy(mappedData, config.source, config.size);
+            vmaUnmapMemory(vma, stageMem);
+        }
+    }
+
     VkImageCreateInfo imageInfo {
         .sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
-        .imageType = VK_IMAGE_TYPE_2D,
+        .flags = imageFlags,
+        .imageType = imageType,
         .extent = size,
         .format = format,
-        .mipLevels = 1,
-        .arrayLayers = 1,
-        .usage = VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT,
+        .mipLevels = levelCount,
+        .arrayLayers = layerCount,
+        .usage = VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT |
+                (levelCount > uploadedLevels ? VK_IMAGE_USAGE_TRANSFER_SRC_BIT : 0),
         .samples = VK_SAMPLE_COUNT_1_BIT,
     };
-    VmaAllocationCreateInfo stageInfo { .usage = VMA_MEMORY_USAGE_CPU_TO_GPU };
-    vmaCreateBuffer(vma, &bufferInfo, &stageInfo, &stage, &stageMem, nullptr);
-    if (config.source) {
-        void* mappedData;
-        vmaMapMemory(vma, stageMem, &mappedData);
-        memcpy(mappedData, config.source, config.size);
-        vmaUnmapMemory(vma, stageMem);
-    }
     VmaAllocationCreateInfo allocInfo { .usage = VMA_MEMORY_USAGE_GPU_ONLY };
     vmaCreateImage(vma, &imageInfo, &allocInfo, &image, &imageMem, nullptr);
+    trackAllocation(vma, imageMem, MEMORY_TEXTURE);
 
     VkImageViewCreateInfo colorViewInfo {
         .sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
         .image = image,
-        .viewType = VK_IMAGE_VIEW_TYPE_2D,
+        .viewType = viewType,
         .format = format,
         .subresourceRange = {
             .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
-            .levelCount = 1,
-            .layerCount = 1
+            .levelCount = levelCount,
+            .layerCount = layerCount
         }
     };
     vkCreateImageView(config.device, &colorViewInfo, VKALLOC, &view);
 }
 
+VkExtent3D LavaTextureImpl::getExtent(uint32_t level) const noexcept {
+    return {
+        std::max(size.width >> level, 1u),
+        std::max(size.height >> level, 1u),
+        std::max(size.depth >> level, 1u)
+    };
+}
+
 void LavaTextureImpl::uploadStage(VkCommandBuffer cmd) const noexcept {
-    const int miplevel = 0;
-    VkImageMemoryBarrier barrier1 {
-        .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
-        .image = image,
-        .oldLayout = VK_IMAGE_LAYOUT_UNDEFINED,
-        .newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-        .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
-        .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
-        .subresourceRange = {
-            .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
-            .baseMipLevel = miplevel,
-            .levelCount = 1,
-            .layerCount = 1,
-        },
-        .srcAccessMask = 0,
-        .dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT
+    assert(stage && "The staging area has been freed or was never created.");
+
+    // Copy all provided levels with a single command.
+    VkImageMemoryBarrier barrier = makeBarrier(image, makeRange(0, levelCount),
+            VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 0,
+            VK_ACCESS_TRANSFER_WRITE_BIT);
+    vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+            VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 1, &barrier);
+    vkCmdCopyBufferToImage(cmd, stage, image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+            (uint32_t) regions.size(), regions.data());
+
+    // Generate the remaining levels by successively downsampling with linear filtering.
+    for (uint32_t level = uploadedLevels; level < levelCount; level++) {
+        barrier = makeBarrier(image, makeRange(level - 1, 1),
+                VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_TRANSFER_READ_BIT);
+        vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 1, &barrier);
+        const VkExtent3D src = getExtent(level - 1);
+        const VkExtent3D dst = getExtent(level);
+        const VkImageBlit blit {
+            .srcSubresource = {
+                .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+                .mipLevel = level - 1,
+                .layerCount = layerCount,
+            },
+            .srcOffsets = {{0, 0, 0},
+                    {(int32_t) src.width, (int32_t) src.height, (int32_t) src.depth}},
+            .dstSubresource = {
+                .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+                .mipLevel = level,
+                .layerCount = layerCount,
+            },
+            .dstOffsets = {{0, 0, 0},
+                    {(int32_t) dst.width, (int32_t) dst.height, (int32_t) dst.depth}},
+        };
+        vkCmdBlitImage(cmd, image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, image,
+                VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &blit, VK_FILTER_LINEAR);
+    }
+
+    // Transition every level to the shader-readable layout. When levels were generated, the ones
+    // that were blitted from (the last uploaded level and every generated level but the last) are
+    // in TRANSFER_SRC, while the other uploaded levels and the last level are still in TRANSFER_DST.
+    VkImageMemoryBarrier barriers[3];
+    uint32_t nbarriers = 0;
+    auto transition = [&](uint32_t baseLevel, uint32_t count, VkImageLayout layout) {
+        const bool src = layout == VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+        barriers[nbarriers++] = makeBarrier(image, makeRange(baseLevel, count), layout,
+                VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+                src ? VK_ACCESS_TRANSFER_READ_BIT : VK_ACCESS_TRANSFER_WRITE_BIT,
+                VK_ACCESS_SHADER_READ_BIT);
     };
-    VkBufferImageCopy upload {
-        .imageSubresource = {
-            .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
-            .mipLevel = miplevel,
-            .layerCount = 1,
-        },
-        .imageExtent = {
-            .width = size.width >> miplevel,
-            .height = size.height >> miplevel,
-            .depth = 1,
+    if (levelCount > uploadedLevels) {
+        if (uploadedLevels > 1) {
+            transition(0, uploadedLevels - 1, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
         }
-    };
-    VkImageMemoryBarrier barrier2 {
-        .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
-        .image = image,
-        .oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-        .newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
-        .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
-        .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
-        .subresourceRange = {
-            .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
-            .baseMipLevel = miplevel,
-            .levelCount = 1,
-            .layerCount = 1,
-        },
-        .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
-        .dstAccessMask = VK_ACCESS_SHADER_READ_BIT
-    };
-    vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
-            VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 1, &barrier1);
-    vkCmdCopyBufferToImage(cmd, stage, image,
-            VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &upload);
+        transition(uploadedLevels - 1, levelCount - uploadedLevels,
+                VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL);
+        transition(levelCount - 1, 1, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
+    } else {
+        transition(0, levelCount, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
+    }
     vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT,
-            VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0, 0, nullptr, 0, nullptr, 1, &barrier2);
+            VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0, 0, nullptr, 0, nullptr, nbarriers, barriers);
+    initialized = true;
+}
+
+void LavaTextureImpl::uploadRegions(VkCommandBuffer cmd, Region const* regions,
+        uint32_t count) const noexcept {
+    // Gather the layers touched at each level so that every subresource is transitioned once.
+    vector<VkImageSubresourceRange> ranges;
+    vector<VkBufferImageCopy> copies;
+    copies.reserve(count);
+    for (uint32_t i = 0; i < count; i++) {
+        const Region& region = regions[i];
+        assert(region.mipLevel < levelCount);
+        const uint32_t layers = region.layerCount ? region.layerCount : 1;
+        VkExtent3D extent = region.extent;
+        if (extent.width == 0) {
+            const VkExtent3D level = getExtent(region.mipLevel);
+            extent = {
+                level.width - region.offset.x,
+                level.height - region.offset.y,
+                level.depth - region.offset.z
+            };
+        }
+        auto match = [&region](const VkImageSubresourceRange& range) {
+            return range.baseMipLevel == region.mipLevel;
+        };
+        auto iter = std::find_if(ranges.begin(), ranges.end(), match);
+        if (iter == ranges.end()) {
+            ranges.push_back(makeRange(region.mipLevel, 1, region.baseArrayLayer, layers));
+        } else {
+            const uint32_t end = std::max(iter->baseArrayLayer + iter->layerCount,
+                    region.baseArrayLayer + layers);
+            iter->baseArrayLayer = std::min(iter->baseArrayLayer, region.baseArrayLayer);
+            iter->layerCount = end - iter->baseArrayLayer;
+        }
+        copies.push_back({
+            .bufferOffset = region.bufferOffset,
+            .imageSubresource = {
+                .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+                .mipLevel = region.mipLevel,
+                .baseArrayLayer = region.baseArrayLayer,
+                .layerCount = layers,
+            },
+            .imageOffset = region.offset,
+            .imageExtent = extent
+        });
+    }
+
+    // Before the first upload, the entire image is transitioned from the undefined layout.
+    if (!initialized) {
+        ranges = { makeRange(0, levelCount) };
+    }
+    const VkImageLayout oldLayout = initialized ? VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL :
+            VK_IMAGE_LAYOUT_UNDEFINED;
+    const VkPipelineStageFlags srcStage = initialized ? VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT :
+            VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
+
+    vector<VkImageMemoryBarrier> barriers;
+    for (const auto& range : ranges) {
+        barriers.push_back(makeBarrier(image, range, oldLayout,
+                VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 0, VK_ACCESS_TRANSFER_WRITE_BIT));
+    }
+    vkCmdPipelineBarrier(cmd, srcStage, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0,
+            nullptr, (uint32_t) barriers.size(), barriers.data());
+
+    // Regions that share a source buffer are copied with a single command.
+    for (uint32_t i = 0; i < count;) {
+        uint32_t n = 1;
+        while (i + n < count && regions[i + n].buffer == regions[i].buffer) {
+            n++;
+        }
+        vkCmdCopyBufferToImage(cmd, regions[i].buffer, image,
+                VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, n, copies.data() + i);
+        i += n;
+    }
+
+    for (auto& barrier : barriers) {
+        barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+        barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+        barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+    }
+    vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT,
+            VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0, 0, nullptr, 0, nullptr,
+            (uint32_t) barriers.size(), barriers.data());
+    initialized = true;
 }
 
 VkImageView LavaTexture::getImageView() const noexcept {
     return upcast(this)->view;
 }
 
+VkImage LavaTexture::getImage() const noexcept {
+    return upcast(this)->image;
+}
+
+uint32_t LavaTexture::getMipLevels() const noexcept {
+    return upcast(this)->levelCount;
+}
+
+uint32_t LavaTexture::getArrayLayers() const noexcept {
+    return upcast(this)->layerCount;
+}
+
+VkFormat LavaTexture::getFormat() const noexcept {
+    return upcast(this)->format;
+}
+
+LavaTexture::Type LavaTexture::getType() const noexcept {
+    return upcast(this)->type;
+}
+
+VkExtent3D LavaTexture::getExtent(uint32_t mipLevel) const noexcept {
+    return upcast(this)->getExtent(mipLevel);
+}
+
+VkSamplerCreateInfo LavaTexture::getSamplerInfo() const noexcept {
+    return VkSamplerCreateInfo {
+        .sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO,
+        .magFilter = VK_FILTER_LINEAR,
+        .minFilter = VK_FILTER_LINEAR,
+        .mipmapMode = VK_SAMPLER_MIPMAP_MODE_LINEAR,
+        .addressModeU = VK_SAMPLER_ADDRESS_MODE_REPEAT,
+        .addressModeV = VK_SAMPLER_ADDRESS_MODE_REPEAT,
+        .addressModeW = VK_SAMPLER_ADDRESS_MODE_REPEAT,
+        .maxAnisotropy = 1.0f,
+        .minLod = 0.0f,
+        .maxLod = (float) upcast(this)->levelCount,
+    };
+}
+
+uint32_t LavaTexture::getMipCount(uint32_t width, uint32_t height, uint32_t depth) noexcept {
+    uint32_t levels = 1;
+    for (uint32_t dim = std::max(std::max(width, height), depth); dim > 1; dim >>= 1) {
+        levels++;
+    }
+    return levels;
+}
+
 void LavaTexture::freeStage() noexcept {
     LavaTextureImpl& impl = *upcast(this);
-    vmaDestroyBuffer(impl.vma, impl.stage, impl.stageMem);
+    untrackAllocation(impl.vma, impl.stageMem);
+    if (impl.stage) {
+        vmaDestroyBuffer(impl.vma, impl.stage, impl.stageMem);
+    }
     impl.stage = 0;
     impl.stageMem = 0;
 }
 
+void* LavaTexture::mapStage() noexcept {
+    LavaTextureImpl& impl = *upcast(this);
+    assert(impl.stage && "The staging area has been freed or was never created.");
+    void* mappedData;
+    vmaMapMemory(impl.vma, impl.stageMem, &mappedData);
+    return mappedData;
+}
+
+void LavaTexture::unmapStage() noexcept {
+    LavaTextureImpl& impl = *upcast(this);
+    vmaUnmapMemory(impl.vma, impl.stageMem);
+}
+
 void LavaTexture::uploadStage(VkCommandBuffer cmd) const noexcept {
+    LAVA_TRACE_SCOPE("LavaTexture::uploadStage");
     upcast(this)->uploadStage(cmd);
 }
+
+void LavaTexture::uploadRegions(VkCommandBuffer cmd, Region const* regions,
+        uint32_t count) const noexcept {
+    upcast(this)->uploadRegions(cmd, regions, count);
+}
@@ -0,0 +1,529 @@
+// The MIT License
+// Copyright (c) 2018 Philip Rideout
+
+#include <par/LavaLoader.h>
+#include <par/LavaTextureStreamer.h>
+#include <par/LavaLog.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "LavaInternal.h"
+
+using namespace par;
+using namespace std;
+
+namespace {
+
+constexpr uint32_t DEFAULT_UPLOAD_BUDGET = 4u << 20;
+constexpr uint64_t DEFAULT_MEMORY_BUDGET = 256ull << 20;
+constexpr uint32_t DEFAULT_TAIL_SIZE = 64;
+constexpr uint32_t MAX_PENDING_LOADS = 4;
+
+// Textures that have not been marked as used for this many frames are candidates for eviction, and
+// no longer stream in finer levels.
+constexpr uint64_t STALE_FRAMES = 60;
+
+using LoadFn = LavaTextureStreamer::LoadFn;
+
+struct Staging {
+    VkBuffer buffer = VK_NULL_HANDLE;
+    VmaAllocation memory = VK_NULL_HANDLE;
+};
+
+struct Texture {
+    LavaTextureStreamer::Source source;
+    VkImage image = VK_NULL_HANDLE;
+    VmaAllocation memory = VK_NULL_HANDLE;
+    VkImageView view = VK_NULL_HANDLE;
+    uint32_t tailLevel;     // Finest level of the tail, which is never evicted.
+    uint32_t baseLevel;     // Finest resident level, or mipLevels if nothing is resident.
+    uint64_t lastUsed;
+    bool loading = false;
+    Staging tail;           // Holds the tail until the first update.
+};
+
+struct LoadRequest {
+    uint32_t id;
+    uint32_t level;
+    uint32_t size;
+    LoadFn load;
+};
+
+struct LoadResult {
+    uint32_t id;
+    uint32_t level;
+    uint32_t size;
+    Staging staging;
+};
+
+struct Retired {
+    VkImage image;
+    VmaAllocation memory;
+    VkImageView view;
+    Staging staging;
+    uint64_t frame;
+};
+
+struct LavaTextureStreamerImpl : LavaTextureStreamer {
+    LavaTextureStreamerImpl(Config config) noexcept;
+    ~LavaTextureStreamerImpl() noexcept;
+    Staging createStaging(uint32_t size, uint8_t** mapped) noexcept;
+    void resize(VkCommandBuffer cmd, Texture& tex, uint32_t newBase, Staging staging,
+            uint32_t stagedLevels) noexcept;
+    bool evictOne(VkCommandBuffer cmd, Texture const* exclude) noexcept;
+    void retire(VkImage image, VmaAllocation memory, VkImageView view, Staging staging) noexcept;
+    void runWorker() noexcept;
+    VkDevice device;
+    VmaAllocator vma;
+    uint32_t uploadBudget;
+    uint64_t memoryBudget;
+    uint32_t tailSize;
+    unordered_map<uint32_t, Texture> textures;
+    uint32_t nextId = 1;
+    uint64_t frame = 0;
+    vector<Retired> graveyard;
+    deque<LoadResult> ready;
+    uint64_t residentBytes = 0;
+    uint64_t pendingBytes = 0;
+    uint64_t uploadedBytes = 0;
+    uint32_t pendingLoads = 0;
+    uint32_t evictions = 0;
+
+    // Shared with the worker thread.
+    thread worker;
+    mutex queueMutex;
+    condition_variable queueCondition;
+    deque<LoadRequest> requests;
+    vector<LoadResult> results;
+    bool quitting = false;
+};
+
+LAVA_DEFINE_UPCAST(LavaTextureStreamer)
+
+VkExtent3D getLevelExtent(const LavaTextureStreamer::Source& source, uint32_t level) {
+    return {std::max(source.width >> level, 1u), std::max(source.height >> level, 1u), 1};
+}
+
+uint32_t getLevelSize(const LavaTextureStreamer::Source& source, uint32_t level) {
+    const VkExtent3D extent = getLevelExtent(source, level);
+    return (uint32_t) getImageSize(source.format, extent.width, extent.height);
+}
+
+uint64_t getResidentSize(const Texture& tex) {
+    uint64_t size = 0;
+    for (uint32_t level = tex.baseLevel; level < tex.source.mipLevels; level++) {
+        size += getLevelSize(tex.source, level);
+    }
+    return size;
+}
+
+} // anonymous namespace
+
+LavaTextureStreamer* LavaTextureStreamer::create(Config config) noexcept {
+    return new LavaTextureStreamerImpl(config);
+}
+
+void LavaTextureStreamer::operator delete(void* ptr) {
+    auto impl = (LavaTextureStreamerImpl*) ptr;
+    ::delete impl;
+}
+
+LavaTextureStreamerImpl::LavaTextureStreamerImpl(Config config) noexcept :
+        device(config.device) {
+    assert(config.device && config.gpu);
+    vma = getVma(config.device, config.gpu);
+    uploadBudget = config.uploadBudget ? config.uploadBudget : DEFAULT_UPLOAD_BUDGET;
+    memoryBudget = config.memoryBudget ? config.memoryBudget : DEFAULT_MEMORY_BUDGET;
+    tailSize = config.tailSize ? config.tailSize : DEFAULT_TAIL_SIZE;
+    worker = thread([this] { runWorker(); });
+}
+
+LavaTextureStreamerImpl::~LavaTextureStreamerImpl() noexcept {
+    {
+        lock_guard<mutex> lock(queueMutex);
+        quitting = true;
+        queueCondition.notify_one();
+    }
+    worker.join();
+    for (auto& result : results) {
+        ready.push_back(result);
+    }
+    for (auto& result : ready) {
+        retire(VK_NULL_HANDLE, VK_NULL_HANDLE, VK_NULL_HANDLE, result.staging);
+    }
+    for (auto& pair : textures) {
+        Texture& tex = pair.second;
+        retire(tex.image, tex.memory, tex.view, tex.tail);
+    }
+    for (auto& retired : graveyard) {
+        if (retired.staging.buffer) {
+            untrackAllocation(vma, retired.staging.memory);
+            vmaDestroyBuffer(vma, retired.staging.buffer, retired.staging.memory);
+        }
+        if (retired.image) {
+            vkDestroyImageView(device, retired.view, VKALLOC);
+            untrackAllocation(vma, retired.memory);
+            vmaDestroyImage(vma, retired.image, retired.memory);
+        }
+    }
+}
+
+Staging LavaTextureStreamerImpl::createStaging(uint32_t size, uint8_t** mapped) noexcept {
+    Staging staging;
+    VkBufferCreateInfo bufferInfo {
+        .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+        .size = size,
+        .usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT
+    };
+    VmaAllocationCreateInfo allocInfo {
+        .flags = VMA_ALLOCATION_CREATE_MAPPED_BIT,
+        .usage = VMA_MEMORY_USAGE_CPU_ONLY
+    };
+    VmaAllocationInfo info;
+    vmaCreateBuffer(vma, &bufferInfo, &allocInfo, &staging.buffer, &staging.memory, &info);
+    trackAllocation(vma, staging.memory, MEMORY_STAGING);
+    *mapped = (uint8_t*) info.pMappedData;
+    return staging;
+}
+
+void LavaTextureStreamerImpl::retire(VkImage image, VmaAllocation memory, VkImageView view,
+        Staging staging) noexcept {
+    if (image || staging.buffer) {
+        graveyard.push_back({image, memory, view, staging, frame});
+    }
+}
+
+void LavaTextureStreamerImpl::runWorker() noexcept {
+    while (true) {
+        LoadRequest request;
+        {
+            unique_lock<mutex> lock(queueMutex);
+            queueCondition.wait(lock, [this] { return quitting || !requests.empty(); });
+            if (quitting) {
+                return;
+            }
+            request = move(requests.front());
+            requests.pop_front();
+        }
+        uint8_t* mapped;
+        LoadResult result { request.id, request.level, request.size };
+        result.staging = createStaging(request.size, &mapped);
+        request.load(request.level, mapped, request.size);
+        flushAllocation(device, vma, result.staging.memory, 0, VK_WHOLE_SIZE);
+        lock_guard<mutex> lock(queueMutex);
+        results.push_back(result);
+    }
+}
+
+uint32_t LavaTextureStreamer::addTexture(const Source& source) noexcept {
+    LavaTextureStreamerImpl& impl = *upcast(this);
+    assert(source.mipLevels > 0 && source.load);
+    const uint32_t id = impl.nextId++;
+    Texture& tex = impl.textures[id];
+    tex.source = source;
+    tex.baseLevel = source.mipLevels;
+    tex.lastUsed = impl.frame;
+    tex.tailLevel = source.mipLevels - 1;
+    while (tex.tailLevel > 0) {
+        const VkExtent3D extent = getLevelExtent(source, tex.tailLevel - 1);
+        if (std::max(extent.width, extent.height) > impl.tailSize) {
+            break;
+        }
+        tex.tailLevel--;
+    }
+
+    // Load the tail into a single staging buffer, level after level.
+    uint32_t tailBytes = 0;
+    for (uint32_t level = tex.tailLevel; level < source.mipLevels; level++) {
+        tailBytes += getLevelSize(source, level);
+    }
+    uint8_t* mapped;
+    tex.tail = impl.createStaging(tailBytes, &mapped);
+    for (uint32_t level = tex.tailLevel; level < source.mipLevels; level++) {
+        const uint32_t size = getLevelSize(source, level);
+        source.load(level, mapped, size);
+        mapped += size;
+    }
+    flushAllocation(impl.device, impl.vma, tex.tail.memory, 0, VK_WHOLE_SIZE);
+    return id;
+}
+
+void LavaTextureStreamer::removeTexture(uint32_t id) noexcept {
+    LavaTextureStreamerImpl& impl = *upcast(this);
+    auto iter = impl.textures.find(id);
+    if (iter == impl.textures.end()) {
+        return;
+    }
+    Texture& tex = iter->second;
+    impl.retire(tex.image, tex.memory, tex.view, tex.tail);
+    impl.residentBytes -= tex.image ? getResidentSize(tex) : 0;
+    impl.textures.erase(iter);
+}
+
+void LavaTextureStreamer::markUsed(uint32_t id) noexcept {
+    LavaTextureStreamerImpl& impl = *upcast(this);
+    auto iter = impl.textures.find(id);
+    if (iter != impl.textures.end()) {
+        iter->second.lastUsed = impl.frame;
+    }
+}
+
+// Replaces the texture's image with one whose finest level is newBase. The first stagedLevels
+// levels come from the staging buffer and the remainder are copied from the old image.
+void LavaTextureStreamerImpl::resize(VkCommandBuffer cmd, Texture& tex, uint32_t newBase,
+        Staging staging, uint32_t stagedLevels) noexcept {
+    const Source& source = tex.source;
+    const uint32_t oldBase = tex.baseLevel;
+    const uint64_t oldSize = tex.image ? getResidentSize(tex) : 0;
+    VkImageCreateInfo imageInfo {
+        .sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
+        .imageType = VK_IMAGE_TYPE_2D,
+        .extent = getLevelExtent(source, newBase),
+        .format = source.format,
+        .mipLevels = source.mipLevels - newBase,
+        .arrayLayers = 1,
+        .usage = VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT |
+                VK_IMAGE_USAGE_TRANSFER_SRC_BIT,
+        .samples = VK_SAMPLE_COUNT_1_BIT,
+    };
+    VmaAllocationCreateInfo allocInfo { .usage = VMA_MEMORY_USAGE_GPU_ONLY };
+    VkImage image;
+    VmaAllocation memory;
+    vmaCreateImage(vma, &imageInfo, &allocInfo, &image, &memory, nullptr);
+    trackAllocation(vma, memory, MEMORY_TEXTURE);
+
+    VkImageMemoryBarrier barriers[2] = {{
+        .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+        .image = image,
+        .oldLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+        .newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+        .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .subresourceRange = {
+            .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+            .levelCount = VK_REMAINING_MIP_LEVELS,
+            .layerCount = 1,
+        },
+        .dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT
+    }};
+    barriers[1] = barriers[0];
+    barriers[1].image = tex.image;
+    barriers[1].oldLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+    barriers[1].newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+    barriers[1].dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+    vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT |
+            VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0,
+            nullptr, 0, nullptr, tex.image ? 2 : 1, barriers);
+
+    if (stagedLevels > 0) {
+        vector<VkBufferImageCopy> regions;
+        VkDeviceSize offset = 0;
+        for (uint32_t i = 0; i < stagedLevels; i++) {
+            regions.push_back({
+                .bufferOffset = offset,
+                .imageSubresource = {
+                    .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+                    .mipLevel = i,
+                    .layerCount = 1,
+                },
+                .imageExtent = getLevelExtent(source, newBase + i)
+            });
+            offset += getLevelSize(source, newBase + i);
+        }
+        vkCmdCopyBufferToImage(cmd, staging.buffer, image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                (uint32_t) regions.size(), regions.data());
+    }
+
+    vector<VkImageCopy> copies;
+    for (uint32_t level = newBase + stagedLevels; level < source.mipLevels; level++) {
+        assert(tex.image && level >= oldBase);
+        copies.push_back({
+            .srcSubresource = {
+                .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+                .mipLevel = level - oldBase,
+                .layerCount = 1,
+            },
+            .dstSubresource = {
+                .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+                .mipLevel = level - newBase,
+                .layerCount = 1,
+            },
+            .extent = getLevelExtent(source, level)
+        });
+    }
+    if (!copies.empty()) {
+        vkCmdCopyImage(cmd, tex.image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, image,
+                VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, (uint32_t) copies.size(), copies.data());
+    }
+
+    barriers[0].oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    barriers[0].newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+    barriers[0].srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barriers[0].dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+    vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT,
+            VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0, 0, nullptr, 0, nullptr, 1, barriers);
+
+    retire(tex.image, tex.memory, tex.view, staging);
+    VkImageViewCreateInfo viewInfo {
+        .sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
+        .image = image,
+        .viewType = VK_IMAGE_VIEW_TYPE_2D,
+        .format = source.format,
+        .subresourceRange = {
+            .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+            .levelCount = source.mipLevels - newBase,
+            .layerCount = 1
+        }
+    };
+    vkCreateImageView(device, &viewInfo, VKALLOC, &tex.view);
+    tex.image = image;
+    tex.memory = memory;
+    tex.baseLevel = newBase;
+    residentBytes += getResidentSize(tex) - oldSize;
+}
+
+// Drops the finest level of the least recently used texture that has gone stale. Returns false if
+// no texture can be evicted.
+bool LavaTextureStreamerImpl::evictOne(VkCommandBuffer cmd, Texture const* exclude) noexcept {
+    Texture* victim = nullptr;
+    for (auto& pair : textures) {
+        Texture& tex = pair.second;
+        if (&tex == exclude || !tex.image || tex.loading || tex.baseLevel >= tex.tailLevel ||
+                tex.lastUsed + STALE_FRAMES >= frame) {
+            continue;
+        }
+        if (!victim || tex.lastUsed < victim->lastUsed) {
+            victim = &tex;
+        }
+    }
+    if (!victim) {
+        return false;
+    }
+    resize(cmd, *victim, victim->baseLevel + 1, {}, 0);
+    evictions++;
+    return true;
+}
+
+void LavaTextureStreamer::update(VkCommandBuffer cmd) noexcept {
+    LavaTextureStreamerImpl& impl = *upcast(this);
+    impl.frame++;
+    impl.uploadedBytes = 0;
+
+    // Destroy objects that are no longer referenced by any command buffer in flight.
+    auto& graveyard = impl.graveyard;
+    auto expired = [&impl](const Retired& retired) {
+        if (retired.frame + FRAMES_IN_FLIGHT > impl.frame) {
+            return false;
+        }
+        if (retired.staging.buffer) {
+            untrackAllocation(impl.vma, retired.staging.memory);
+            vmaDestroyBuffer(impl.vma, retired.staging.buffer, retired.staging.memory);
+        }
+        if (retired.image) {
+            vkDestroyImageView(impl.device, retired.view, VKALLOC);
+            untrackAllocation(impl.vma, retired.memory);
+            vmaDestroyImage(impl.vma, retired.image, retired.memory);
+        }
+        return true;
+    };
+    graveyard.erase(remove_if(graveyard.begin(), graveyard.end(), expired), graveyard.end());
+
+    // Upload the tails of newly added textures. These are small, so they ignore the budget.
+    for (auto& pair : impl.textures) {
+        Texture& tex = pair.second;
+        if (tex.tail.buffer) {
+            const uint32_t nlevels = tex.source.mipLevels - tex.tailLevel;
+            impl.resize(cmd, tex, tex.tailLevel, tex.tail, nlevels);
+            impl.uploadedBytes += getResidentSize(tex);
+            tex.tail = {};
+        }
+    }
+
+    // Copy finished loads into their textures until the upload budget is exhausted. At least one
+    // level is always uploaded so that large levels cannot stall forever.
+    {
+        lock_guard<mutex> lock(impl.queueMutex);
+        impl.ready.insert(impl.ready.end(), impl.results.begin(), impl.results.end());
+        impl.results.clear();
+    }
+    while (!impl.ready.empty()) {
+        const LoadResult result = impl.ready.front();
+        auto iter = impl.textures.find(result.id);
+        if (iter != impl.textures.end()) {
+            if (impl.uploadedBytes > 0 && impl.uploadedBytes + result.size > impl.uploadBudget) {
+                break;
+            }
+            Texture& tex = iter->second;
+            tex.loading = false;
+            impl.resize(cmd, tex, result.level, result.staging, 1);
+            impl.uploadedBytes += result.size;
+        } else {
+            impl.retire(VK_NULL_HANDLE, VK_NULL_HANDLE, VK_NULL_HANDLE, result.staging);
+        }
+        impl.pendingBytes -= result.size;
+        impl.pendingLoads--;
+        impl.ready.pop_front();
+    }
+
+    // Enforce the memory cap, e.g. after adding many textures.
+    while (impl.residentBytes > impl.memoryBudget && impl.evictOne(cmd, nullptr)) {}
+
+    // Request the next level for recently used textures, evicting stale levels to make room.
+    vector<LoadRequest> requests;
+    for (auto& pair : impl.textures) {
+        if (impl.pendingLoads >= MAX_PENDING_LOADS) {
+            break;
+        }
+        Texture& tex = pair.second;
+        if (!tex.image || tex.loading || tex.baseLevel == 0 ||
+                tex.lastUsed + STALE_FRAMES < impl.frame) {
+            continue;
+        }
+        const uint32_t level = tex.baseLevel - 1;
+        const uint32_t size = getLevelSize(tex.source, level);
+        auto fits = [&impl, size] {
+            return impl.residentBytes + impl.pendingBytes + size <= impl.memoryBudget;
+        };
+        while (!fits() && impl.evictOne(cmd, &tex)) {}
+        if (!fits()) {
+            continue;
+        }
+        tex.loading = true;
+        impl.pendingBytes += size;
+        impl.pendingLoads++;
+        requests.push_back({pair.first, level, size, tex.source.load});
+    }
+    if (!requests.empty()) {
+        lock_guard<mutex> lock(impl.queueMutex);
+        impl.requests.insert(impl.requests.end(), requests.begin(), requests.end());
+        impl.queueCondition.notify_one();
+    }
+}
+
+VkImageView LavaTextureStreamer::getImageView(uint32_t id) const noexcept {
+    auto& textures = upcast(this)->textures;
+    auto iter = textures.find(id);
+    return iter == textures.end() ? VK_NULL_HANDLE : iter->second.view;
+}
+
+uint32_t LavaTextureStreamer::getResidentLevel(uint32_t id) const noexcept {
+    auto& textures = upcast(this)->textures;
+    auto iter = textures.find(id);
+    return iter == textures.end() ? 0 : iter->second.baseLevel;
+}
+
+LavaTextureStreamer::Stats LavaTextureStreamer::getStats() const noexcept {
+    auto& impl = *upcast(this);
+    return {
+        .residentBytes = impl.residentBytes,
+        .uploadedBytes = impl.uploadedBytes,
+        .pendingLoads = impl.pendingLoads,
+        .evictions = impl.evictions,
+    };
+}
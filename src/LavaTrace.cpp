@@ -0,0 +1,170 @@
+// The MIT License
+// Copyright (c) 2018 Philip Rideout
+
+#include <par/LavaLog.h>
+#include <par/LavaTrace.h>
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <stdio.h>
+#include <unistd.h>
+
+using namespace par;
+using namespace std;
+
+namespace {
+
+// Each thread acquires a buffer when it records its first event, and returns it to a free list
+// when it exits, so that short-lived worker threads do not accumulate buffers.
+constexpr uint32_t EVENTS_PER_THREAD = 1 << 16;
+
+struct Event {
+    char const* name;
+    uint64_t begin;
+    uint64_t end;
+};
+
+// Only the owning thread writes to a buffer. The count is published with release semantics, so
+// the exporter can read every event below it without locking. Rather than having start() reset
+// the count of another thread's buffer, each buffer remembers the session that it belongs to and
+// the owner resets itself when it notices a new session.
+struct ThreadBuffer {
+    uint32_t threadIndex;
+    atomic<uint32_t> session {0};
+    atomic<uint32_t> count {0};
+    unique_ptr<Event[]> events {new Event[EVENTS_PER_THREAD]};
+};
+
+atomic<bool> gRecording {false};
+atomic<uint32_t> gSession {0};
+atomic<uint64_t> gDropped {0};
+
+// Guards the list of buffers and the free list, which are only modified when a thread records its
+// first event or exits. Buffers are never destroyed, since the exporter may still need the events
+// of threads that have exited. A reused buffer keeps its events and its thread index, which is
+// harmless because the previous owner's events all precede the new owner's.
+mutex gBuffersMutex;
+vector<unique_ptr<ThreadBuffer>> gBuffers;
+vector<ThreadBuffer*> gFreeBuffers;
+
+struct ThreadBufferHolder {
+    ThreadBuffer* buffer = nullptr;
+    ~ThreadBufferHolder() {
+        if (buffer) {
+            lock_guard<mutex> lock(gBuffersMutex);
+            gFreeBuffers.push_back(buffer);
+        }
+    }
+};
+
+thread_local ThreadBufferHolder tHolder;
+
+ThreadBuffer* getThreadBuffer() {
+    if (!tHolder.buffer) {
+        lock_guard<mutex> lock(gBuffersMutex);
+        if (!gFreeBuffers.empty()) {
+            tHolder.buffer = gFreeBuffers.back();
+            gFreeBuffers.pop_back();
+        } else {
+            gBuffers.emplace_back(new ThreadBuffer);
+            tHolder.buffer = gBuffers.back().get();
+            tHolder.buffer->threadIndex = (uint32_t) gBuffers.size();
+        }
+    }
+    return tHolder.buffer;
+}
+
+void writeString(FILE* file, char const* str) {
+    fputc('"', file);
+    for (; *str; ++str) {
+        if (*str == '"' || *str == '\\') {
+            fputc('\\', file);
+        }
+        fputc(*str, file);
+    }
+    fputc('"', file);
+}
+
+}
+
+void LavaTrace::start() noexcept {
+    gSession++;
+    gDropped = 0;
+    gRecording = true;
+}
+
+void LavaTrace::stop() noexcept {
+    gRecording = false;
+}
+
+bool LavaTrace::isRecording() noexcept {
+    return gRecording.load(memory_order_relaxed);
+}
+
+uint64_t LavaTrace::getTime() noexcept {
+    const auto now = chrono::steady_clock::now().time_since_epoch();
+    return chrono::duration_cast<chrono::nanoseconds>(now).count();
+}
+
+uint64_t LavaTrace::getDroppedCount() noexcept {
+    return gDropped;
+}
+
+void LavaTrace::record(char const* name, uint64_t begin, uint64_t end) noexcept {
+    if (!gRecording.load(memory_order_relaxed)) {
+        return;
+    }
+    ThreadBuffer* buffer = getThreadBuffer();
+    const uint32_t session = gSession.load(memory_order_relaxed);
+    if (buffer->session.load(memory_order_relaxed) != session) {
+        buffer->count.store(0, memory_order_relaxed);
+        buffer->session.store(session, memory_order_release);
+    }
+    const uint32_t index = buffer->count.load(memory_order_relaxed);
+    if (index == EVENTS_PER_THREAD) {
+        gDropped++;
+        return;
+    }
+    buffer->events[index] = {name, begin, end};
+    buffer->count.store(index + 1, memory_order_release);
+}
+
+bool LavaTrace::write(const string& path) noexcept {
+    FILE* file = fopen(path.c_str(), "w");
+    if (!file) {
+        llog.error("Unable to write {}", path);
+        return false;
+    }
+    const uint32_t session = gSession.load();
+    const int pid = getpid();
+    size_t nevents = 0;
+    fprintf(file, "{\"traceEvents\":[");
+    lock_guard<mutex> lock(gBuffersMutex);
+    for (const auto& buffer : gBuffers) {
+        if (buffer->session.load(memory_order_acquire) != session) {
+            continue;
+        }
+        const uint32_t count = buffer->count.load(memory_order_acquire);
+        for (uint32_t i = 0; i < count; i++) {
+            const Event& event = buffer->events[i];
+            fprintf(file, "%s\n{\"name\":", nevents++ ? "," : "");
+            writeString(file, event.name);
+            fprintf(file, ",\"ph\":\"X\",\"pid\":%d,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}", pid,
+                    buffer->threadIndex, event.begin / 1000.0, (event.end - event.begin) / 1000.0);
+        }
+    }
+    fprintf(file, "\n]}\n");
+    if (fclose(file) != 0) {
+        llog.error("Unable to write {}", path);
+        return false;
+    }
+    llog.info("Wrote {} trace events to {}", nevents, path);
+    if (gDropped > 0) {
+        llog.warn("Dropped {} trace events.", gDropped.load());
+    }
+    return true;
+}
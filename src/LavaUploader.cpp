@@ -0,0 +1,389 @@
+// The MIT License
+// Copyright (c) 2018 Philip Rideout
+
+#include <par/LavaLoader.h>
+#include <par/LavaUploader.h>
+#include <par/LavaLog.h>
+
+#include <algorithm>
+#include <deque>
+#include <vector>
+
+#include "LavaInternal.h"
+
+using namespace par;
+using namespace std;
+
+namespace {
+
+constexpr uint32_t DEFAULT_CAPACITY = 16 * 1024 * 1024;
+
+// Satisfies the alignment rules for bufferOffset in VkBufferImageCopy (a multiple of 4 and of the
+// texel size) for every format up to 16 bytes per texel, except for the 3-component 32-bit formats.
+constexpr uint32_t STAGING_ALIGNMENT = 16;
+
+// Access and stage masks for the consumers of uploaded data.
+constexpr VkAccessFlags DST_ACCESS = VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT |
+        VK_ACCESS_INDEX_READ_BIT | VK_ACCESS_UNIFORM_READ_BIT | VK_ACCESS_SHADER_READ_BIT;
+constexpr VkPipelineStageFlags DST_STAGES = VK_PIPELINE_STAGE_VERTEX_INPUT_BIT |
+        VK_PIPELINE_STAGE_VERTEX_SHADER_BIT | VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT |
+        VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+
+struct PendingBuffer {
+    VkBuffer src;
+    VkBuffer dst;
+    VkBufferCopy region;
+};
+
+struct PendingImage {
+    VkBuffer src;
+    VkImage dst;
+    VkBufferImageCopy region;
+    VkImageLayout finalLayout;
+};
+
+struct Dedicated {
+    VkBuffer buffer;
+    VmaAllocation memory;
+};
+
+struct Submission {
+    VkCommandBuffer cmd;
+    VkFence fence;
+    uint32_t bytes;
+    vector<Dedicated> dedicated;
+};
+
+struct LavaUploaderImpl : LavaUploader {
+    LavaUploaderImpl(Config config) noexcept;
+    ~LavaUploaderImpl() noexcept;
+    VkBuffer stage(void const* source, uint32_t size, VkDeviceSize* offset) noexcept;
+    bool allocate(uint32_t size, VkDeviceSize* offset) noexcept;
+    void retire(bool wait) noexcept;
+    VkDevice device;
+    VkQueue queue;
+    VmaAllocator vma;
+    VkCommandPool pool;
+    VkBuffer buffer;
+    VmaAllocation memory;
+    uint8_t* mapped;
+    uint32_t capacity;
+
+    // The arena is a FIFO ring; the tail is implicitly at (head - used), modulo capacity.
+    uint32_t head = 0;
+    uint32_t used = 0;
+    uint32_t batchBytes = 0;
+
+    vector<PendingBuffer> pendingBuffers;
+    vector<PendingImage> pendingImages;
+    vector<Dedicated> pendingDedicated;
+    deque<Submission> inflight;
+    vector<Submission> freeSubmissions;
+};
+
+LAVA_DEFINE_UPCAST(LavaUploader)
+
+}
+
+LavaUploader* LavaUploader::create(Config config) noexcept {
+    return new LavaUploaderImpl(config);
+}
+
+void LavaUploader::operator delete(void* ptr) {
+    auto impl = (LavaUploaderImpl*) ptr;
+    ::delete impl;
+}
+
+LavaUploaderImpl::LavaUploaderImpl(Config config) noexcept : device(config.device),
+        queue(config.queue) {
+    assert(config.device && config.gpu && config.queue);
+    vma = getVma(config.device, config.gpu);
+    capacity = config.capacity ? config.capacity : DEFAULT_CAPACITY;
+    VkCommandPoolCreateInfo poolInfo {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+        .flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT |
+                VK_COMMAND_POOL_CREATE_TRANSIENT_BIT,
+        .queueFamilyIndex = config.queueFamilyIndex,
+    };
+    vkCreateCommandPool(device, &poolInfo, VKALLOC, &pool);
+
+    // VMA guarantees that CPU_ONLY memory is host-coherent, so writes to the arena never need to
+    // be flushed.
+    VkBufferCreateInfo bufferInfo {
+        .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+        .size = capacity,
+        .usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT
+    };
+    VmaAllocationCreateInfo allocInfo {
+        .flags = VMA_ALLOCATION_CREATE_MAPPED_BIT,
+        .usage = VMA_MEMORY_USAGE_CPU_ONLY
+    };
+    VmaAllocationInfo info;
+    vmaCreateBuffer(vma, &bufferInfo, &allocInfo, &buffer, &memory, &info);
+    trackAllocation(vma, memory, MEMORY_STAGING);
+    mapped = (uint8_t*) info.pMappedData;
+}
+
+LavaUploaderImpl::~LavaUploaderImpl() noexcept {
+    finish();
+    for (auto& sub : freeSubmissions) {
+        vkFreeCommandBuffers(device, pool, 1, &sub.cmd);
+        vkDestroyFence(device, sub.fence, VKALLOC);
+    }
+    vkDestroyCommandPool(device, pool, VKALLOC);
+    untrackAllocation(vma, memory);
+    vmaDestroyBuffer(vma, buffer, memory);
+}
+
+// Reserves a range in the arena, returning false if the ring does not currently have room.
+bool LavaUploaderImpl::allocate(uint32_t size, VkDeviceSize* offset) noexcept {
+    if (used == 0) {
+        head = 0;
+    }
+    const uint32_t mask = STAGING_ALIGNMENT - 1;
+    uint32_t start = (head + mask) & ~mask;
+    uint32_t padding = start - head;
+    if (start + size > capacity) {
+        padding = capacity - head;
+        start = 0;
+    }
+    if (used + padding + size > capacity) {
+        return false;
+    }
+    head = start + size;
+    used += padding + size;
+    batchBytes += padding + size;
+    *offset = start;
+    return true;
+}
+
+// Copies the given data into staging memory and returns the buffer that it lives in.
+VkBuffer LavaUploaderImpl::stage(void const* source, uint32_t size, VkDeviceSize* offset) noexcept {
+    if (size > capacity) {
+        llog.debug("LavaUploader: dedicated staging buffer for {} bytes.", size);
+        VkBufferCreateInfo bufferInfo {
+            .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+            .size = size,
+            .usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT
+        };
+        VmaAllocationCreateInfo allocInfo {
+            .flags = VMA_ALLOCATION_CREATE_MAPPED_BIT,
+            .usage = VMA_MEMORY_USAGE_CPU_ONLY
+        };
+        VmaAllocationInfo info;
+        Dedicated ded;
+        vmaCreateBuffer(vma, &bufferInfo, &allocInfo, &ded.buffer, &ded.memory, &info);
+        trackAllocation(vma, ded.memory, MEMORY_STAGING);
+        memcpy(info.pMappedData, source, size);
+        pendingDedicated.push_back(ded);
+        *offset = 0;
+        return ded.buffer;
+    }
+    while (!allocate(size, offset)) {
+        retire(false);
+        if (allocate(size, offset)) {
+            break;
+        }
+        if (getPendingCount() > 0) {
+            flush();
+        }
+        LOG_CHECK(!inflight.empty(), "LavaUploader arena is inconsistent.");
+        retire(true);
+    }
+    memcpy(mapped + *offset, source, size);
+    return buffer;
+}
+
+// Recycles the submissions whose fences have signaled. If "wait" is true, blocks until at least the
+// oldest submission has finished.
+void LavaUploaderImpl::retire(bool wait) noexcept {
+    while (!inflight.empty()) {
+        Submission& sub = inflight.front();
+        if (wait) {
+            vkWaitForFences(device, 1, &sub.fence, VK_TRUE, ~0ull);
+            wait = false;
+        } else if (vkGetFenceStatus(device, sub.fence) != VK_SUCCESS) {
+            break;
+        }
+        used -= sub.bytes;
+        for (auto ded : sub.dedicated) {
+            untrackAllocation(vma, ded.memory);
+            vmaDestroyBuffer(vma, ded.buffer, ded.memory);
+        }
+        sub.dedicated.clear();
+        freeSubmissions.emplace_back(move(sub));
+        inflight.pop_front();
+    }
+}
+
+void LavaUploader::upload(const BufferUpload& upload) noexcept {
+    auto impl = upcast(this);
+    assert(upload.buffer && upload.source && upload.size > 0);
+    VkDeviceSize offset;
+    VkBuffer src = impl->stage(upload.source, upload.size, &offset);
+    impl->pendingBuffers.push_back({
+        .src = src,
+        .dst = upload.buffer,
+        .region = {
+            .srcOffset = offset,
+            .dstOffset = upload.offset,
+            .size = upload.size
+        }
+    });
+}
+
+void LavaUploader::upload(const ImageUpload& upload) noexcept {
+    auto impl = upcast(this);
+    assert(upload.image && upload.source && upload.size > 0);
+    VkDeviceSize offset;
+    VkBuffer src = impl->stage(upload.source, upload.size, &offset);
+    VkExtent3D extent = upload.extent;
+    extent.depth = extent.depth ? extent.depth : 1;
+    impl->pendingImages.push_back({
+        .src = src,
+        .dst = upload.image,
+        .region = {
+            .bufferOffset = offset,
+            .imageSubresource = {
+                .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+                .mipLevel = upload.mipLevel,
+                .baseArrayLayer = upload.baseArrayLayer,
+                .layerCount = upload.layerCount ? upload.layerCount : 1
+            },
+            .imageExtent = extent
+        },
+        .finalLayout = upload.finalLayout ? upload.finalLayout :
+                VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL
+    });
+}
+
+void LavaUploader::flush() noexcept {
+    auto impl = upcast(this);
+    if (getPendingCount() == 0) {
+        return;
+    }
+
+    // Obtain a command buffer and fence, recycling them from a previous submission if possible.
+    impl->retire(false);
+    Submission sub;
+    if (impl->freeSubmissions.empty()) {
+        VkCommandBufferAllocateInfo allocInfo {
+            .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+            .commandPool = impl->pool,
+            .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+            .commandBufferCount = 1
+        };
+        vkAllocateCommandBuffers(impl->device, &allocInfo, &sub.cmd);
+        VkFenceCreateInfo fenceInfo { .sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO };
+        vkCreateFence(impl->device, &fenceInfo, VKALLOC, &sub.fence);
+    } else {
+        sub = move(impl->freeSubmissions.back());
+        impl->freeSubmissions.pop_back();
+        vkResetFences(impl->device, 1, &sub.fence);
+        vkResetCommandBuffer(sub.cmd, 0);
+    }
+    sub.bytes = impl->batchBytes;
+    sub.dedicated.swap(impl->pendingDedicated);
+    impl->batchBytes = 0;
+
+    VkCommandBuffer cmd = sub.cmd;
+    VkCommandBufferBeginInfo beginInfo {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+        .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT
+    };
+    vkBeginCommandBuffer(cmd, &beginInfo);
+
+    // Transition every destination subresource to TRANSFER_DST in a single barrier batch.
+    auto& images = impl->pendingImages;
+    vector<VkImageMemoryBarrier> barriers;
+    barriers.reserve(images.size());
+    for (const auto& pending : images) {
+        const VkImageSubresourceLayers& layers = pending.region.imageSubresource;
+        barriers.push_back({
+            .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+            .image = pending.dst,
+            .oldLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+            .newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+            .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+            .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+            .subresourceRange = {
+                .aspectMask = layers.aspectMask,
+                .baseMipLevel = layers.mipLevel,
+                .levelCount = 1,
+                .baseArrayLayer = layers.baseArrayLayer,
+                .layerCount = layers.layerCount
+            },
+            .srcAccessMask = 0,
+            .dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT
+        });
+    }
+    if (!barriers.empty()) {
+        vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr,
+                (uint32_t) barriers.size(), barriers.data());
+    }
+
+    // Coalesce copies that share a source and destination into a single command.
+    auto& buffers = impl->pendingBuffers;
+    stable_sort(buffers.begin(), buffers.end(), [](const PendingBuffer& a, const PendingBuffer& b) {
+        return a.src != b.src ? a.src < b.src : a.dst < b.dst;
+    });
+    vector<VkBufferCopy> bufferRegions;
+    for (size_t i = 0; i < buffers.size();) {
+        size_t j = i;
+        bufferRegions.clear();
+        for (; j < buffers.size() && buffers[j].src == buffers[i].src &&
+                buffers[j].dst == buffers[i].dst; j++) {
+            bufferRegions.push_back(buffers[j].region);
+        }
+        vkCmdCopyBuffer(cmd, buffers[i].src, buffers[i].dst, (uint32_t) bufferRegions.size(),
+                bufferRegions.data());
+        i = j;
+    }
+    for (const auto& pending : images) {
+        vkCmdCopyBufferToImage(cmd, pending.src, pending.dst, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                1, &pending.region);
+    }
+
+    // Make the transfers visible to subsequent reads and move images to their final layouts.
+    for (size_t i = 0; i < images.size(); i++) {
+        barriers[i].oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+        barriers[i].newLayout = images[i].finalLayout;
+        barriers[i].srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        barriers[i].dstAccessMask = DST_ACCESS;
+    }
+    VkMemoryBarrier memoryBarrier {
+        .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+        .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+        .dstAccessMask = DST_ACCESS
+    };
+    const uint32_t nmemory = buffers.empty() ? 0 : 1;
+    vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, DST_STAGES, 0, nmemory,
+            &memoryBarrier, 0, nullptr, (uint32_t) barriers.size(), barriers.data());
+    vkEndCommandBuffer(cmd);
+
+    VkSubmitInfo submitInfo {
+        .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+        .commandBufferCount = 1,
+        .pCommandBuffers = &cmd
+    };
+    vkQueueSubmit(impl->queue, 1, &submitInfo, sub.fence);
+    llog.debug("LavaUploader: submitted {} buffer and {} image transfers.", buffers.size(),
+            images.size());
+    buffers.clear();
+    images.clear();
+    impl->inflight.emplace_back(move(sub));
+}
+
+void LavaUploader::finish() noexcept {
+    auto impl = upcast(this);
+    flush();
+    while (!impl->inflight.empty()) {
+        impl->retire(true);
+    }
+}
+
+uint32_t LavaUploader::getPendingCount() const noexcept {
+    auto impl = upcast(this);
+    return (uint32_t) (impl->pendingBuffers.size() + impl->pendingImages.size());
+}